@@ -0,0 +1,249 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Connected components of a grid (periodic boundaries, 6-connectivity)
+// and finding blobs of density above a cutoff.
+
+#ifndef GEMMI_BLOB_HPP_
+#define GEMMI_BLOB_HPP_
+
+#include <algorithm>     // for min
+#include <vector>
+#include "grid.hpp"      // for Grid
+#include "parallel.hpp"  // for parallel_for
+
+namespace gemmi {
+
+namespace impl {
+inline int uf_find(std::vector<int>& parent, int i) {
+  while (parent[i] != i) {
+    parent[i] = parent[parent[i]];  // path halving
+    i = parent[i];
+  }
+  return i;
+}
+
+// the smaller index becomes the root, so the final root of each set
+// is its smallest element, regardless of the order of unions
+inline void uf_union(std::vector<int>& parent, int a, int b) {
+  a = uf_find(parent, a);
+  b = uf_find(parent, b);
+  if (a < b)
+    parent[b] = a;
+  else if (b < a)
+    parent[a] = b;
+}
+} // namespace impl
+
+// Labels 6-connected regions of grid points for which in_region(value)
+// is true, treating the grid as periodic. Returns a vector with label
+// (from 0 to n-1) for each point, or -1 for points outside of the regions.
+// Labels are numbered in the order of the first point of each region,
+// so they do not depend on n_threads.
+//
+// The grid is split into slabs along w. Each slab is labelled by a separate
+// thread using union-find, then the slabs are joined in a serial pass.
+template<typename T, typename Pred>
+std::vector<int> label_connected_components(const Grid<T>& grid,
+                                            Pred in_region, int n_threads=0,
+                                            int* n_labels=nullptr) {
+  const int nu = grid.nu, nv = grid.nv, nw = grid.nw;
+  const int uv = nu * nv;
+  std::vector<int> parent(grid.data.size());
+  if (n_threads <= 0)
+    n_threads = default_thread_count();
+  const int n_slabs = std::max(1, std::min(n_threads, nw));
+  auto slab_begin = [&](int n) { return int((long) nw * n / n_slabs); };
+
+  parallel_for(n_slabs, n_threads, [&](size_t slab) {
+    int w_begin = slab_begin((int) slab);
+    int w_end = slab_begin((int) slab + 1);
+    for (int w = w_begin; w != w_end; ++w)
+      for (int v = 0, idx = w * uv; v != nv; ++v)
+        for (int u = 0; u != nu; ++u, ++idx) {
+          if (!in_region(grid.data[idx])) {
+            parent[idx] = -1;
+            continue;
+          }
+          parent[idx] = idx;
+          if (u != 0 && parent[idx-1] >= 0)
+            impl::uf_union(parent, idx, idx-1);
+          if (v != 0 && parent[idx-nu] >= 0)
+            impl::uf_union(parent, idx, idx-nu);
+          if (w != w_begin && parent[idx-uv] >= 0)
+            impl::uf_union(parent, idx, idx-uv);
+        }
+    // periodic boundaries along u and v
+    for (int w = w_begin; w != w_end; ++w)
+      for (int v = 0; v != nv; ++v) {
+        int idx = w * uv + v * nu;
+        if (parent[idx] >= 0 && parent[idx + nu - 1] >= 0)
+          impl::uf_union(parent, idx, idx + nu - 1);
+      }
+    for (int w = w_begin; w != w_end; ++w)
+      for (int u = 0; u != nu; ++u) {
+        int idx = w * uv + u;
+        if (parent[idx] >= 0 && parent[idx + uv - nu] >= 0)
+          impl::uf_union(parent, idx, idx + uv - nu);
+      }
+  });
+
+  // join slabs (and the periodic boundary along w)
+  if (nw > 1)
+    for (int slab = 0; slab != n_slabs; ++slab) {
+      int w = slab_begin(slab);
+      int prev_w = (w == 0 ? nw : w) - 1;
+      for (int i = 0; i != uv; ++i)
+        if (parent[w * uv + i] >= 0 && parent[prev_w * uv + i] >= 0)
+          impl::uf_union(parent, w * uv + i, prev_w * uv + i);
+    }
+
+  // find roots (parent is only read here, so it can be done in parallel),
+  // then replace roots with consecutive labels
+  std::vector<int> labels(parent.size());
+  parallel_for(parent.size(), n_threads, [&](size_t idx) {
+    int i = parent[idx];
+    if (i >= 0)
+      while (parent[i] != i)
+        i = parent[i];
+    labels[idx] = i;
+  }, 1 << 16);
+  // the root is the first point of its region, so it is relabelled
+  // before other points are visited
+  int count = 0;
+  for (int idx = 0; idx != (int) labels.size(); ++idx) {
+    int root = labels[idx];
+    if (root < 0)
+      continue;
+    labels[idx] = root == idx ? count++ : labels[root];
+  }
+  if (n_labels)
+    *n_labels = count;
+  return labels;
+}
+
+// Returns a vector that maps each label to the smallest label of regions
+// related to it by the space group symmetry. The grid values must be
+// symmetric (otherwise symmetry mates would not be labelled consistently).
+template<typename T>
+std::vector<int> find_symmetry_equivalent_labels(const Grid<T>& grid,
+                                                 const std::vector<int>& labels,
+                                                 int n_labels) {
+  std::vector<int> parent(n_labels);
+  for (int i = 0; i != n_labels; ++i)
+    parent[i] = i;
+  if (!grid.spacegroup || !grid.full_canonical)
+    return parent;
+  std::vector<GridOp> ops = grid.get_scaled_ops_except_id();
+  if (ops.empty())
+    return parent;
+  // a region is mapped by each symmetry operation onto one region,
+  // so it is enough to check one point (the first one) of each region
+  std::vector<bool> seen(n_labels, false);
+  int idx = 0;
+  for (int w = 0; w != grid.nw; ++w)
+    for (int v = 0; v != grid.nv; ++v)
+      for (int u = 0; u != grid.nu; ++u, ++idx) {
+        int label = labels[idx];
+        if (label < 0 || seen[label])
+          continue;
+        seen[label] = true;
+        for (const GridOp& op : ops) {
+          std::array<int, 3> t = op.apply(u, v, w);
+          int mate = labels[grid.index_s(t[0], t[1], t[2])];
+          if (mate >= 0)
+            impl::uf_union(parent, label, mate);
+        }
+      }
+  for (int i = 0; i != n_labels; ++i)
+    parent[i] = impl::uf_find(parent, i);
+  return parent;
+}
+
+struct Blob {
+  double volume = 0.0;
+  double score = 0.0;
+  double peak_value = 0.0;
+  int point_count = 0;
+  Position pos;  // centroid weighted by density
+  int label = -1;  // label from label_connected_components()
+  explicit operator bool() const { return point_count != 0; }
+};
+
+struct BlobCriteria {
+  double min_volume = 10.0;
+  double min_score = 15.0;
+  double min_peak = 0.0;
+  double cutoff;
+};
+
+// Finds blobs of points with values above criteria.cutoff. Symmetry mates
+// are not reported separately: only one region from each set of
+// symmetry-related regions is used.
+inline std::vector<Blob> find_blobs(const Grid<float>& grid,
+                                    const BlobCriteria& criteria,
+                                    int n_threads=0) {
+  int n_labels = 0;
+  double cutoff = criteria.cutoff;
+  std::vector<int> labels = label_connected_components(
+      grid, [cutoff](float x) { return x > cutoff; }, n_threads, &n_labels);
+  std::vector<int> equiv = find_symmetry_equivalent_labels(grid, labels,
+                                                           n_labels);
+  struct Sum {
+    int u0, v0, w0;  // the first point, to unwrap periodic boundaries
+    double u = 0., v = 0., w = 0.;
+  };
+  std::vector<Blob> blobs(n_labels);
+  std::vector<Sum> sums(n_labels);
+  int idx = 0;
+  for (int w = 0; w != grid.nw; ++w)
+    for (int v = 0; v != grid.nv; ++v)
+      for (int u = 0; u != grid.nu; ++u, ++idx) {
+        int label = labels[idx];
+        if (label < 0 || equiv[label] != label)
+          continue;
+        Blob& blob = blobs[label];
+        Sum& sum = sums[label];
+        if (blob.point_count == 0) {
+          blob.label = label;
+          sum.u0 = u;
+          sum.v0 = v;
+          sum.w0 = w;
+        }
+        double value = grid.data[idx];
+        ++blob.point_count;
+        blob.score += value;
+        if (value > blob.peak_value)
+          blob.peak_value = value;
+        auto unwrap = [](int d, int n) {
+          return d > n / 2 ? d - n : d < -n / 2 ? d + n : d;
+        };
+        sum.u += unwrap(u - sum.u0, grid.nu) * value;
+        sum.v += unwrap(v - sum.v0, grid.nv) * value;
+        sum.w += unwrap(w - sum.w0, grid.nw) * value;
+      }
+  double volume_per_point = grid.unit_cell.volume / grid.point_count();
+  std::vector<Blob> result;
+  for (int label = 0; label != n_labels; ++label) {
+    Blob& blob = blobs[label];
+    if (!blob)
+      continue;
+    const Sum& sum = sums[label];
+    blob.volume = blob.point_count * volume_per_point;
+    if (blob.point_count < 3 || blob.volume < criteria.min_volume ||
+        blob.peak_value < criteria.min_peak)
+      continue;
+    double sum_mult = 1.0 / blob.score;
+    blob.score *= volume_per_point;
+    if (blob.score < criteria.min_score)
+      continue;
+    Fractional fract((sum.u0 + sum_mult * sum.u) / grid.nu,
+                     (sum.v0 + sum_mult * sum.v) / grid.nv,
+                     (sum.w0 + sum_mult * sum.w) / grid.nw);
+    blob.pos = grid.unit_cell.orthogonalize(fract);
+    result.push_back(blob);
+  }
+  return result;
+}
+
+} // namespace gemmi
+#endif
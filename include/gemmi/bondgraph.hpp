@@ -0,0 +1,152 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Bond perception from covalent radii, for coordinates without restraints
+// (small molecules, ligands). Uses SubCells, so bonds to symmetry images
+// are also found. The result is a graph in the compressed
+// sparse row (CSR) format.
+
+#ifndef GEMMI_BONDGRAPH_HPP_
+#define GEMMI_BONDGRAPH_HPP_
+
+#include <algorithm>     // for max
+#include <cctype>        // for isalpha, islower
+#include <cmath>         // for sqrt
+#include <string>
+#include <vector>
+#include "subcells.hpp"  // for SubCells
+#include "elem.hpp"      // for covalent_radius
+#include "smcif.hpp"     // for AtomicStructure
+#include "parallel.hpp"  // for parallel_for
+
+namespace gemmi {
+
+struct BondGraph {
+  // position of the atom in Model
+  struct AtomIndex {
+    int chain_idx;
+    int residue_idx;
+    int atom_idx;
+  };
+  struct Bond {
+    int atom;       // index in atoms
+    int image_idx;  // 0 = the same unit, n > 0 = cell.images[n-1]
+    float dist;
+  };
+  // all atoms of the model, in the usual order
+  std::vector<AtomIndex> atoms;
+  // bonds of atom n are bonds[offsets[n]] ... bonds[offsets[n+1]-1];
+  // each bond is listed for both atoms
+  std::vector<int> offsets;
+  std::vector<Bond> bonds;
+
+  int atom_count() const { return (int) atoms.size(); }
+  int degree(int n) const { return offsets[n+1] - offsets[n]; }
+  const Bond* begin_of(int n) const { return bonds.data() + offsets[n]; }
+  const Bond* end_of(int n) const { return bonds.data() + offsets[n+1]; }
+  size_t bond_count() const { return bonds.size() / 2; }
+};
+
+// Atoms are bonded if their distance is below
+//   cov_mult * (covalent_r1 + covalent_r2) + cov_tol.
+// Hydrogens are included, the same atoms in different conformers are not
+// bonded. n_threads <= 0 means default_thread_count().
+inline BondGraph find_covalent_bonds(const Model& model, const UnitCell& cell,
+                                     float cov_tol=0.4f, float cov_mult=1.0f,
+                                     int n_threads=0) {
+  BondGraph graph;
+  // first atom of each residue, to convert AtomIndex to a single index
+  std::vector<std::vector<int>> first_atom(model.chains.size());
+  float max_r = 0.f;
+  for (int n_ch = 0; n_ch != (int) model.chains.size(); ++n_ch) {
+    const Chain& chain = model.chains[n_ch];
+    for (int n_res = 0; n_res != (int) chain.residues.size(); ++n_res) {
+      first_atom[n_ch].push_back(graph.atom_count());
+      const Residue& res = chain.residues[n_res];
+      for (int n_atom = 0; n_atom != (int) res.atoms.size(); ++n_atom) {
+        graph.atoms.push_back({n_ch, n_res, n_atom});
+        max_r = std::max(max_r, res.atoms[n_atom].element.covalent_r());
+      }
+    }
+  }
+  double max_dist = cov_mult * 2 * max_r + cov_tol;
+  SubCells sc(model, cell, std::max(max_dist, 1.0));
+  sc.populate();
+  const UnitCell& sc_cell = sc.grid.unit_cell;
+
+  std::vector<std::vector<BondGraph::Bond>> rows(graph.atoms.size());
+  parallel_for(graph.atoms.size(), n_threads, [&](size_t i) {
+    BondGraph::AtomIndex idx = graph.atoms[i];
+    const Atom& atom = model.chains[idx.chain_idx].residues[idx.residue_idx]
+                                                  .atoms[idx.atom_idx];
+    float d_part = cov_mult * atom.element.covalent_r() + cov_tol;
+    std::vector<BondGraph::Bond>& row = rows[i];
+    std::vector<Position> partner_pos;
+    sc.for_each(atom.pos, atom.altloc, (float) max_dist,
+                [&](const SubCells::Mark& m, float dist_sq) {
+      float limit = d_part + cov_mult * covalent_radius(m.element);
+      if (dist_sq > sq(limit))
+        return;
+      int partner = first_atom[m.chain_idx][m.residue_idx] + m.atom_idx;
+      // the atom itself, or its image if the atom is on special position
+      if (partner == (int) i && (m.image_idx == 0 || dist_sq < sq(0.8f)))
+        return;
+      // on special positions, a few images of the partner can overlap
+      Position pos = sc_cell.orthogonalize_in_pbc(atom.pos,
+                                          sc_cell.fractionalize(m.pos()));
+      for (size_t j = 0; j != row.size(); ++j)
+        if (row[j].atom == partner && pos.dist_sq(partner_pos[j]) < 0.01)
+          return;
+      row.push_back({partner, m.image_idx, std::sqrt(dist_sq)});
+      partner_pos.push_back(pos);
+    });
+  }, 256);
+  graph.offsets.reserve(rows.size() + 1);
+  graph.offsets.push_back(0);
+  for (std::vector<BondGraph::Bond>& row : rows) {
+    graph.bonds.insert(graph.bonds.end(), row.begin(), row.end());
+    graph.offsets.push_back((int) graph.bonds.size());
+  }
+  return graph;
+}
+
+namespace impl {
+// type_symbol can have a charge (O2-, Fe3+); if it is absent, the element
+// is guessed from the label (C12 -> C, Fe1 -> Fe).
+inline std::string element_symbol_of_site(const AtomicStructure::Site& site) {
+  const std::string& s = site.type_symbol.empty() ? site.label
+                                                  : site.type_symbol;
+  std::string symbol;
+  for (char c : s) {
+    if (!std::isalpha((unsigned char) c) || symbol.size() == 2 ||
+        (symbol.size() == 1 && site.type_symbol.empty() &&
+         !std::islower((unsigned char) c)))
+      break;
+    symbol += c;
+  }
+  return symbol;
+}
+} // namespace impl
+
+// Sites of AtomicStructure are atoms of a single residue,
+// so BondGraph::atoms[n] corresponds to sites[n].
+inline BondGraph find_covalent_bonds(const AtomicStructure& st,
+                                     float cov_tol=0.4f, float cov_mult=1.0f,
+                                     int n_threads=0) {
+  Model model("1");
+  model.chains.emplace_back("A");
+  model.chains[0].residues.emplace_back();
+  Residue& res = model.chains[0].residues[0];
+  res.atoms.reserve(st.sites.size());
+  for (const AtomicStructure::Site& site : st.sites) {
+    Atom atom;
+    atom.name = site.label;
+    atom.element = Element(impl::element_symbol_of_site(site));
+    atom.pos = st.cell.orthogonalize(site.fract);
+    atom.occ = site.occ;
+    res.atoms.push_back(atom);
+  }
+  return find_covalent_bonds(model, st.cell, cov_tol, cov_mult, n_threads);
+}
+
+} // namespace gemmi
+#endif
@@ -5,7 +5,10 @@
 #ifndef GEMMI_CALCULATE_HPP_
 #define GEMMI_CALCULATE_HPP_
 
+#include <algorithm>  // for max
 #include <array>
+#include <cmath>      // for sqrt
+#include "math.hpp"   // for Transform
 #include "model.hpp"
 
 namespace gemmi {
@@ -139,5 +142,152 @@ inline double get_distance_from_plane(const Position& pos,
   return coeff[0] * pos.x + coeff[1] * pos.y + coeff[2] * pos.z + coeff[3];
 }
 
+struct SupResult {
+  double rmsd;
+  size_t count;
+  Position center1;
+  Position center2;
+  Transform transform;  // moves positions 2 onto positions 1
+};
+
+namespace impl {
+// Jacobi eigenvalue algorithm for a symmetric 4x4 matrix. On return
+// the diagonal of a contains eigenvalues, columns of v - eigenvectors.
+inline void jacobi_eigen_sym4(double (&a)[4][4], double (&v)[4][4]) {
+  for (int i = 0; i != 4; ++i)
+    for (int j = 0; j != 4; ++j)
+      v[i][j] = i == j ? 1. : 0.;
+  for (int sweep = 0; sweep != 50; ++sweep) {
+    double off = 0.;
+    double diag = 0.;
+    for (int p = 0; p != 4; ++p) {
+      diag += std::fabs(a[p][p]);
+      for (int q = p + 1; q != 4; ++q)
+        off += std::fabs(a[p][q]);
+    }
+    if (off <= 1e-15 * diag)
+      return;
+    for (int p = 0; p != 3; ++p)
+      for (int q = p + 1; q != 4; ++q) {
+        if (a[p][q] == 0.)
+          continue;
+        double theta = (a[q][q] - a[p][p]) / (2 * a[p][q]);
+        double t = 1. / (std::fabs(theta) + std::sqrt(theta * theta + 1));
+        if (theta < 0)
+          t = -t;
+        double c = 1. / std::sqrt(t * t + 1);
+        double s = t * c;
+        for (int k = 0; k != 4; ++k) {
+          double akp = a[k][p], akq = a[k][q];
+          a[k][p] = c * akp - s * akq;
+          a[k][q] = s * akp + c * akq;
+        }
+        for (int k = 0; k != 4; ++k) {
+          double apk = a[p][k], aqk = a[q][k];
+          a[p][k] = c * apk - s * aqk;
+          a[q][k] = s * apk + c * aqk;
+        }
+        for (int k = 0; k != 4; ++k) {
+          double vkp = v[k][p], vkq = v[k][q];
+          v[k][p] = c * vkp - s * vkq;
+          v[k][q] = s * vkp + c * vkq;
+        }
+      }
+  }
+}
+
+inline Position weighted_center(const Position* pos, size_t len,
+                                const double* weight, double& total_weight) {
+  Vec3 sum;
+  total_weight = 0.;
+  for (size_t i = 0; i != len; ++i) {
+    double w = weight ? weight[i] : 1.;
+    sum += pos[i] * w;
+    total_weight += w;
+  }
+  return Position(sum / total_weight);
+}
+} // namespace impl
+
+// Root-mean-square deviation without superposition.
+inline double calculate_current_rmsd(const Position* pos1,
+                                     const Position* pos2, size_t len,
+                                     const double* weight=nullptr) {
+  double sum = 0.;
+  double total_weight = 0.;
+  for (size_t i = 0; i != len; ++i) {
+    double w = weight ? weight[i] : 1.;
+    sum += w * pos1[i].dist_sq(pos2[i]);
+    total_weight += w;
+  }
+  return std::sqrt(sum / total_weight);
+}
+
+// Optimal (least-squares) superposition of pos2 onto pos1, using the
+// quaternion method of B.K.P. Horn, J. Opt. Soc. Am. A 4, 629 (1987).
+// weight can be null (all weights equal 1).
+inline SupResult superpose_positions(const Position* pos1,
+                                     const Position* pos2, size_t len,
+                                     const double* weight=nullptr) {
+  SupResult r;
+  r.count = len;
+  r.rmsd = NAN;
+  if (len == 0)
+    return r;
+  double total_weight;
+  r.center1 = impl::weighted_center(pos1, len, weight, total_weight);
+  r.center2 = impl::weighted_center(pos2, len, weight, total_weight);
+  // correlation matrix s[i][j] = sum(w * b_i * a_j) of centered positions,
+  // a from pos1, b from pos2; g - sum of squared lengths of both
+  double s[3][3] = {{0., 0., 0.}, {0., 0., 0.}, {0., 0., 0.}};
+  double g = 0.;
+  for (size_t n = 0; n != len; ++n) {
+    double w = weight ? weight[n] : 1.;
+    Vec3 a = pos1[n] - r.center1;
+    Vec3 b = pos2[n] - r.center2;
+    Vec3 wb = b * w;
+    s[0][0] += wb.x * a.x;
+    s[0][1] += wb.x * a.y;
+    s[0][2] += wb.x * a.z;
+    s[1][0] += wb.y * a.x;
+    s[1][1] += wb.y * a.y;
+    s[1][2] += wb.y * a.z;
+    s[2][0] += wb.z * a.x;
+    s[2][1] += wb.z * a.y;
+    s[2][2] += wb.z * a.z;
+    g += w * (a.length_sq() + b.length_sq());
+  }
+  double n[4][4] = {
+    {s[0][0] + s[1][1] + s[2][2], s[1][2] - s[2][1],
+     s[2][0] - s[0][2], s[0][1] - s[1][0]},
+    {s[1][2] - s[2][1], s[0][0] - s[1][1] - s[2][2],
+     s[0][1] + s[1][0], s[2][0] + s[0][2]},
+    {s[2][0] - s[0][2], s[0][1] + s[1][0],
+     -s[0][0] + s[1][1] - s[2][2], s[1][2] + s[2][1]},
+    {s[0][1] - s[1][0], s[2][0] + s[0][2],
+     s[1][2] + s[2][1], -s[0][0] - s[1][1] + s[2][2]}};
+  double v[4][4];
+  impl::jacobi_eigen_sym4(n, v);
+  int k = 0;
+  for (int i = 1; i != 4; ++i)
+    if (n[i][i] > n[k][k])
+      k = i;
+  // unit quaternion of the rotation
+  double q0 = v[0][k], q1 = v[1][k], q2 = v[2][k], q3 = v[3][k];
+  Mat33& m = r.transform.mat;
+  m[0][0] = q0*q0 + q1*q1 - q2*q2 - q3*q3;
+  m[0][1] = 2 * (q1*q2 - q0*q3);
+  m[0][2] = 2 * (q1*q3 + q0*q2);
+  m[1][0] = 2 * (q1*q2 + q0*q3);
+  m[1][1] = q0*q0 - q1*q1 + q2*q2 - q3*q3;
+  m[1][2] = 2 * (q2*q3 - q0*q1);
+  m[2][0] = 2 * (q1*q3 - q0*q2);
+  m[2][1] = 2 * (q2*q3 + q0*q1);
+  m[2][2] = q0*q0 - q1*q1 - q2*q2 + q3*q3;
+  r.transform.vec = Vec3(r.center1) - m.multiply(r.center2);
+  r.rmsd = std::sqrt(std::max(0., g - 2 * n[k][k]) / total_weight);
+  return r;
+}
+
 } // namespace gemmi
 #endif
@@ -19,6 +19,7 @@
 #include "fileutil.hpp"  // for file_open, is_little_endian, ...
 #include "input.hpp"     // for FileStream
 #include "grid.hpp"
+#include "gridstats.hpp"  // for GridStats, calculate_grid_statistics
 
 namespace gemmi {
 
@@ -32,34 +33,6 @@ enum class GridSetup {
   FullCheck     // additionally consistency of redundant data
 };
 
-struct GridStats {
-  double dmin = NAN;
-  double dmax = NAN;
-  double dmean = NAN;
-  double rms = NAN;
-};
-
-template<typename T>
-GridStats calculate_grid_statistics(const std::vector<T>& data) {
-  GridStats st;
-  if (data.empty())
-    return st;
-  double sum = 0;
-  double sq_sum = 0;
-  st.dmin = st.dmax = data[0];
-  for (double d : data) {
-    sum += d;
-    sq_sum += d * d;
-    if (d < st.dmin)
-      st.dmin = d;
-    if (d > st.dmax)
-      st.dmax = d;
-  }
-  st.dmean = sum / data.size();
-  st.rms = std::sqrt(sq_sum / data.size() - st.dmean * st.dmean);
-  return st;
-}
-
 template<typename T=float>
 struct Ccp4 {
   Grid<T> grid;
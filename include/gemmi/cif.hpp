@@ -240,6 +240,85 @@ template<> struct Action<rules::loop> {
 };
 
 
+// **** event-based parsing, without storing the Document ****
+
+// Base class for handlers passed to parse_events(). A handler overrides
+// (hides) the functions it needs. Strings are passed as pointer + length,
+// without the terminating null, and are valid only during the call.
+struct EventHandler {
+  void start_block(const char*, size_t) {}
+  void start_frame(const char*, size_t) {}
+  void end_frame() {}
+  void pair_tag(const char*, size_t) {}
+  void pair_value(const char*, size_t) {}
+  void start_loop() {}
+  void loop_tag(const char*, size_t) {}
+  void loop_value(const char*, size_t) {}
+  void end_loop() {}
+};
+
+template<typename Rule> struct EventAction : pegtl::nothing<Rule> {};
+
+template<> struct EventAction<rules::datablockname> {
+  template<typename Input, typename H>
+  static void apply(const Input& in, H& h) {
+    h.start_block(in.begin(), in.size());
+  }
+};
+template<> struct EventAction<rules::str_global> {
+  template<typename H> static void apply0(H& h) { h.start_block("", 0); }
+};
+template<> struct EventAction<rules::framename> {
+  template<typename Input, typename H>
+  static void apply(const Input& in, H& h) {
+    h.start_frame(in.begin(), in.size());
+  }
+};
+template<> struct EventAction<rules::endframe> {
+  template<typename H> static void apply0(H& h) { h.end_frame(); }
+};
+template<> struct EventAction<rules::tag> {
+  template<typename Input, typename H>
+  static void apply(const Input& in, H& h) {
+    h.pair_tag(in.begin(), in.size());
+  }
+};
+template<> struct EventAction<rules::value> {
+  template<typename Input, typename H>
+  static void apply(const Input& in, H& h) {
+    h.pair_value(in.begin(), in.size());
+  }
+};
+template<> struct EventAction<rules::str_loop> {
+  template<typename H> static void apply0(H& h) { h.start_loop(); }
+};
+template<> struct EventAction<rules::loop_tag> {
+  template<typename Input, typename H>
+  static void apply(const Input& in, H& h) {
+    h.loop_tag(in.begin(), in.size());
+  }
+};
+template<> struct EventAction<rules::loop_value> {
+  template<typename Input, typename H>
+  static void apply(const Input& in, H& h) {
+    h.loop_value(in.begin(), in.size());
+  }
+};
+template<> struct EventAction<rules::loop> {
+  template<typename H> static void apply0(H& h) { h.end_loop(); }
+};
+
+// Parses CIF calling member functions of the handler (see EventHandler).
+// Used for processing files that are too big to be kept in memory;
+// with buffered input (such as cstream_input) the memory usage is bounded.
+// Unlike read_input(), it does not check the number of values in loops
+// (it can be done in end_loop()).
+template<typename Input, typename Handler>
+void parse_events(Input&& in, Handler& handler) {
+  pegtl::parse<rules::file, EventAction, Errors>(in, handler);
+}
+
+
 template<typename Input> void parse_input(Document& d, Input&& in) {
   pegtl::parse<rules::file, Action, Errors>(in, d);
   d.source = in.source();
@@ -0,0 +1,207 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Contact search, based on SubCells (cell lists).
+// Each contact is reported once, unless ContactSearch::twice is set.
+
+#ifndef GEMMI_CONTACT_HPP_
+#define GEMMI_CONTACT_HPP_
+
+#include <cmath>         // for fabs
+#include <vector>
+#include "subcells.hpp"  // for SubCells
+#include "polyheur.hpp"  // for check_polymer_type, are_connected, ...
+#include "elem.hpp"      // for is_hydrogen
+#include "parallel.hpp"  // for parallel_for
+
+namespace gemmi {
+
+struct ContactSearch {
+  enum class Ignore { Nothing, SameResidue, AdjacentResidues };
+  struct Result {
+    const_CRA partner1;
+    const_CRA partner2;
+    int image_idx;
+    float dist_sq;
+  };
+  // atom and its position in Model, used as argument to for_each_contact_of()
+  struct AtomIndex {
+    int chain_idx;
+    int residue_idx;
+    int atom_idx;
+  };
+
+  float search_radius;
+  Ignore ignore = Ignore::AdjacentResidues;
+  // report both A-B and B-A
+  bool twice = false;
+  bool skip_hydrogens = false;
+  // ignore atom pairs with summed occupancies < min_occupancy_sum
+  float min_occupancy_sum = 0.f;
+  // atom can be linked with its image, but if the image
+  // is too close the atom is likely on special position.
+  float special_pos_cutoff_sq = 0.8f * 0.8f;
+  // If use_covalent_radius is set, atoms are in contact if
+  //   distance < cov_mult * (covalent_r1 + covalent_r2) + cov_tol
+  bool use_covalent_radius = false;
+  float cov_mult = 1.0f;
+  float cov_tol = 0.0f;
+
+  explicit ContactSearch(float radius) noexcept : search_radius(radius) {}
+
+  // Must be called after SubCells is populated and before searching.
+  void setup(const SubCells& sc) {
+    const Model& model = *sc.model;
+    polymer_types_.clear();
+    backbones_.clear();
+    ResidueInfoCache cache;
+    for (const Chain& chain : model.chains) {
+      polymer_types_.push_back(check_polymer_type(chain.get_polymer(), cache));
+      backbones_.emplace_back();
+      backbones_.back().reserve(chain.residues.size());
+      for (const Residue& res : chain.residues)
+        backbones_.back().emplace_back(res);
+    }
+    // For each symmetry image, find the image with inverse operation.
+    // Contact A-B(image k) is the same as B-A(image inverse_images_[k]).
+    const std::vector<FTransform>& images = sc.grid.unit_cell.images;
+    inverse_images_.assign(images.size() + 1, -1);
+    inverse_images_[0] = 0;
+    for (size_t i = 0; i != images.size(); ++i) {
+      Transform inv = images[i].inverse();
+      for (size_t j = 0; j != images.size(); ++j)
+        if (is_same_op_modulo_lattice(inv, images[j])) {
+          inverse_images_[i+1] = (int) j + 1;
+          break;
+        }
+    }
+  }
+
+  std::vector<AtomIndex> atoms_to_search(const Model& model) const {
+    std::vector<AtomIndex> atoms;
+    for (int n_ch = 0; n_ch != (int) model.chains.size(); ++n_ch) {
+      const Chain& chain = model.chains[n_ch];
+      for (int n_res = 0; n_res != (int) chain.residues.size(); ++n_res) {
+        const Residue& res = chain.residues[n_res];
+        for (int n_atom = 0; n_atom != (int) res.atoms.size(); ++n_atom)
+          if (!skip_hydrogens || !is_hydrogen(res.atoms[n_atom].element))
+            atoms.push_back({n_ch, n_res, n_atom});
+      }
+    }
+    return atoms;
+  }
+
+  // Calls func(const Result&) for each contact of one atom.
+  // The callback is called from the calling thread only, so this function
+  // can be called concurrently for different atoms.
+  template<typename Func>
+  void for_each_contact_of(SubCells& sc, AtomIndex idx, Func func) const;
+
+  // Serial search over all atoms.
+  template<typename Func>
+  void for_each_contact(SubCells& sc, Func func) const {
+    for (AtomIndex idx : atoms_to_search(*sc.model))
+      for_each_contact_of(sc, idx, func);
+  }
+
+  // Multithreaded search; results are in the same order as from
+  // for_each_contact(), regardless of the number of threads.
+  std::vector<Result> find_contacts(SubCells& sc, int n_threads=0) const {
+    std::vector<AtomIndex> atoms = atoms_to_search(*sc.model);
+    std::vector<std::vector<Result>> partial(atoms.size());
+    parallel_for(atoms.size(), n_threads, [&](size_t i) {
+      for_each_contact_of(sc, atoms[i], [&](const Result& r) {
+          partial[i].push_back(r);
+      });
+    }, 256);
+    std::vector<Result> results;
+    for (std::vector<Result>& v : partial)
+      results.insert(results.end(), v.begin(), v.end());
+    return results;
+  }
+
+private:
+  std::vector<PolymerType> polymer_types_;
+  // backbone atoms of each residue, to check for adjacent residues
+  std::vector<std::vector<BackboneAtoms>> backbones_;
+  std::vector<int> inverse_images_;
+
+  static bool is_same_op_modulo_lattice(const Transform& a,
+                                        const Transform& b) {
+    const double eps = 1e-6;
+    for (int i = 0; i != 3; ++i) {
+      for (int j = 0; j != 3; ++j)
+        if (std::fabs(a.mat[i][j] - b.mat[i][j]) > eps)
+          return false;
+      double d = a.vec.at(i) - b.vec.at(i);
+      if (std::fabs(d - std::round(d)) > eps)
+        return false;
+    }
+    return true;
+  }
+
+  // true if the pair (a, b) should be reported from a rather than from b
+  bool is_first_of_pair(AtomIndex a, const SubCells::Mark& b) const {
+    if (a.chain_idx != b.chain_idx)
+      return a.chain_idx < b.chain_idx;
+    if (a.residue_idx != b.residue_idx)
+      return a.residue_idx < b.residue_idx;
+    if (a.atom_idx != b.atom_idx)
+      return a.atom_idx < b.atom_idx;
+    // contact with own image
+    int inv = inverse_images_.at(b.image_idx);
+    return inv < 0 || b.image_idx <= inv;
+  }
+};
+
+template<typename Func>
+void ContactSearch::for_each_contact_of(SubCells& sc, AtomIndex idx,
+                                        Func func) const {
+  const Model& model = *sc.model;
+  const Chain& chain = model.chains[idx.chain_idx];
+  const Residue& res = chain.residues[idx.residue_idx];
+  const Atom& atom = res.atoms[idx.atom_idx];
+  PolymerType pt = polymer_types_.at(idx.chain_idx);
+  float min_occ = min_occupancy_sum - atom.occ;
+  float max_r = search_radius;
+  float d_part = 0.f;
+  if (use_covalent_radius) {
+    d_part = cov_mult * atom.element.covalent_r() + cov_tol;
+    max_r = d_part + 2.4f;
+  }
+  sc.for_each(atom.pos, atom.altloc, max_r,
+              [&](const SubCells::Mark& m, float dist_sq) {
+      if (!twice && !is_first_of_pair(idx, m))
+        return;
+      if (m.image_idx == 0 && m.chain_idx == idx.chain_idx) {
+        // do not consider connections inside a residue
+        // or between this and previous/next residue
+        if (ignore != Ignore::Nothing && m.residue_idx == idx.residue_idx)
+          return;
+        if (ignore == Ignore::AdjacentResidues) {
+          const std::vector<BackboneAtoms>& bb = backbones_.at(idx.chain_idx);
+          const BackboneAtoms& bb1 = bb.at(idx.residue_idx);
+          const BackboneAtoms& bb2 = bb.at(m.residue_idx);
+          if (are_connected(bb1, bb2, pt) || are_connected(bb2, bb1, pt))
+            return;
+        }
+      }
+      if (m.chain_idx == idx.chain_idx && m.residue_idx == idx.residue_idx &&
+          m.atom_idx == idx.atom_idx && (m.image_idx == 0 ||
+                                         dist_sq < special_pos_cutoff_sq))
+        return;
+      const_CRA cra = m.to_cra(model);
+      if (cra.atom->occ < min_occ)
+        return;
+      if (skip_hydrogens && is_hydrogen(cra.atom->element))
+        return;
+      if (use_covalent_radius) {
+        float limit = d_part + cov_mult * cra.atom->element.covalent_r();
+        if (limit < 0 || dist_sq > sq(limit))
+          return;
+      }
+      func(Result{{&chain, &res, &atom}, cra, m.image_idx, dist_sq});
+  });
+}
+
+} // namespace gemmi
+#endif
@@ -10,6 +10,9 @@
 // PdbWalk: .pdb or .ent (optionally with .gz) except r????sf.ent
 // CoorFileWalk: .cif, .pdb or .ent (optionally with .gz)
 //               except r????sf.ent and *-sf.cif
+// ParallelFileWalk (ParallelCifWalk, ...) yields the same files
+// in the same order, but directories are listed by multiple threads
+// ahead of the iteration, and upcoming files can be prefetched.
 //
 //
 // Usage:
@@ -18,21 +21,36 @@
 // or
 //   for (const char* file : gemmi::CifWalk(top_dir))
 //     do_something(file);
+// or
+//   for (const std::string& file : gemmi::ParallelCifWalk(top_dir))
+//     do_something(file);
 // You should also catch std::runtime_error.
 
 #ifndef GEMMI_DIRWALK_HPP_
 #define GEMMI_DIRWALK_HPP_
 
 #include <stdexcept>  // for runtime_error
+#include <algorithm>  // for find, max
+#include <condition_variable>
+#include <cstring>    // for strcmp
+#include <deque>
+#include <memory>     // for unique_ptr
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 #include <cassert>
+#ifndef _WIN32
+# include <fcntl.h>   // for open, posix_fadvise
+# include <unistd.h>  // for close
+#endif
 #if defined(_MSC_VER) && !defined(NOMINMAX)
 # define NOMINMAX
 #endif
 #include "third_party/tinydir.h"
 
-#include "util.hpp"  // for giends_with
+#include "util.hpp"      // for giends_with
+#include "parallel.hpp"  // for default_thread_count
 
 namespace gemmi {
 
@@ -186,5 +204,270 @@ using MmCifWalk = FileWalk<impl::IsMmCifFile>;
 using PdbWalk = FileWalk<impl::IsPdbFile>;
 using CoorFileWalk = FileWalk<impl::IsCoordinateFile>;
 
+// Reads files into the OS page cache in a background thread,
+// using posix_fadvise(POSIX_FADV_WILLNEED). Does nothing on systems
+// without posix_fadvise.
+class FilePrefetcher {
+public:
+  FilePrefetcher() : thread_([this]() { run(); }) {}
+  ~FilePrefetcher() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+  }
+  void add(const std::string& path) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back(path);
+    }
+    cv_.notify_one();
+  }
+
+  static void prefetch(const std::string& path) {
+#if defined(POSIX_FADV_WILLNEED)
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+      ::posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+      ::close(fd);
+    }
+#else
+    (void) path;
+#endif
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::string> queue_;
+  bool stop_ = false;
+  std::thread thread_;  // must be initialized after the members above
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      cv_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+      if (stop_)
+        return;
+      std::string path = std::move(queue_.front());
+      queue_.pop_front();
+      lock.unlock();
+      prefetch(path);
+      lock.lock();
+    }
+  }
+};
+
+// Like FileWalk, but directories are listed (and sorted) concurrently by
+// n_threads threads, which helps a lot on network file systems.
+// Listing can run ahead of the iteration by up to max_ahead entries.
+// If prefetch > 0, that many upcoming files are prefetched while the
+// current one is processed.
+template<typename Check>
+class ParallelFileWalk {
+public:
+  explicit ParallelFileWalk(const std::string& path, int n_threads=0,
+                            int prefetch=0, size_t max_ahead=100000)
+    : prefetch_count_(prefetch), max_ahead_(max_ahead) {
+    tinydir_file top;
+    if (tinydir_file_open(&top, path.c_str()) == -1)
+      throw std::runtime_error("Cannot open file or directory: " + path);
+    root_.path = top.path;
+    if (!top.is_dir) {
+      // a single file is yielded even if it does not pass the Check
+      root_.entries.push_back(Entry{root_.path, nullptr});
+      root_.state = DirNode::Ready;
+      stack_.emplace_back(&root_, 0);
+      return;
+    }
+    stack_.emplace_back(&root_, 0);
+    queue_.push_back(&root_);
+    if (n_threads <= 0)
+      n_threads = std::max(4, default_thread_count());
+    for (int i = 0; i != n_threads; ++i)
+      threads_.emplace_back([this]() { work(); });
+    if (prefetch_count_ > 0)
+      prefetcher_.reset(new FilePrefetcher);
+  }
+  ~ParallelFileWalk() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    work_cv_.notify_all();
+    for (std::thread& t : threads_)
+      t.join();
+  }
+
+  // Sets path to the next file. Returns false at the end.
+  bool next(std::string& path) {
+    while (lookahead_.size() <= (size_t) prefetch_count_) {
+      std::string p;
+      if (!next_in_tree(p))
+        break;
+      if (prefetcher_)
+        prefetcher_->add(p);
+      lookahead_.push_back(std::move(p));
+    }
+    if (lookahead_.empty())
+      return false;
+    path = std::move(lookahead_.front());
+    lookahead_.pop_front();
+    return true;
+  }
+
+  struct Iter {
+    ParallelFileWalk* walk;
+    std::string path;
+    void operator++() {
+      if (!walk->next(path))
+        walk = nullptr;
+    }
+    const std::string& operator*() const { return path; }
+    // == and != is used only to compare with end()
+    bool operator==(const Iter& o) const { return walk == o.walk; }
+    bool operator!=(const Iter& o) const { return walk != o.walk; }
+  };
+  Iter begin() {
+    Iter it{this, {}};
+    ++it;
+    return it;
+  }
+  Iter end() { return Iter{nullptr, {}}; }
+
+private:
+  struct DirNode;
+  struct Entry {
+    std::string path;
+    std::unique_ptr<DirNode> subdir;  // null for files
+  };
+  struct DirNode {
+    enum State { Pending, Listing, Ready };
+    std::string path;
+    State state = Pending;
+    std::vector<Entry> entries;  // in alphabetical order
+    std::string error;
+  };
+
+  DirNode root_;
+  int prefetch_count_;
+  size_t max_ahead_;
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable ready_cv_;
+  std::deque<DirNode*> queue_;  // directories to be listed
+  size_t unconsumed_ = 0;  // entries listed, but not yet iterated
+  bool stop_ = false;
+  std::vector<std::thread> threads_;
+  // used only by the iterating thread
+  std::vector<std::pair<DirNode*, size_t>> stack_;
+  std::deque<std::string> lookahead_;
+  std::unique_ptr<FilePrefetcher> prefetcher_;
+
+  static void list_dir(DirNode& node) {
+    tinydir_dir dir;
+    if (tinydir_open_sorted(&dir, node.path.c_str()) == -1) {
+      node.error = "Cannot open directory: " + node.path;
+      return;
+    }
+    for (size_t i = 0; i != dir.n_files; ++i) {
+      const tinydir_file& f = dir._files[i];
+      if (std::strcmp(f.name, ".") == 0 || std::strcmp(f.name, "..") == 0)
+        continue;
+      if (f.is_dir) {
+        node.entries.push_back(Entry{f.path, std::unique_ptr<DirNode>(
+                                                  new DirNode)});
+        node.entries.back().subdir->path = f.path;
+      } else if (Check::check(f.name)) {
+        node.entries.push_back(Entry{f.path, nullptr});
+      }
+    }
+    tinydir_close(&dir);
+  }
+
+  // called with mutex_ locked
+  void finish_listing(DirNode& node) {
+    node.state = DirNode::Ready;
+    unconsumed_ += node.entries.size();
+    // subdirectories go to the front, so they are listed in the same
+    // (depth-first) order in which they are iterated
+    for (auto e = node.entries.rbegin(); e != node.entries.rend(); ++e)
+      if (e->subdir)
+        queue_.push_front(e->subdir.get());
+    work_cv_.notify_all();
+    ready_cv_.notify_all();
+  }
+
+  void work() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      work_cv_.wait(lock, [this]() {
+          return stop_ || (!queue_.empty() && unconsumed_ < max_ahead_);
+      });
+      if (stop_)
+        return;
+      DirNode* node = queue_.front();
+      queue_.pop_front();
+      node->state = DirNode::Listing;
+      lock.unlock();
+      list_dir(*node);
+      lock.lock();
+      finish_listing(*node);
+    }
+  }
+
+  // Waits until the node is listed. If no thread has started listing it,
+  // it is listed here, so the iteration does not depend on max_ahead_.
+  void wait_for_listing(DirNode& node) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (node.state == DirNode::Pending) {
+      queue_.erase(std::find(queue_.begin(), queue_.end(), &node));
+      node.state = DirNode::Listing;
+      lock.unlock();
+      list_dir(node);
+      lock.lock();
+      finish_listing(node);
+    }
+    ready_cv_.wait(lock, [&]() { return node.state == DirNode::Ready; });
+  }
+
+  bool next_in_tree(std::string& path) {
+    while (!stack_.empty()) {
+      DirNode& node = *stack_.back().first;
+      size_t& pos = stack_.back().second;
+      if (pos == 0) {
+        wait_for_listing(node);
+        if (!node.error.empty())
+          throw std::runtime_error(node.error);
+      }
+      if (pos == node.entries.size()) {
+        node.entries.clear();  // free memory of the visited subtree
+        stack_.pop_back();
+        continue;
+      }
+      Entry& entry = node.entries[pos++];
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        --unconsumed_;
+      }
+      work_cv_.notify_one();
+      if (entry.subdir) {
+        stack_.emplace_back(entry.subdir.get(), 0);
+      } else {
+        path = std::move(entry.path);
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+using ParallelCifWalk = ParallelFileWalk<impl::IsCifFile>;
+using ParallelMmCifWalk = ParallelFileWalk<impl::IsMmCifFile>;
+using ParallelPdbWalk = ParallelFileWalk<impl::IsPdbFile>;
+using ParallelCoorFileWalk = ParallelFileWalk<impl::IsCoordinateFile>;
+
 } // namespace gemmi
 #endif
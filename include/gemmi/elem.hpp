@@ -216,6 +216,29 @@ inline El find_single_letter_element(char c) {
     default: return El::X;
   }
 }
+
+// first and second are uppercase letters, or other characters (-> X)
+inline El find_two_letter_element(char first, char second) {
+  // 26x26 table filled (once) from element_name()
+  struct Table {
+    El el[26 * 26];
+    Table() {
+      for (El& e : el)
+        e = El::X;
+      for (int n = 0; n != static_cast<int>(El::END); ++n) {
+        const char* name = element_name(static_cast<El>(n));
+        if (name[0] != '\0' && name[1] != '\0')
+          el[(name[0] - 'A') * 26 + (name[1] - 'a')] = static_cast<El>(n);
+      }
+    }
+  };
+  static const Table table;
+  unsigned a = static_cast<unsigned char>(first - 'A');
+  unsigned b = static_cast<unsigned char>(second - 'A');
+  if (a >= 26 || b >= 26)
+    return El::X;
+  return table.el[a * 26 + b];
+}
 } // namespace impl
 
 inline El find_element(const char* symbol) {
@@ -230,12 +253,7 @@ inline El find_element(const char* symbol) {
   // some control characters - inconsistent but not necessarily bad.
   if (second < 14)
     return impl::find_single_letter_element(first);
-  elname_t* names = &element_uppercase_name(El::X);
-  for (int i = 0; i != 120; ++i) {
-    if (names[i][0] == first && names[i][1] == second)
-      return static_cast<El>(i);
-  }
-  return El::X;
+  return impl::find_two_letter_element(first, second);
 }
 
 struct Element {
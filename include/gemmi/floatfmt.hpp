@@ -0,0 +1,214 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// FloatFormat: fast formatting of floats with printf-like format.
+
+#ifndef GEMMI_FLOATFMT_HPP_
+#define GEMMI_FLOATFMT_HPP_
+
+#include <algorithm>  // for min, max
+#include <cctype>     // for tolower
+#include <cmath>      // for nearbyint, log10, floor, fabs, isfinite
+#include <cstdint>    // for uint64_t
+#include <cstdio>     // for snprintf
+#include <cstdlib>    // for abs
+#include <cstring>    // for memcpy, memchr
+#include <string>
+#include "atox.hpp"   // for is_digit
+
+#if defined(__GNUC__)
+# pragma GCC diagnostic push
+# pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#endif
+
+namespace gemmi {
+
+// printf-like format of a float (%f, %e or %g with optional flag, width
+// and precision), parsed once. The output is the same as from snprintf(),
+// but typical numbers are formatted here directly, using the fact that
+// float * 10^k is exact in double for k <= 12. Other cases (large
+// exponents, inf, # and 0 flags) fall back to snprintf().
+struct FloatFormat {
+  std::string printf_format = "%g";
+  char flag = '\0';
+  int width = 0;
+  int precision = 6;
+  char conv = 'g';  // lowercase: f, e or g
+  bool upper = false;
+  bool fast = true;
+
+  // fmt is without %, e.g. "12.5e" or "_.4f" (_ stands for space)
+  void parse(const std::string& fmt) {
+    printf_format = "%" + fmt;
+    if (printf_format[1] == '_')
+      printf_format[1] = ' ';
+    const char* p = printf_format.c_str() + 1;
+    flag = '\0';
+    if (*p == ' ' || *p == '+' || *p == '-' || *p == '#')
+      flag = *p++;
+    if (*p == '0' || flag == '#')  // zero-padding and alternative form
+      fast = false;
+    width = 0;
+    while (is_digit(*p))
+      width = width * 10 + (*p++ - '0');
+    precision = 6;
+    if (*p == '.') {
+      precision = 0;
+      for (++p; is_digit(*p); ++p)
+        precision = precision * 10 + (*p - '0');
+    }
+    upper = (*p == 'F' || *p == 'E' || *p == 'G');
+    conv = (char) std::tolower(*p);
+  }
+
+  // Writes formatted v to p (which must have room for 64 + width bytes).
+  // Returns pointer after the last character.
+  char* write(char* p, float v) const {
+    char buf[64];
+    char* end = fast ? write_number(buf, v) : nullptr;
+    if (!end) {
+      int n = std::snprintf(p, 64 + width, printf_format.c_str(), v);
+      return p + (n > 0 ? n : 0);
+    }
+    int len = int(end - buf);
+    int pad = width - len;
+    if (flag != '-')
+      for (; pad > 0; --pad)
+        *p++ = ' ';
+    std::memcpy(p, buf, len);
+    p += len;
+    for (; pad > 0; --pad)
+      *p++ = ' ';
+    return p;
+  }
+
+private:
+  static double pow10(int n) {
+    static const double table[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+                                   1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14,
+                                   1e15, 1e16, 1e17};
+    return table[n];
+  }
+
+  static char* write_uint(char* p, std::uint64_t n) {
+    char tmp[24];
+    int len = 0;
+    do {
+      tmp[len++] = char('0' + n % 10);
+      n /= 10;
+    } while (n != 0);
+    while (len != 0)
+      *p++ = tmp[--len];
+    return p;
+  }
+
+  // writes n with exactly ndigits digits (with leading zeros)
+  static char* write_digits(char* p, std::uint64_t n, int ndigits) {
+    for (int i = ndigits - 1; i >= 0; --i) {
+      p[i] = char('0' + n % 10);
+      n /= 10;
+    }
+    return p + ndigits;
+  }
+
+  // Rounds a > 0 to P significant digits: a ~= D * 10^(X-P+1),
+  // where 10^(P-1) <= D < 10^P. Returns false if it cannot be done exactly.
+  static bool round_to_digits(double a, int P, std::uint64_t& D, int& X) {
+    X = (int) std::floor(std::log10(a));
+    for (int attempt = 0; attempt != 3; ++attempt) {
+      int k = P - 1 - X;
+      if (k < 0 || k > 12)
+        return false;
+      double s = a * pow10(k);
+      if (s < pow10(P - 1)) {
+        --X;
+      } else if (s >= pow10(P)) {
+        ++X;
+      } else {
+        D = (std::uint64_t) std::nearbyint(s);  // ties to even, as printf
+        if (D == (std::uint64_t) pow10(P)) {
+          D /= 10;
+          ++X;
+        }
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // D with the decimal point before the last dec digits
+  static char* write_fixed(char* p, std::uint64_t D, int dec) {
+    std::uint64_t div = (std::uint64_t) pow10(std::min(dec, 17));
+    if (dec > 17) {  // only leading zeros in the fraction
+      p = write_uint(p, 0);
+      *p++ = '.';
+      for (int i = 17; i != dec; ++i)
+        *p++ = '0';
+      return write_digits(p, D, 17);
+    }
+    p = write_uint(p, D / div);
+    if (dec > 0) {
+      *p++ = '.';
+      p = write_digits(p, D % div, dec);
+    }
+    return p;
+  }
+
+  char* write_exponent(char* p, int X) const {
+    *p++ = upper ? 'E' : 'e';
+    *p++ = X < 0 ? '-' : '+';
+    int ax = std::abs(X);
+    if (ax < 10)
+      *p++ = '0';
+    return write_uint(p, ax);
+  }
+
+  static char* strip_zeros(char* begin, char* end) {
+    char* dot = static_cast<char*>(std::memchr(begin, '.', end - begin));
+    if (!dot)
+      return end;
+    while (end[-1] == '0')
+      --end;
+    if (end[-1] == '.')
+      --end;
+    return end;
+  }
+
+  // returns nullptr if snprintf should be used
+  char* write_number(char* p, float v) const {
+    if (!std::isfinite(v) || precision > 15)
+      return nullptr;
+    if (std::signbit(v))
+      *p++ = '-';
+    else if (flag == '+' || flag == ' ')
+      *p++ = flag;
+    double a = std::fabs((double) v);
+    if (conv == 'f') {
+      double scaled = a * pow10(std::min(precision, 12));
+      if (precision > 12 || scaled >= 1e17)
+        return nullptr;
+      return write_fixed(p, (std::uint64_t) std::nearbyint(scaled), precision);
+    }
+    int P = conv == 'e' ? precision + 1 : std::max(precision, 1);
+    std::uint64_t D = 0;
+    int X = 0;
+    if (a != 0. && !round_to_digits(a, P, D, X))
+      return nullptr;
+    if (conv == 'e' || X < -4 || X >= P) {
+      char* start = p;
+      p = write_fixed(p, D, P - 1);
+      if (conv == 'g')
+        p = strip_zeros(start, p);
+      return write_exponent(p, X);
+    }
+    char* start = p;
+    p = write_fixed(p, D, P - 1 - X);
+    return strip_zeros(start, p);
+  }
+};
+
+} // namespace gemmi
+
+#if defined(__GNUC__)
+# pragma GCC diagnostic pop
+#endif
+#endif
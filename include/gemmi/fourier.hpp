@@ -5,12 +5,17 @@
 #ifndef GEMMI_FOURIER_HPP_
 #define GEMMI_FOURIER_HPP_
 
+#include <algorithm>     // for copy, min, max, move, rotate
 #include <array>
+#include <cmath>         // for exp, isinf
 #include <complex>       // for std::conj
+#include <type_traits>   // for conditional, is_const
+#include <vector>
 #include "grid.hpp"      // for Grid
 #include "math.hpp"      // for rad
 #include "symmetry.hpp"  // for GroupOps, Op
 #include "fail.hpp"      // for fail
+#include "parallel.hpp"  // for parallel_for
 
 #ifdef  __INTEL_COMPILER
 // warning #2196: routine is both "inline" and "noinline"
@@ -168,8 +173,89 @@ Grid<std::complex<T>> get_f_phi_on_grid(const DataProxy& data,
 }
 
 
+namespace impl {
+// 3D transforms along one axis, split into independent 2D transforms
+// that are run in parallel (pocketfft is used without its own threading).
+// The array is split along w, or along v if axis is w (0 in pocketfft).
+// Strides are in bytes, as in pocketfft.
+struct FftSplit {
+  size_t axis;   // axis of the 2D sub-arrays
+  size_t split;  // axis along which the 3D array is split
+  pocketfft::shape_t shape;
+
+  FftSplit(const pocketfft::shape_t& shape3, size_t axis3)
+    : axis(axis3 == 0 ? 0 : axis3 - 1), split(axis3 == 0 ? 1 : 0) {
+    for (size_t i = 0; i != 3; ++i)
+      if (i != split)
+        shape.push_back(shape3[i]);
+  }
+  pocketfft::stride_t sub_stride(const pocketfft::stride_t& stride) const {
+    pocketfft::stride_t sub;
+    for (size_t i = 0; i != 3; ++i)
+      if (i != split)
+        sub.push_back(stride[i]);
+    return sub;
+  }
+  template<typename P> P* ptr(P* start, const pocketfft::stride_t& stride,
+                              size_t i) const {
+    using Byte = typename std::conditional<std::is_const<P>::value,
+                                           const char, char>::type;
+    return reinterpret_cast<P*>(reinterpret_cast<Byte*>(start) +
+                                i * stride[split]);
+  }
+};
+
+template<typename T>
+void parallel_c2c(const pocketfft::shape_t& shape,
+                  const pocketfft::stride_t& stride, size_t axis,
+                  bool forward, std::complex<T>* data, T fct, int n_threads) {
+  FftSplit fs(shape, axis);
+  pocketfft::stride_t sub_stride = fs.sub_stride(stride);
+  parallel_for(shape[fs.split], n_threads, [&](size_t i) {
+    std::complex<T>* p = fs.ptr(data, stride, i);
+    pocketfft::c2c<T>(fs.shape, sub_stride, sub_stride, {fs.axis}, forward,
+                      p, p, fct);
+  });
+}
+
+// shape is the shape of the real array
+template<typename T>
+void parallel_r2c(const pocketfft::shape_t& shape,
+                  const pocketfft::stride_t& stride_in,
+                  const pocketfft::stride_t& stride_out, size_t axis,
+                  bool forward, const T* data_in, std::complex<T>* data_out,
+                  T fct, int n_threads) {
+  FftSplit fs(shape, axis);
+  pocketfft::stride_t sub_in = fs.sub_stride(stride_in);
+  pocketfft::stride_t sub_out = fs.sub_stride(stride_out);
+  parallel_for(shape[fs.split], n_threads, [&](size_t i) {
+    pocketfft::r2c<T>(fs.shape, sub_in, sub_out, fs.axis, forward,
+                      fs.ptr(data_in, stride_in, i),
+                      fs.ptr(data_out, stride_out, i), fct);
+  });
+}
+
+// shape is the shape of the real array
 template<typename T>
-void transform_f_phi_grid_to_map_(Grid<std::complex<T>>&& hkl, Grid<T>& map) {
+void parallel_c2r(const pocketfft::shape_t& shape,
+                  const pocketfft::stride_t& stride_in,
+                  const pocketfft::stride_t& stride_out, size_t axis,
+                  bool forward, const std::complex<T>* data_in, T* data_out,
+                  T fct, int n_threads) {
+  FftSplit fs(shape, axis);
+  pocketfft::stride_t sub_in = fs.sub_stride(stride_in);
+  pocketfft::stride_t sub_out = fs.sub_stride(stride_out);
+  parallel_for(shape[fs.split], n_threads, [&](size_t i) {
+    pocketfft::c2r<T>(fs.shape, sub_in, sub_out, fs.axis, forward,
+                      fs.ptr(data_in, stride_in, i),
+                      fs.ptr(data_out, stride_out, i), fct);
+  });
+}
+} // namespace impl
+
+template<typename T>
+void transform_f_phi_grid_to_map_(Grid<std::complex<T>>&& hkl, Grid<T>& map,
+                                  int n_threads=1) {
   // x -> conj(x) is equivalent to changing axis direction before FFT
   for (std::complex<T>& x : hkl.data)
     x.imag(-x.imag());
@@ -195,16 +281,19 @@ void transform_f_phi_grid_to_map_(Grid<std::complex<T>>&& hkl, Grid<T>& map) {
   if (hkl.half_l) {
     size_t last_axis = axes.back();
     axes.pop_back();
-    pocketfft::c2c<T>(shape, stride, stride, axes, pocketfft::BACKWARD,
-                      &hkl.data[0], &hkl.data[0], norm);
+    for (size_t i = 0; i != axes.size(); ++i)
+      impl::parallel_c2c<T>(shape, stride, axes[i], pocketfft::BACKWARD,
+                            &hkl.data[0], i == 0 ? norm : T(1), n_threads);
     pocketfft::stride_t stride_out{map.nv * map.nu * s, map.nu * s, s};
     shape[0] = (size_t) map.nw;
     shape[2] = (size_t) map.nu;
-    pocketfft::c2r<T>(shape, stride, stride_out, last_axis, pocketfft::BACKWARD,
-                      &hkl.data[0], &map.data[0], 1.0f);
+    impl::parallel_c2r<T>(shape, stride, stride_out, last_axis,
+                          pocketfft::BACKWARD, &hkl.data[0], &map.data[0],
+                          T(1), n_threads);
   } else {
-    pocketfft::c2c<T>(shape, stride, stride, axes, pocketfft::BACKWARD,
-                      &hkl.data[0], &hkl.data[0], norm);
+    for (size_t i = 0; i != axes.size(); ++i)
+      impl::parallel_c2c<T>(shape, stride, axes[i], pocketfft::BACKWARD,
+                            &hkl.data[0], i == 0 ? norm : T(1), n_threads);
     assert(map.data.size() == hkl.data.size());
     for (size_t i = 0; i != map.data.size(); ++i)
       map.data[i] = hkl.data[i].real();
@@ -212,9 +301,11 @@ void transform_f_phi_grid_to_map_(Grid<std::complex<T>>&& hkl, Grid<T>& map) {
 }
 
 template<typename T>
-Grid<T> transform_f_phi_grid_to_map(Grid<std::complex<T>>&& hkl) {
+Grid<T> transform_f_phi_grid_to_map(Grid<std::complex<T>>&& hkl,
+                                    int n_threads=1) {
   Grid<T> map;
-  transform_f_phi_grid_to_map_(std::forward<Grid<std::complex<T>>>(hkl), map);
+  transform_f_phi_grid_to_map_(std::forward<Grid<std::complex<T>>>(hkl), map,
+                               n_threads);
   return map;
 }
 
@@ -234,11 +325,15 @@ Grid<T> transform_f_phi_to_map(const DataProxy& data,
                                                           size, true));
 }
 
+// The result is written to hkl, so in a loop the same grid can be reused
+// without reallocating memory. transform_f_phi_grid_to_map_() can also
+// be called repeatedly with the same map grid (hkl is overwritten there).
 template<typename T>
-Grid<std::complex<T>> transform_map_to_f_phi(const Grid<T>& map, bool half_l) {
-  Grid<std::complex<T>> hkl;
+void transform_map_to_f_phi_(const Grid<T>& map, Grid<std::complex<T>>& hkl,
+                             bool half_l, int n_threads=1) {
   hkl.unit_cell = map.unit_cell;
   hkl.half_l = half_l;
+  hkl.hkl_orient = HklOrient::HKL;
   hkl.spacegroup = map.spacegroup;
   int half_nw = map.nw / 2 + 1;
   hkl.set_size_without_checking(map.nu, map.nv, half_l ? half_nw : map.nw);
@@ -248,11 +343,13 @@ Grid<std::complex<T>> transform_map_to_f_phi(const Grid<T>& map, bool half_l) {
   std::ptrdiff_t s = sizeof(T);
   pocketfft::stride_t stride_in{s * hkl.nv * hkl.nu, s * hkl.nu, s};
   pocketfft::stride_t stride{2*s * hkl.nv * hkl.nu, 2*s * hkl.nu, 2*s};
-  pocketfft::r2c<T>(shape, stride_in, stride, /*axis=*/0, pocketfft::FORWARD,
-                    &map.data[0], &hkl.data[0], norm);
+  impl::parallel_r2c<T>(shape, stride_in, stride, /*axis=*/0,
+                        pocketfft::FORWARD, &map.data[0], &hkl.data[0], norm,
+                        n_threads);
   shape[0] = half_nw;
-  pocketfft::c2c<T>(shape, stride, stride, {1, 2}, pocketfft::FORWARD,
-                    &hkl.data[0], &hkl.data[0], 1.0f);
+  for (size_t axis : {1, 2})
+    impl::parallel_c2c<T>(shape, stride, axis, pocketfft::FORWARD,
+                          &hkl.data[0], T(1), n_threads);
   if (!half_l)  // add Friedel pairs
     for (int w = half_nw; w != hkl.nw; ++w) {
       int w_ = hkl.nw - w;
@@ -268,8 +365,200 @@ Grid<std::complex<T>> transform_map_to_f_phi(const Grid<T>& map, bool half_l) {
     }
   for (int i = 0; i != hkl.nu * hkl.nv * half_nw; ++i)
     hkl.data[i].imag(-hkl.data[i].imag());
+}
+
+template<typename T>
+Grid<std::complex<T>> transform_map_to_f_phi(const Grid<T>& map, bool half_l) {
+  Grid<std::complex<T>> hkl;
+  transform_map_to_f_phi_(map, hkl, half_l);
   return hkl;
 }
 
+// Map coefficients for Miller indices in a box: 0 <= h <= max_h,
+// |k| <= max_k, |l| <= max_l. Values for h < 0 are from Friedel mates.
+template<typename T>
+struct FPhiBox {
+  UnitCell unit_cell;
+  const SpaceGroup* spacegroup = nullptr;
+  int max_h = 0, max_k = 0, max_l = 0;
+  std::vector<std::complex<T>> data;
+
+  size_t index(int h, int k, int l) const {
+    return h + (max_h + 1) * ((size_t)(k + max_k) +
+                              (2 * max_k + 1) * (size_t)(l + max_l));
+  }
+  bool has_index(int h, int k, int l) const {
+    return std::abs(h) <= max_h && std::abs(k) <= max_k &&
+           std::abs(l) <= max_l;
+  }
+  std::complex<T> get_value(int h, int k, int l) const {
+    if (h < 0)
+      return std::conj(data[index(-h, -k, -l)]);
+    return data[index(h, k, l)];
+  }
+};
+
+// Like transform_map_to_f_phi(), but only coefficients up to resolution
+// d_min are calculated (all up to the Nyquist index n/2 if d_min is 0;
+// for even n, -n/2 and n/2 have the same value), and the
+// full reciprocal-space grid is never allocated. The map is transformed
+// along u, v and w in turn, and after each step only indices that can
+// be within d_min are kept; sections are processed on n_threads threads.
+template<typename T>
+FPhiBox<T> transform_map_to_f_phi_box(const Grid<T>& map, double d_min,
+                                      int n_threads=0) {
+  FPhiBox<T> box;
+  box.unit_cell = map.unit_cell;
+  box.spacegroup = map.spacegroup;
+  // |h| <= a/d_min, because h = a.s and |s| = 1/d
+  auto max_index = [&](int n, double length) {
+    int m = n / 2;
+    if (d_min > 0)
+      m = std::min(m, (int) std::floor(length / d_min));
+    return m;
+  };
+  box.max_h = max_index(map.nu, map.unit_cell.a);
+  box.max_k = max_index(map.nv, map.unit_cell.b);
+  box.max_l = max_index(map.nw, map.unit_cell.c);
+  const int nh = box.max_h + 1;
+  const int nk = 2 * box.max_k + 1;
+  const int nl = 2 * box.max_l + 1;
+  const int half_nu = map.nu / 2 + 1;
+  T norm = T(map.unit_cell.volume / map.point_count());
+  std::ptrdiff_t s = sizeof(T);
+  const size_t row_size = (size_t) nk * nh;
+  // FFT along u and v of each section, the kept part goes to slab[w][k][h];
+  // later slab becomes box.data, which may need one more row (see below)
+  std::vector<std::complex<T>> slab;
+  slab.reserve(std::max(map.nw, nl) * row_size);
+  slab.resize(map.nw * row_size);
+  parallel_for(map.nw, n_threads, [&](size_t w) {
+    std::vector<std::complex<T>> section((size_t) map.nv * half_nu);
+    pocketfft::shape_t shape{(size_t)map.nv, (size_t)map.nu};
+    pocketfft::stride_t stride_in{s * map.nu, s};
+    pocketfft::stride_t stride{2*s * half_nu, 2*s};
+    pocketfft::r2c<T>(shape, stride_in, stride, /*axis=*/1,
+                      pocketfft::FORWARD, &map.data[w * map.nv * map.nu],
+                      &section[0], norm);
+    shape[1] = nh;
+    pocketfft::c2c<T>(shape, stride, stride, {0}, pocketfft::FORWARD,
+                      &section[0], &section[0], T(1));
+    for (int k = -box.max_k; k <= box.max_k; ++k) {
+      const std::complex<T>* row = &section[(k >= 0 ? k : k + map.nv) *
+                                            half_nu];
+      std::copy(row, row + nh, &slab[(w * nk + k + box.max_k) * nh]);
+    }
+  });
+  // FFT along w of each column
+  parallel_for(nk, n_threads, [&](size_t k) {
+    pocketfft::shape_t shape{(size_t)map.nw, (size_t)nh};
+    pocketfft::stride_t stride{2*s * nk * nh, 2*s};
+    std::complex<T>* start = &slab[k * nh];
+    pocketfft::c2c<T>(shape, stride, stride, {0}, pocketfft::FORWARD,
+                      start, start, T(1));
+  });
+  // Rows of slab are reordered in place, from w = 0, 1, ..., nw-1
+  // to l = -max_l, ..., max_l, so no second buffer is needed.
+  // If max_l = nw/2, the Nyquist row is used for both -max_l and max_l.
+  const int n_pos = box.max_l + 1;  // l = 0, ..., max_l
+  const int n_neg = std::min(box.max_l, (map.nw - 1) / 2);  // -n_neg, ..., -1
+  auto row = [&](int n) { return slab.begin() + n * row_size; };
+  if (n_pos != map.nw - n_neg)
+    std::move(row(map.nw - n_neg), row(map.nw), row(n_pos));
+  slab.resize((n_pos + n_neg) * row_size);
+  std::rotate(row(0), row(n_pos), slab.end());
+  if (n_neg != box.max_l) {  // copy the Nyquist row to the front
+    slab.resize(nl * row_size);  // within the reserved capacity
+    std::copy(row(nl - 2), row(nl - 1), row(nl - 1));
+    std::rotate(row(0), row(nl - 1), slab.end());
+  }
+  for (std::complex<T>& x : slab)
+    x = std::conj(x);
+  // if d_min cut off many rows, release the memory
+  if (2 * slab.size() < slab.capacity())
+    slab.shrink_to_fit();
+  box.data = std::move(slab);
+  return box;
+}
+
+// Calls func(w, x, 1/d^2) for each coefficient x in the hkl grid
+// (w is the index of the section that contains x).
+// 1/d^2 is not calculated from scratch for each point: along a row it is
+// a quadratic function of the index, with coefficients set per row.
+// Sections (w = const) are processed in parallel.
+template<typename T, typename Func>
+void for_each_reciprocal_point(Grid<std::complex<T>>& hkl, Func func,
+                               int n_threads=0) {
+  const UnitCell& cell = hkl.unit_cell;
+  // reciprocal metric tensor
+  double g[3][3];
+  g[0][0] = cell.ar * cell.ar;
+  g[1][1] = cell.br * cell.br;
+  g[2][2] = cell.cr * cell.cr;
+  g[0][1] = g[1][0] = cell.ar * cell.br * cell.cos_gammar;
+  g[0][2] = g[2][0] = cell.ar * cell.cr * cell.cos_betar;
+  g[1][2] = g[2][1] = cell.br * cell.cr * cell.cos_alphar;
+  // Miller index (h, k or l) that corresponds to grid axes u, v, w
+  const bool lkh = hkl.hkl_orient == HklOrient::LKH;
+  const int hu = lkh ? 2 : 0;
+  const int hw = lkh ? 0 : 2;
+  auto miller_indices = [&](int n, bool half) {
+    std::vector<double> m(n);
+    for (int i = 0; i != n; ++i)
+      m[i] = half || 2 * i <= n ? i : i - n;
+    return m;
+  };
+  std::vector<double> mu = miller_indices(hkl.nu, hkl.half_l && lkh);
+  std::vector<double> mv = miller_indices(hkl.nv, false);
+  std::vector<double> mw = miller_indices(hkl.nw, hkl.half_l && !lkh);
+  parallel_for(hkl.nw, n_threads, [&](size_t w) {
+    double m3 = mw[w];
+    for (int v = 0; v != hkl.nv; ++v) {
+      double m2 = mv[v];
+      double a = g[hu][hu];
+      double b = 2 * (g[hu][1] * m2 + g[hu][hw] * m3);
+      double c = g[1][1] * m2 * m2 + g[hw][hw] * m3 * m3 +
+                 2 * g[1][hw] * m2 * m3;
+      std::complex<T>* row = &hkl.data[hkl.index_q(0, v, (int) w)];
+      for (int u = 0; u != hkl.nu; ++u) {
+        double m1 = mu[u];
+        func(w, row[u], (a * m1 + b) * m1 + c);
+      }
+    }
+  });
+}
+
+// Multiplies each coefficient in the hkl grid by weight(1/d^2).
+template<typename T, typename Func>
+void apply_reciprocal_weights(Grid<std::complex<T>>& hkl, Func weight,
+                              int n_threads=0) {
+  for_each_reciprocal_point(hkl, [&](size_t, std::complex<T>& x,
+                                     double inv_d2) {
+    x *= (T) weight(inv_d2);
+  }, n_threads);
+}
+
+// Blurring (b > 0) or sharpening (b < 0): F *= exp(-b/4 * 1/d^2).
+template<typename T>
+void apply_b_factor(Grid<std::complex<T>>& hkl, double b, int n_threads=0) {
+  double mult = -0.25 * b;
+  apply_reciprocal_weights(hkl, [mult](double inv_d2) {
+      return std::exp(mult * inv_d2);
+  }, n_threads);
+}
+
+// Sets to zero coefficients with resolution beyond d_min (low-pass filter)
+// and below d_max (high-pass filter, removes also F000).
+// d_min <= 0 or d_max = INFINITY means no limit.
+template<typename T>
+void apply_resolution_limits(Grid<std::complex<T>>& hkl, double d_min,
+                             double d_max=INFINITY, int n_threads=0) {
+  double max_1_d2 = d_min > 0 ? 1. / (d_min * d_min) : INFINITY;
+  double min_1_d2 = std::isinf(d_max) ? -1. : 1. / (d_max * d_max);
+  apply_reciprocal_weights(hkl, [&](double inv_d2) {
+      return inv_d2 <= max_1_d2 && inv_d2 >= min_1_d2 ? 1. : 0.;
+  }, n_threads);
+}
+
 } // namespace gemmi
 #endif
@@ -174,6 +174,61 @@ struct Grid {
 
   void fill(T value) { std::fill(data.begin(), data.end(), value); }
 
+  // Interpolation at (x, y, z) in grid coordinates (x = fractional x * nu),
+  // the grid is treated as periodic. Trilinear uses 8 points, tricubic
+  // (Catmull-Rom spline, which goes through the grid values) uses 64.
+  double trilinear_interpolation(double x, double y, double z) const {
+    std::array<int, 3> idx;
+    std::array<double, 3> t = split_grid_coord(x, y, z, idx);
+    int u0 = modulo(idx[0], nu), u1 = u0 + 1 != nu ? u0 + 1 : 0;
+    int v0 = modulo(idx[1], nv), v1 = v0 + 1 != nv ? v0 + 1 : 0;
+    int w0 = modulo(idx[2], nw), w1 = w0 + 1 != nw ? w0 + 1 : 0;
+    double avg[2];
+    for (int i = 0; i != 2; ++i) {
+      int w = i == 0 ? w0 : w1;
+      double a0 = data[index_q(u0, v0, w)] * (1 - t[0]) +
+                  data[index_q(u1, v0, w)] * t[0];
+      double a1 = data[index_q(u0, v1, w)] * (1 - t[0]) +
+                  data[index_q(u1, v1, w)] * t[0];
+      avg[i] = a0 * (1 - t[1]) + a1 * t[1];
+    }
+    return avg[0] * (1 - t[2]) + avg[1] * t[2];
+  }
+
+  double tricubic_interpolation(double x, double y, double z) const {
+    std::array<int, 3> idx;
+    std::array<double, 3> t = split_grid_coord(x, y, z, idx);
+    int us[4], vs[4], ws[4];
+    double wu[4], wv[4], ww[4];
+    for (int i = 0; i != 4; ++i) {
+      us[i] = modulo(idx[0] + i - 1, nu);
+      vs[i] = modulo(idx[1] + i - 1, nv) * nu;
+      ws[i] = modulo(idx[2] + i - 1, nw) * nu * nv;
+    }
+    catmull_rom_weights(t[0], wu);
+    catmull_rom_weights(t[1], wv);
+    catmull_rom_weights(t[2], ww);
+    double sum = 0;
+    for (int k = 0; k != 4; ++k)
+      for (int j = 0; j != 4; ++j) {
+        const T* row = &data[ws[k] + vs[j]];
+        double s = wu[0] * row[us[0]] + wu[1] * row[us[1]] +
+                   wu[2] * row[us[2]] + wu[3] * row[us[3]];
+        sum += ww[k] * wv[j] * s;
+      }
+    return sum;
+  }
+
+  double interpolate_value(const Fractional& fctr) const {
+    return trilinear_interpolation(fctr.x * nu, fctr.y * nv, fctr.z * nw);
+  }
+  double interpolate_value(const Position& ctr) const {
+    return interpolate_value(unit_cell.fractionalize(ctr));
+  }
+  double tricubic_interpolation(const Fractional& fctr) const {
+    return tricubic_interpolation(fctr.x * nu, fctr.y * nv, fctr.z * nw);
+  }
+
   void set_points_around(const Position& ctr, double radius, T value) {
     int du = (int) std::ceil(radius / spacing[0]);
     int dv = (int) std::ceil(radius / spacing[1]);
@@ -184,18 +239,36 @@ struct Grid {
     int u0 = iround(fctr.x * nu);
     int v0 = iround(fctr.y * nv);
     int w0 = iround(fctr.z * nw);
-    for (int w = w0-dw; w <= w0+dw; ++w)
-      for (int v = v0-dv; v <= v0+dv; ++v)
-        for (int u = u0-du; u <= u0+du; ++u) {
-          Fractional fdelta{fctr.x - u * (1.0 / nu),
-                            fctr.y - v * (1.0 / nv),
-                            fctr.z - w * (1.0 / nw)};
-          fdelta.move_toward_zero_by_one();
-          Position d = unit_cell.orthogonalize(fdelta);
-          if (d.x*d.x + d.y*d.y + d.z*d.z < radius*radius) {
-            data[index_n(u, v, w)] = value;
-          }
+    // The orthogonal distance is a sum of contributions from fractional
+    // deltas along each axis; these contributions and wrapped indices
+    // are calculated once per axis rather than for each point.
+    const Mat33& m = unit_cell.orth.mat;
+    auto axis_deltas = [&](int n, int c0, int dc, double fc, int col,
+                           std::vector<Vec3>& delta, std::vector<int>& idx) {
+      for (int c = c0 - dc; c <= c0 + dc; ++c) {
+        double f = fc - c * (1.0 / n);
+        if (f > 0.5) f -= 1.0; else if (f < -0.5) f += 1.0;
+        delta.emplace_back(m[0][col] * f, m[1][col] * f, m[2][col] * f);
+        idx.push_back(modulo(c, n));
+      }
+    };
+    std::vector<Vec3> ou, ov, ow;
+    std::vector<int> iu, iv, iw;
+    axis_deltas(nu, u0, du, fctr.x, 0, ou, iu);
+    axis_deltas(nv, v0, dv, fctr.y, 1, ov, iv);
+    axis_deltas(nw, w0, dw, fctr.z, 2, ow, iw);
+    const double radius_sq = radius * radius;
+    for (size_t k = 0; k != ow.size(); ++k)
+      for (size_t j = 0; j != ov.size(); ++j) {
+        T* row = &data[index_q(0, iv[j], iw[k])];
+        for (size_t i = 0; i != ou.size(); ++i) {
+          double x = ou[i].x + ov[j].x + ow[k].x;
+          double y = ou[i].y + ov[j].y + ow[k].y;
+          double z = ou[i].z + ov[j].z + ow[k].z;
+          if (x*x + y*y + z*z < radius_sq)
+            row[iu[i]] = value;
         }
+      }
   }
 
   void mask_atom(double x, double y, double z, double radius) {
@@ -289,6 +362,25 @@ struct Grid {
             }
     return mask;
   }
+
+private:
+  // integer part goes to idx, fractional part is returned
+  static std::array<double, 3> split_grid_coord(double x, double y, double z,
+                                                std::array<int, 3>& idx) {
+    double fl[3] = {std::floor(x), std::floor(y), std::floor(z)};
+    idx = {{(int) fl[0], (int) fl[1], (int) fl[2]}};
+    return {{x - fl[0], y - fl[1], z - fl[2]}};
+  }
+
+  // weights of points -1, 0, 1, 2 for t in [0, 1)
+  static void catmull_rom_weights(double t, double* w) {
+    double t2 = t * t;
+    double t3 = t2 * t;
+    w[0] = -0.5 * t3 + t2 - 0.5 * t;
+    w[1] = 1.5 * t3 - 2.5 * t2 + 1.0;
+    w[2] = -1.5 * t3 + 2.0 * t2 + 0.5 * t;
+    w[3] = 0.5 * t3 - 0.5 * t2;
+  }
 };
 
 } // namespace gemmi
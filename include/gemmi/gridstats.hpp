@@ -0,0 +1,347 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Statistics of map values: min, max, mean and rms, histogram,
+// and the n-th smallest value (median, threshold for a given fraction)
+// found without copying and sorting the data.
+
+#ifndef GEMMI_GRIDSTATS_HPP_
+#define GEMMI_GRIDSTATS_HPP_
+
+#include <algorithm>     // for min, nth_element
+#include <cmath>         // for NAN, sqrt, floor
+#include <vector>
+#include "grid.hpp"      // for Grid
+#include "fail.hpp"      // for fail
+#include "parallel.hpp"  // for parallel_for
+
+namespace gemmi {
+
+struct GridStats {
+  double dmin = NAN;
+  double dmax = NAN;
+  double dmean = NAN;
+  double rms = NAN;
+};
+
+namespace impl {
+// Mean and the sum of squared deviations (M2) are calculated for blocks
+// of data in two passes, and blocks are combined using the formula
+// of Chan et al. This is stable for large maps, and since blocks have
+// fixed size and are merged in order, the result does not depend on
+// the number of threads.
+struct StatsAccumulator {
+  static constexpr size_t block_size = 16384;
+  size_t n = 0;
+  double mean = 0.;
+  double m2 = 0.;
+  double dmin = NAN;
+  double dmax = NAN;
+
+  // pred(i) selects points, it is used for masked statistics
+  template<typename T, typename Pred>
+  void add_block(const T* data, size_t begin, size_t end, Pred pred) {
+    StatsAccumulator b;
+    double sum = 0.;
+    for (size_t i = begin; i != end; ++i)
+      if (pred(i)) {
+        double d = data[i];
+        if (b.n++ == 0) {
+          b.dmin = b.dmax = d;
+        } else {
+          if (d < b.dmin)
+            b.dmin = d;
+          if (d > b.dmax)
+            b.dmax = d;
+        }
+        sum += d;
+      }
+    if (b.n == 0)
+      return;
+    b.mean = sum / b.n;
+    for (size_t i = begin; i != end; ++i)
+      if (pred(i))
+        b.m2 += sq(data[i] - b.mean);
+    merge(b);
+  }
+
+  void merge(const StatsAccumulator& b) {
+    if (b.n == 0)
+      return;
+    if (n == 0) {
+      *this = b;
+      return;
+    }
+    size_t total = n + b.n;
+    double delta = b.mean - mean;
+    mean += delta * b.n / total;
+    m2 += b.m2 + sq(delta) * ((double) n * b.n / total);
+    n = total;
+    if (b.dmin < dmin)
+      dmin = b.dmin;
+    if (b.dmax > dmax)
+      dmax = b.dmax;
+  }
+
+  GridStats to_stats() const {
+    GridStats st;
+    if (n != 0) {
+      st.dmin = dmin;
+      st.dmax = dmax;
+      st.dmean = mean;
+      st.rms = std::sqrt(m2 / n);
+    }
+    return st;
+  }
+};
+
+template<typename T, typename Pred>
+GridStats calculate_statistics(const std::vector<T>& data, int n_threads,
+                               Pred pred) {
+  const size_t bs = StatsAccumulator::block_size;
+  size_t n_blocks = (data.size() + bs - 1) / bs;
+  std::vector<StatsAccumulator> blocks(n_blocks);
+  parallel_for(n_blocks, n_threads, [&](size_t i) {
+    blocks[i].add_block(data.data(), i * bs,
+                        std::min(data.size(), (i + 1) * bs), pred);
+  });
+  StatsAccumulator acc;
+  for (const StatsAccumulator& b : blocks)
+    acc.merge(b);
+  return acc.to_stats();
+}
+
+// Splits [0, n) into up to n_threads contiguous parts, calls
+// func(part, begin, end) for each part and returns the number of parts.
+template<typename Func>
+int for_each_part(size_t n, int n_threads, Func func) {
+  if (n_threads <= 0)
+    n_threads = default_thread_count();
+  // small data is not worth splitting
+  int n_parts = (int) std::max<size_t>(1, std::min<size_t>(n_threads,
+                                                           n / 65536));
+  parallel_for(n_parts, n_parts, [&](size_t k) {
+    func((int) k, n * k / n_parts, n * (k + 1) / n_parts);
+  });
+  return n_parts;
+}
+} // namespace impl
+
+// Serial version, used also in Ccp4::update_ccp4_header().
+template<typename T>
+GridStats calculate_grid_statistics(const std::vector<T>& data) {
+  impl::StatsAccumulator acc;
+  const size_t bs = impl::StatsAccumulator::block_size;
+  for (size_t i = 0; i < data.size(); i += bs)
+    acc.add_block(data.data(), i, std::min(data.size(), i + bs),
+                  [](size_t) { return true; });
+  return acc.to_stats();
+}
+
+// Multithreaded version (n_threads <= 0 means default_thread_count()).
+// The result is the same as from the serial version.
+template<typename T>
+GridStats calculate_grid_statistics(const std::vector<T>& data,
+                                    int n_threads) {
+  return impl::calculate_statistics(data, n_threads,
+                                    [](size_t) { return true; });
+}
+
+// Statistics of grid points for which the mask value is not zero.
+template<typename T>
+GridStats calculate_masked_statistics(const Grid<T>& grid,
+                                      const Grid<signed char>& mask,
+                                      int n_threads=0) {
+  if (mask.data.size() != grid.data.size())
+    fail("calculate_masked_statistics: mask and grid differ in size");
+  return impl::calculate_statistics(grid.data, n_threads, [&](size_t i) {
+      return mask.data[i] != 0;
+  });
+}
+
+struct Histogram {
+  double min = 0.;
+  double max = 0.;
+  std::vector<size_t> counts;
+  size_t total = 0;
+
+  double bin_width() const { return (max - min) / counts.size(); }
+  double bin_start(int n) const { return min + n * bin_width(); }
+
+  // Approximate value below which the given percent of values lies,
+  // interpolated linearly within a bin.
+  double percentile(double percent) const {
+    double target = percent * 0.01 * total;
+    double cumulative = 0.;
+    for (size_t i = 0; i != counts.size(); ++i) {
+      if (cumulative + counts[i] >= target && counts[i] != 0)
+        return bin_start((int) i) +
+               (target - cumulative) / counts[i] * bin_width();
+      cumulative += counts[i];
+    }
+    return max;
+  }
+};
+
+namespace impl {
+template<typename T, typename Pred>
+Histogram calculate_histogram(const std::vector<T>& data, int n_bins,
+                              double min, double max, int n_threads,
+                              Pred pred) {
+  Histogram hist;
+  hist.min = min;
+  hist.max = max;
+  hist.counts.resize(n_bins, 0);
+  double scale = n_bins / (max - min);
+  std::vector<std::vector<size_t>> partial(n_threads > 0 ? n_threads
+                                                     : default_thread_count());
+  int n_parts = for_each_part(data.size(), (int) partial.size(),
+                              [&](int k, size_t begin, size_t end) {
+    std::vector<size_t>& counts = partial[k];
+    counts.resize(n_bins, 0);
+    for (size_t i = begin; i != end; ++i) {
+      double d = data[i];
+      if (d != d || !pred(i))
+        continue;
+      double x = std::floor((d - min) * scale);
+      int n = x >= 0 ? (x < n_bins ? (int) x : n_bins - 1) : 0;
+      counts[n]++;
+    }
+  });
+  for (int k = 0; k != n_parts; ++k)
+    for (int i = 0; i != n_bins; ++i)
+      hist.counts[i] += partial[k][i];
+  for (size_t c : hist.counts)
+    hist.total += c;
+  return hist;
+}
+} // namespace impl
+
+// Counts values in n_bins bins of equal width between min and max.
+// Values below min and above max are counted in the first and the last
+// bin, respectively; NaNs are skipped.
+template<typename T>
+Histogram calculate_histogram(const std::vector<T>& data, int n_bins,
+                              double min, double max, int n_threads=0) {
+  return impl::calculate_histogram(data, n_bins, min, max, n_threads,
+                                   [](size_t) { return true; });
+}
+
+// Histogram of grid points for which the mask value is not zero.
+template<typename T>
+Histogram calculate_masked_histogram(const Grid<T>& grid,
+                                     const Grid<signed char>& mask,
+                                     int n_bins, double min, double max,
+                                     int n_threads=0) {
+  if (mask.data.size() != grid.data.size())
+    fail("calculate_masked_histogram: mask and grid differ in size");
+  return impl::calculate_histogram(grid.data, n_bins, min, max, n_threads,
+                                   [&](size_t i) {
+      return mask.data[i] != 0;
+  });
+}
+
+// Returns the same value as std::nth_element() would put at position n,
+// without copying and reordering the data. Each pass over the data counts
+// values in bins (and tracks min and max of each bin); the search is
+// narrowed to the bin with the n-th value until only a few values are left,
+// which are then copied and passed to std::nth_element().
+// Data must not contain NaNs.
+template<typename T>
+T find_nth_smallest(const std::vector<T>& data, size_t n, int n_threads=0) {
+  if (n >= data.size())
+    fail("find_nth_smallest: index out of range");
+  if (n_threads <= 0)
+    n_threads = default_thread_count();
+  const int n_bins = 4096;
+  const size_t max_copied = 65536;
+  struct Bins {
+    std::vector<size_t> counts;
+    std::vector<T> min;
+    std::vector<T> max;
+  };
+  std::vector<Bins> partial(n_threads);
+  // we are looking for the n-th smallest value among values in [lo, hi]
+  T lo = data[0];
+  T hi = data[0];
+  int n_parts = impl::for_each_part(data.size(), n_threads,
+                                    [&](int k, size_t begin, size_t end) {
+    Bins& b = partial[k];
+    b.min.assign(1, data[begin]);
+    b.max.assign(1, data[begin]);
+    for (size_t i = begin; i != end; ++i) {
+      if (data[i] < b.min[0])
+        b.min[0] = data[i];
+      if (data[i] > b.max[0])
+        b.max[0] = data[i];
+    }
+  });
+  for (int k = 0; k != n_parts; ++k) {
+    lo = std::min(lo, partial[k].min[0]);
+    hi = std::max(hi, partial[k].max[0]);
+  }
+  for (;;) {
+    if (!(lo < hi))
+      return lo;
+    double dlo = lo;
+    double scale = n_bins / ((double) hi - dlo);
+    // monotonic, bin_of(lo) == 0, bin_of(hi) == n_bins - 1
+    auto bin_of = [&](T x) {
+      return std::min((int) ((x - dlo) * scale), n_bins - 1);
+    };
+    n_parts = impl::for_each_part(data.size(), n_threads,
+                                  [&](int k, size_t begin, size_t end) {
+      Bins& b = partial[k];
+      b.counts.assign(n_bins, 0);
+      b.min.assign(n_bins, hi);
+      b.max.assign(n_bins, lo);
+      for (size_t i = begin; i != end; ++i) {
+        T x = data[i];
+        if (x < lo || x > hi)
+          continue;
+        int bin = bin_of(x);
+        b.counts[bin]++;
+        if (x < b.min[bin])
+          b.min[bin] = x;
+        if (x > b.max[bin])
+          b.max[bin] = x;
+      }
+    });
+    size_t count = 0;
+    int bin = 0;
+    for (; bin != n_bins; ++bin) {
+      count = 0;
+      for (int k = 0; k != n_parts; ++k)
+        count += partial[k].counts[bin];
+      if (n < count)
+        break;
+      n -= count;
+    }
+    // bins are ordered, so values from other bins are outside of new range
+    T new_lo = hi;
+    T new_hi = lo;
+    for (int k = 0; k != n_parts; ++k)
+      if (partial[k].counts[bin] != 0) {
+        new_lo = std::min(new_lo, partial[k].min[bin]);
+        new_hi = std::max(new_hi, partial[k].max[bin]);
+      }
+    lo = new_lo;
+    hi = new_hi;
+    if (count <= max_copied && lo < hi) {
+      std::vector<std::vector<T>> selected(n_parts);
+      impl::for_each_part(data.size(), n_parts,
+                          [&](int k, size_t begin, size_t end) {
+        for (size_t i = begin; i != end; ++i)
+          if (!(data[i] < lo || data[i] > hi))
+            selected[k].push_back(data[i]);
+      });
+      std::vector<T>& all = selected[0];
+      for (int k = 1; k != n_parts; ++k)
+        all.insert(all.end(), selected[k].begin(), selected[k].end());
+      std::nth_element(all.begin(), all.begin() + n, all.end());
+      return all[n];
+    }
+  }
+}
+
+} // namespace gemmi
+#endif
@@ -0,0 +1,239 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Running the same job on many inputs (usually files) in a pool of threads.
+// Results are passed to the calling thread in the order of inputs,
+// an exception in one job is reported as a failure of that input only.
+//
+// Usage:
+//   JobScheduler scheduler(n_threads);
+//   scheduler.run<std::string>(next_path,
+//       [](const std::string& path, int worker) { return process(path); },
+//       [](const std::string& path, JobResult<Output>& r) { print(r); });
+
+#ifndef GEMMI_JOBS_HPP_
+#define GEMMI_JOBS_HPP_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>     // for fprintf
+#include <exception>  // for exception_ptr
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>    // for move, declval
+#include <vector>
+#include "parallel.hpp"  // for default_thread_count
+
+namespace gemmi {
+
+template<typename T>
+struct JobResult {
+  T value;
+  std::string error;  // what() of the exception or "unknown error"
+  bool ok() const { return error.empty(); }
+};
+
+struct JobStats {
+  size_t done = 0;    // results passed to the consumer
+  size_t failed = 0;  // jobs that threw an exception
+  double seconds = 0.;
+  double per_second() const { return seconds > 0 ? done / seconds : 0.; }
+};
+
+inline void print_job_progress(const JobStats& stats) {
+  std::fprintf(stderr, "%zu done, %zu failed, %.1f s (%.1f/s)\n",
+               stats.done, stats.failed, stats.seconds, stats.per_second());
+}
+
+class JobScheduler {
+public:
+  // n_threads <= 0 means default_thread_count().
+  // At most max_pending (default: 4 per thread) inputs can be taken
+  // before their results are consumed, which bounds the memory used
+  // by results waiting for a slow job that precedes them.
+  explicit JobScheduler(int n_threads=0, size_t max_pending=0)
+    : n_workers_(n_threads > 0 ? n_threads : default_thread_count()),
+      max_pending_(max_pending != 0 ? max_pending : 4 * n_workers_) {}
+
+  int n_workers() const { return n_workers_; }
+
+  // Calls func(stats) from the calling thread every interval seconds.
+  void set_progress(double interval,
+                    std::function<void(const JobStats&)> func) {
+    progress_interval_ = interval;
+    progress_func_ = std::move(func);
+  }
+
+  // Can be called from consume() to stop taking new inputs.
+  // Results of jobs that are already running are discarded.
+  void cancel() { cancelled_ = true; }
+
+  // Input next_input(Input&) returns false when there are no more inputs;
+  // it is called by one thread at a time (not necessarily the same one).
+  // R job(const Input&, int worker) runs in a worker thread;
+  // worker is in [0, n_workers()), so it can index per-worker scratch data.
+  // consume(const Input&, JobResult<R>&) runs in the calling thread.
+  // Exceptions from next_input and consume are propagated.
+  template<typename Input, typename NextInput, typename Job, typename Consume>
+  JobStats run(NextInput next_input, Job job, Consume consume);
+
+  // Same as above, with inputs 0, 1, ..., n-1.
+  template<typename Job, typename Consume>
+  JobStats run_n(size_t n, Job job, Consume consume) {
+    size_t counter = 0;
+    return run<size_t>([&](size_t& i) {
+      if (counter == n)
+        return false;
+      i = counter++;
+      return true;
+    }, job, consume);
+  }
+
+private:
+  int n_workers_;
+  size_t max_pending_;
+  double progress_interval_ = 0.;
+  std::function<void(const JobStats&)> progress_func_;
+  bool cancelled_ = false;
+
+  template<typename R, typename Input, typename Job>
+  static void run_job(Job& job, const Input& input, int worker,
+                      JobResult<R>& result) {
+    try {
+      result.value = job(input, worker);
+    } catch (std::exception& e) {
+      result.error = e.what();
+      if (result.error.empty())
+        result.error = "unknown error";
+    } catch (...) {
+      result.error = "unknown error";
+    }
+  }
+};
+
+template<typename Input, typename NextInput, typename Job, typename Consume>
+JobStats JobScheduler::run(NextInput next_input, Job job, Consume consume) {
+  using R = decltype(job(std::declval<const Input&>(), 0));
+  using Clock = std::chrono::steady_clock;
+  const Clock::time_point start = Clock::now();
+  Clock::time_point last_report = start;
+  JobStats stats;
+  cancelled_ = false;
+  auto pass_result = [&](const Input& input, JobResult<R>& result) {
+    if (!result.ok())
+      ++stats.failed;
+    ++stats.done;
+    consume(input, result);
+    if (progress_func_) {
+      Clock::time_point now = Clock::now();
+      if (std::chrono::duration<double>(now - last_report).count()
+          >= progress_interval_) {
+        last_report = now;
+        stats.seconds = std::chrono::duration<double>(now - start).count();
+        progress_func_(stats);
+      }
+    }
+  };
+
+  if (n_workers_ == 1) {
+    Input input;
+    while (!cancelled_ && next_input(input)) {
+      JobResult<R> result;
+      run_job(job, input, 0, result);
+      pass_result(input, result);
+    }
+  } else {
+    struct Slot {
+      Input input;
+      JobResult<R> result;
+      bool ready = false;
+    };
+    std::vector<Slot> slots(max_pending_);
+    std::mutex mutex;
+    std::condition_variable worker_cv;
+    std::condition_variable consumer_cv;
+    size_t taken = 0;     // number of inputs taken by workers
+    size_t consumed_n = 0;
+    bool no_more_inputs = false;
+    bool stop = false;
+    std::exception_ptr input_error;
+
+    auto worker = [&](int worker_idx) {
+      std::unique_lock<std::mutex> lock(mutex);
+      for (;;) {
+        worker_cv.wait(lock, [&]() {
+            return stop || no_more_inputs || taken - consumed_n < max_pending_;
+        });
+        if (stop || no_more_inputs)
+          return;
+        Slot& slot = slots[taken % max_pending_];
+        bool has_input = false;
+        try {
+          has_input = next_input(slot.input);
+        } catch (...) {
+          input_error = std::current_exception();
+        }
+        if (!has_input) {
+          no_more_inputs = true;
+          worker_cv.notify_all();
+          consumer_cv.notify_one();
+          return;
+        }
+        ++taken;
+        lock.unlock();
+        run_job(job, slot.input, worker_idx, slot.result);
+        lock.lock();
+        slot.ready = true;
+        consumer_cv.notify_one();
+      }
+    };
+    std::vector<std::thread> threads;
+    threads.reserve(n_workers_);
+    for (int i = 0; i != n_workers_; ++i)
+      threads.emplace_back(worker, i);
+    auto stop_workers = [&]() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+      }
+      worker_cv.notify_all();
+      for (std::thread& t : threads)
+        t.join();
+    };
+
+    try {
+      for (;;) {
+        std::unique_lock<std::mutex> lock(mutex);
+        Slot& slot = slots[consumed_n % max_pending_];
+        consumer_cv.wait(lock, [&]() {
+            return slot.ready || (no_more_inputs && consumed_n == taken);
+        });
+        if (!slot.ready)
+          break;
+        lock.unlock();
+        // the slot is not reused by workers until consumed_n is incremented
+        pass_result(slot.input, slot.result);
+        slot.result = JobResult<R>();
+        lock.lock();
+        slot.ready = false;
+        ++consumed_n;
+        worker_cv.notify_one();
+        if (cancelled_)
+          break;
+      }
+    } catch (...) {
+      stop_workers();
+      throw;
+    }
+    stop_workers();
+    if (input_error && !cancelled_)
+      std::rethrow_exception(input_error);
+  }
+  stats.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  return stats;
+}
+
+} // namespace gemmi
+#endif
@@ -8,7 +8,7 @@
 
 #include "model.hpp"
 #include "seqalign.hpp"  // for align_sequences
-#include "polyheur.hpp"  // for are_connected3
+#include "polyheur.hpp"  // for are_connected3, BackboneAtoms
 
 namespace gemmi {
 
@@ -26,8 +26,14 @@ inline std::vector<bool> prepare_free_gapo(const ConstResidueSpan& polymer,
   gaps.push_back(true); // free gap opening at the beginning of sequence
   auto first_conformer = polymer.first_conformer();
   auto res = first_conformer.begin();
-  for (auto next_res = res; ++next_res != first_conformer.end(); res = next_res)
-    gaps.push_back(!are_connected3(*res, *next_res, polymer_type));
+  if (res == first_conformer.end())
+    return gaps;
+  BackboneAtoms prev(*res);
+  while (++res != first_conformer.end()) {
+    BackboneAtoms backbone(*res);
+    gaps.push_back(!are_connected3(prev, backbone, polymer_type));
+    prev = backbone;
+  }
   return gaps;
 }
 
@@ -208,6 +208,24 @@ struct Transform {
   }
 };
 
+// Applies tr to n points stored as separate x, y and z arrays (structure
+// of arrays). Output arrays can be the same as input arrays.
+// A simple loop that compilers can vectorize; the result is the same
+// as from tr.apply().
+inline void transform_soa(const Transform& tr,
+                          const double* x, const double* y, const double* z,
+                          double* out_x, double* out_y, double* out_z,
+                          size_t n) {
+  const Mat33& m = tr.mat;
+  const Vec3& v = tr.vec;
+  for (size_t i = 0; i < n; ++i) {
+    double px = x[i], py = y[i], pz = z[i];
+    out_x[i] = (m[0][0] * px + m[0][1] * py + m[0][2] * pz) + v.x;
+    out_y[i] = (m[1][0] * px + m[1][1] * py + m[1][2] * pz) + v.y;
+    out_z[i] = (m[2][0] * px + m[2][1] * py + m[2][2] * pz) + v.z;
+  }
+}
+
 struct BoundingBox {
   Vec3 low = Vec3(INFINITY, INFINITY, INFINITY);
   Vec3 high = Vec3(-INFINITY, -INFINITY, -INFINITY);
@@ -272,6 +290,21 @@ struct Correlation {
     mean_x += dx / n;
     mean_y += dy / n;
   }
+  // combines statistics of two sets of points (Chan et al. formula)
+  void merge(const Correlation& o) {
+    if (o.n == 0)
+      return;
+    int total = n + o.n;
+    double weight = (double) n * o.n / total;
+    double dx = o.mean_x - mean_x;
+    double dy = o.mean_y - mean_y;
+    sum_xx += o.sum_xx + weight * dx * dx;
+    sum_yy += o.sum_yy + weight * dy * dy;
+    sum_xy += o.sum_xy + weight * dx * dy;
+    mean_x += dx * o.n / total;
+    mean_y += dy * o.n / total;
+    n = total;
+  }
   double coefficient() const { return sum_xy / std::sqrt(sum_xx * sum_yy); }
   double x_variance() const { return sum_xx / n; }
   double y_variance() const { return sum_yy / n; }
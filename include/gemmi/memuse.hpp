@@ -0,0 +1,208 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Estimates of memory used by Document, Structure, Mtz and Grid.
+// Each memory_usage() returns the size of the object itself plus
+// the heap memory it owns (vector capacities, long strings).
+// Allocator overhead is not included, so the real usage is somewhat larger.
+
+#ifndef GEMMI_MEMUSE_HPP_
+#define GEMMI_MEMUSE_HPP_
+
+#include <cstddef>     // for size_t
+#include <map>
+#include <string>
+#include <vector>
+#include "cifdoc.hpp"  // for Document
+#include "model.hpp"   // for Structure
+#include "mtz.hpp"     // for Mtz
+#include "grid.hpp"    // for Grid
+
+namespace gemmi {
+
+// Heap memory owned by the object, not including sizeof the object.
+namespace impl {
+
+// The overloads are declared upfront, so that the templates below
+// can find them regardless of the order of definitions.
+inline size_t heap_usage(const std::string& s);
+inline size_t heap_usage(const cif::Loop& loop);
+inline size_t heap_usage(const cif::Item& item);
+inline size_t heap_usage(const cif::Block& b);
+inline size_t heap_usage(const Atom& a);
+inline size_t heap_usage(const ResidueId& rid);
+inline size_t heap_usage(const Residue& res);
+inline size_t heap_usage(const Chain& ch);
+inline size_t heap_usage(const AtomAddress& a);
+inline size_t heap_usage(const Connection& c);
+inline size_t heap_usage(const Model& m);
+inline size_t heap_usage(const Entity& ent);
+inline size_t heap_usage(const NcsOp& op);
+inline size_t heap_usage(const Helix& h);
+inline size_t heap_usage(const Sheet::Strand& s);
+inline size_t heap_usage(const Sheet& s);
+inline size_t heap_usage(const Assembly::Oper& op);
+inline size_t heap_usage(const Assembly::Gen& gen);
+inline size_t heap_usage(const Assembly& a);
+inline size_t heap_usage(const Mtz::Dataset& ds);
+inline size_t heap_usage(const Mtz::Column& col);
+inline size_t heap_usage(const Mtz::Batch& b);
+
+// types that do not own heap memory (numbers, Op, Transform, ...)
+template<typename T> size_t heap_usage(const T&) { return 0; }
+
+template<typename T> size_t heap_usage(const std::vector<T>& v) {
+  size_t n = v.capacity() * sizeof(T);
+  for (const T& x : v)
+    n += heap_usage(x);
+  return n;
+}
+
+template<typename K, typename V>
+size_t heap_usage(const std::map<K, V>& m) {
+  // a red-black tree node has 3 pointers and a color field before the value
+  const size_t node_size = 4 * sizeof(void*) + sizeof(std::pair<const K, V>);
+  size_t n = m.size() * node_size;
+  for (const auto& kv : m)
+    n += heap_usage(kv.first) + heap_usage(kv.second);
+  return n;
+}
+
+inline size_t heap_usage(const std::string& s) {
+  // strings that fit in the small string buffer do not allocate
+  static const size_t sso_capacity = std::string().capacity();
+  return s.capacity() > sso_capacity ? s.capacity() + 1 : 0;
+}
+
+inline size_t heap_usage(const cif::Loop& loop) {
+  return heap_usage(loop.tags) + heap_usage(loop.values);
+}
+
+inline size_t heap_usage(const cif::Item& item) {
+  switch (item.type) {
+    case cif::ItemType::Pair:
+    case cif::ItemType::Comment:
+      return heap_usage(item.pair[0]) + heap_usage(item.pair[1]);
+    case cif::ItemType::Loop:
+      return heap_usage(item.loop);
+    case cif::ItemType::Frame:
+      return heap_usage(item.frame);
+    case cif::ItemType::Erased:
+      break;
+  }
+  return 0;
+}
+
+inline size_t heap_usage(const cif::Block& b) {
+  return heap_usage(b.name) + heap_usage(b.items);
+}
+
+inline size_t heap_usage(const Atom& a) { return heap_usage(a.name); }
+
+inline size_t heap_usage(const ResidueId& rid) {
+  return heap_usage(rid.segment) + heap_usage(rid.name);
+}
+
+inline size_t heap_usage(const Residue& res) {
+  return heap_usage(static_cast<const ResidueId&>(res)) +
+         heap_usage(res.subchain) + heap_usage(res.atoms);
+}
+
+inline size_t heap_usage(const Chain& ch) {
+  return heap_usage(ch.name) + heap_usage(ch.residues);
+}
+
+inline size_t heap_usage(const AtomAddress& a) {
+  return heap_usage(a.chain_name) + heap_usage(a.res_id) +
+         heap_usage(a.atom_name);
+}
+
+inline size_t heap_usage(const Connection& c) {
+  return heap_usage(c.name) + heap_usage(c.atom[0]) + heap_usage(c.atom[1]);
+}
+
+inline size_t heap_usage(const Model& m) {
+  return heap_usage(m.name) + heap_usage(m.chains) +
+         heap_usage(m.connections);
+}
+
+inline size_t heap_usage(const Entity& ent) {
+  return heap_usage(ent.name) + heap_usage(ent.subchains) +
+         heap_usage(ent.full_sequence);
+}
+
+inline size_t heap_usage(const NcsOp& op) { return heap_usage(op.id); }
+
+inline size_t heap_usage(const Helix& h) {
+  return heap_usage(h.start) + heap_usage(h.end);
+}
+
+inline size_t heap_usage(const Sheet::Strand& s) {
+  return heap_usage(s.start) + heap_usage(s.end) + heap_usage(s.hbond_atom2) +
+         heap_usage(s.hbond_atom1) + heap_usage(s.name);
+}
+
+inline size_t heap_usage(const Sheet& s) {
+  return heap_usage(s.name) + heap_usage(s.strands);
+}
+
+inline size_t heap_usage(const Assembly::Oper& op) {
+  return heap_usage(op.name) + heap_usage(op.type);
+}
+
+inline size_t heap_usage(const Assembly::Gen& gen) {
+  return heap_usage(gen.chains) + heap_usage(gen.subchains) +
+         heap_usage(gen.opers);
+}
+
+inline size_t heap_usage(const Assembly& a) {
+  return heap_usage(a.name) + heap_usage(a.oligomeric_details) +
+         heap_usage(a.software_name) + heap_usage(a.generators);
+}
+
+inline size_t heap_usage(const Mtz::Dataset& ds) {
+  return heap_usage(ds.project_name) + heap_usage(ds.crystal_name) +
+         heap_usage(ds.dataset_name);
+}
+
+inline size_t heap_usage(const Mtz::Column& col) {
+  return heap_usage(col.label) + heap_usage(col.source);
+}
+
+inline size_t heap_usage(const Mtz::Batch& b) {
+  return heap_usage(b.title) + heap_usage(b.ints) + heap_usage(b.floats) +
+         heap_usage(b.axes);
+}
+} // namespace impl
+
+inline size_t memory_usage(const cif::Document& doc) {
+  return sizeof(doc) + impl::heap_usage(doc.source) +
+         impl::heap_usage(doc.blocks);
+}
+
+// Models dominate the total; metadata (info, remarks, entities, etc)
+// is included too, but for most files it is a small fraction.
+inline size_t memory_usage(const Structure& st) {
+  using impl::heap_usage;
+  return sizeof(st) + heap_usage(st.name) + heap_usage(st.spacegroup_hm) +
+         heap_usage(st.models) + heap_usage(st.ncs) + heap_usage(st.entities) +
+         heap_usage(st.helices) + heap_usage(st.sheets) +
+         heap_usage(st.assemblies) + heap_usage(st.info) +
+         heap_usage(st.raw_remarks);
+}
+
+inline size_t memory_usage(const Mtz& mtz) {
+  using impl::heap_usage;
+  return sizeof(mtz) + heap_usage(mtz.version_stamp) + heap_usage(mtz.title) +
+         heap_usage(mtz.spacegroup_name) + heap_usage(mtz.symops) +
+         heap_usage(mtz.datasets) + heap_usage(mtz.columns) +
+         heap_usage(mtz.batches) + heap_usage(mtz.history) +
+         heap_usage(mtz.data);
+}
+
+template<typename T>
+size_t memory_usage(const Grid<T>& grid) {
+  return sizeof(grid) + impl::heap_usage(grid.data);
+}
+
+} // namespace gemmi
+#endif
@@ -659,6 +659,14 @@ struct Mtz {
   // Function for writing MTZ file
   void write_to_stream(std::FILE* stream) const;
   void write_to_file(const std::string& path) const;
+
+  // write_to_stream() in parts, for writing data that is not kept in memory:
+  // write_first_bytes(), then nreflections x columns floats, and then
+  // write_main_headers(). When the data is not in memory, column ranges
+  // and resolution are taken from Column::min_value/max_value and
+  // min_1_d2/max_1_d2, and nreflections must be already set.
+  void write_first_bytes(std::FILE* stream) const;
+  void write_main_headers(std::FILE* stream) const;
 };
 
 // Unmerged MTZ files always store in-asu hkl indices and symmetry operation
@@ -755,14 +763,26 @@ void Mtz::write_to_stream(std::FILE* stream) const {
     fail("Cannot write Mtz which has no data");
   if (!spacegroup)
     fail("Cannot write Mtz which has no space group");
-  char buf[81] = {'M', 'T', 'Z', ' ', '\0'};
+  write_first_bytes(stream);
+  if (std::fwrite(data.data(), 4, data.size(), stream) != data.size())
+    fail("Writing MTZ file failed");
+  write_main_headers(stream);
+}
+
+void Mtz::write_first_bytes(std::FILE* stream) const {
+  char buf[80] = {'M', 'T', 'Z', ' ', '\0'};
   std::int32_t header_start = (int) columns.size() * nreflections + 21;
   std::memcpy(buf + 4, &header_start, 4);
   std::int32_t machst = is_little_endian() ? 0x00004144 : 0x11110000;
   std::memcpy(buf + 8, &machst, 4);
-  if (std::fwrite(buf, 80, 1, stream) != 1 ||
-      std::fwrite(data.data(), 4, data.size(), stream) != data.size())
+  if (std::fwrite(buf, 80, 1, stream) != 1)
     fail("Writing MTZ file failed");
+}
+
+void Mtz::write_main_headers(std::FILE* stream) const {
+  if (!spacegroup)
+    fail("Cannot write Mtz which has no space group");
+  char buf[81];
   WRITE("VERS MTZ:V1.1");
   WRITE("TITLE %s", title.c_str());
   WRITE("NCOL %8zu %12d %8zu", columns.size(), nreflections, batches.size());
@@ -782,14 +802,19 @@ void Mtz::write_to_stream(std::FILE* stream) const {
         spacegroup->point_group_hm()); // point group name
   for (Op op : ops)
     WRITE("SYMM %s", to_upper(op.triplet()).c_str());
-  auto reso = calculate_min_max_1_d2();
+  bool in_memory = has_data();
+  std::array<double,2> reso = {{min_1_d2, max_1_d2}};
+  if (in_memory)
+    reso = calculate_min_max_1_d2();
   WRITE("RESO %-20.12f %-20.12f", reso[0], reso[1]);
   if (std::isnan(valm))
     WRITE("VALM NAN");
   else
     WRITE("VALM %f", valm);
   for (const Column& col : columns) {
-    auto minmax = calculate_min_max_disregarding_nans(col.begin(), col.end());
+    std::array<float,2> minmax = {{col.min_value, col.max_value}};
+    if (in_memory)
+      minmax = calculate_min_max_disregarding_nans(col.begin(), col.end());
     WRITE("COLUMN %-30s %c %17.9g %17.9g %4d",
           col.label.c_str(), col.type, minmax[0], minmax[1], col.dataset_id);
     if (!col.source.empty())
@@ -0,0 +1,74 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Minimal helpers for running loops on multiple threads (std::thread).
+
+#ifndef GEMMI_PARALLEL_HPP_
+#define GEMMI_PARALLEL_HPP_
+
+#include <algorithm>  // for min
+#include <atomic>
+#include <exception>  // for exception_ptr
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace gemmi {
+
+// Number of threads to use when the user did not specify it.
+inline int default_thread_count() {
+  unsigned n = std::thread::hardware_concurrency();
+  return n == 0 ? 1 : (int) n;
+}
+
+// Calls func(i) for each i in [0, n), using up to n_threads threads
+// (n_threads <= 0 means default_thread_count()). Indices are handed out
+// dynamically in chunks of chunk_size. If func throws, the remaining
+// indices are skipped and the first exception is rethrown in the caller.
+template<typename Func>
+void parallel_for(size_t n, int n_threads, Func func, size_t chunk_size=1) {
+  if (n_threads <= 0)
+    n_threads = default_thread_count();
+  if (chunk_size == 0)
+    chunk_size = 1;
+  size_t n_chunks = (n + chunk_size - 1) / chunk_size;
+  if (n_threads == 1 || n_chunks <= 1) {
+    for (size_t i = 0; i != n; ++i)
+      func(i);
+    return;
+  }
+  std::atomic<size_t> next_chunk{0};
+  std::atomic<bool> failed{false};
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  auto worker = [&]() {
+    for (;;) {
+      size_t chunk = next_chunk++;
+      if (chunk >= n_chunks || failed)
+        return;
+      size_t end = std::min(n, (chunk + 1) * chunk_size);
+      try {
+        for (size_t i = chunk * chunk_size; i != end; ++i)
+          func(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!failed)
+          error = std::current_exception();
+        failed = true;
+        return;
+      }
+    }
+  };
+  size_t n_workers = std::min((size_t) n_threads, n_chunks);
+  std::vector<std::thread> threads;
+  threads.reserve(n_workers - 1);
+  for (size_t i = 1; i < n_workers; ++i)
+    threads.emplace_back(worker);
+  worker();  // the calling thread is also a worker
+  for (std::thread& t : threads)
+    t.join();
+  if (error)
+    std::rethrow_exception(error);
+}
+
+} // namespace gemmi
+#endif
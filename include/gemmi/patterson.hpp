@@ -0,0 +1,136 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Patterson maps and FFT-based cross-correlation of maps.
+
+#ifndef GEMMI_PATTERSON_HPP_
+#define GEMMI_PATTERSON_HPP_
+
+#include <algorithm>      // for min, max
+#include <cmath>          // for exp, pow
+#include <complex>
+#include <vector>
+#include "fail.hpp"       // for fail
+#include "fourier.hpp"    // for transform_f_phi_grid_to_map_, ...
+#include "grid.hpp"       // for Grid
+#include "symmetry.hpp"   // for find_spacegroup_by_name
+
+namespace gemmi {
+
+// Replaces map coefficients F with Patterson coefficients |F|^2 (phases
+// are discarded). Optionally:
+//  - sharpen_b > 0 sharpens the map as if amplitudes were multiplied
+//    by exp(sharpen_b/4 * 1/d^2), i.e. |F|^2 by exp(sharpen_b/2 * 1/d^2),
+//  - remove_origin subtracts from |F|^2 the mean |F|^2 in its resolution
+//    shell (n_shells shells of equal reciprocal-space volume), which removes
+//    the origin peak. Zero coefficients (missing data) stay zero.
+template<typename T>
+void make_patterson_coefficients(Grid<std::complex<T>>& hkl,
+                                 double sharpen_b=0., bool remove_origin=false,
+                                 int n_shells=20, int n_threads=0) {
+  double mult = 0.5 * sharpen_b;
+  for_each_reciprocal_point(hkl, [&](size_t, std::complex<T>& x,
+                                     double inv_d2) {
+    double f2 = std::norm(x);
+    if (mult != 0. && f2 != 0.)
+      f2 *= std::exp(mult * inv_d2);
+    x = (T) f2;
+  }, n_threads);
+  hkl.data[0] = T(0);  // F000 has no information about interatomic vectors
+  if (!remove_origin || n_shells < 1)
+    return;
+  // the largest 1/d^2 among non-zero coefficients
+  std::vector<double> section_max(hkl.nw, 0.);
+  for_each_reciprocal_point(hkl, [&](size_t w, std::complex<T>& x,
+                                     double inv_d2) {
+    if (x.real() != 0 && inv_d2 > section_max[w])
+      section_max[w] = inv_d2;
+  }, n_threads);
+  double max_1_d2 = 0.;
+  for (double m : section_max)
+    max_1_d2 = std::max(max_1_d2, m);
+  if (max_1_d2 == 0.)
+    return;
+  auto shell_of = [&](double inv_d2) {
+    int n = (int) (n_shells * std::pow(inv_d2 / max_1_d2, 1.5));
+    return std::min(n, n_shells - 1);
+  };
+  // sums and counts per section, to be merged without locking
+  std::vector<double> sums((size_t) hkl.nw * n_shells, 0.);
+  std::vector<int> counts((size_t) hkl.nw * n_shells, 0);
+  for_each_reciprocal_point(hkl, [&](size_t w, std::complex<T>& x,
+                                     double inv_d2) {
+    if (x.real() != 0) {
+      size_t idx = w * n_shells + shell_of(inv_d2);
+      sums[idx] += x.real();
+      ++counts[idx];
+    }
+  }, n_threads);
+  std::vector<double> shell_mean(n_shells, 0.);
+  for (int i = 0; i != n_shells; ++i) {
+    double sum = 0.;
+    int count = 0;
+    for (int w = 0; w != hkl.nw; ++w) {
+      sum += sums[w * n_shells + i];
+      count += counts[w * n_shells + i];
+    }
+    if (count != 0)
+      shell_mean[i] = sum / count;
+  }
+  for_each_reciprocal_point(hkl, [&](size_t, std::complex<T>& x,
+                                     double inv_d2) {
+    if (x.real() != 0)
+      x -= (T) shell_mean[shell_of(inv_d2)];
+  }, n_threads);
+}
+
+// Patterson map from map coefficients (only amplitudes are used).
+// The symmetry of the result is set to P1, which is a subgroup of
+// every Patterson symmetry.
+template<typename T>
+Grid<T> calculate_patterson(Grid<std::complex<T>>&& hkl,
+                            double sharpen_b=0., bool remove_origin=false,
+                            int n_threads=0) {
+  make_patterson_coefficients(hkl, sharpen_b, remove_origin, 20, n_threads);
+  Grid<T> map;
+  transform_f_phi_grid_to_map_(std::move(hkl), map, n_threads);
+  map.spacegroup = find_spacegroup_by_name("P 1");
+  return map;
+}
+
+// Cross-correlation of two maps on the same grid, calculated with FFT:
+//   result(t) = mean over x of a(x) * b(x + t),
+// so the maximum of the result is at the translation t that brings
+// b onto a (phased translation function). For a == b it is
+// the autocorrelation function of the map (the Patterson of the map,
+// divided by the unit cell volume).
+template<typename T>
+Grid<T> calculate_cross_correlation(const Grid<T>& a, const Grid<T>& b,
+                                    int n_threads=0) {
+  if (a.nu != b.nu || a.nv != b.nv || a.nw != b.nw)
+    fail("calculate_cross_correlation: maps have different grids");
+  // half_l works only if the map has even size along w
+  bool half_l = a.nw % 2 == 0;
+  Grid<std::complex<T>> fa, fb;
+  transform_map_to_f_phi_(a, fa, half_l, n_threads);
+  // with the normalization used in fourier.hpp, the product
+  // of coefficients needs to be divided by the volume
+  T mult = T(1. / a.unit_cell.volume);
+  if (&a != &b) {
+    transform_map_to_f_phi_(b, fb, half_l, n_threads);
+    parallel_for(fa.data.size(), n_threads, [&](size_t i) {
+      fa.data[i] = std::conj(fa.data[i]) * fb.data[i] * mult;
+    }, 1 << 16);
+    fb.data = std::vector<std::complex<T>>();  // release memory
+  } else {
+    parallel_for(fa.data.size(), n_threads, [&](size_t i) {
+      fa.data[i] = std::norm(fa.data[i]) * mult;
+    }, 1 << 16);
+  }
+  Grid<T> result;
+  transform_f_phi_grid_to_map_(std::move(fa), result, n_threads);
+  result.spacegroup = find_spacegroup_by_name("P 1");
+  return result;
+}
+
+} // namespace gemmi
+#endif
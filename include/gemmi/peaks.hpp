@@ -0,0 +1,181 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Peak search: local maxima of a map with subvoxel positions,
+// one peak from each set of symmetry mates, and the nearest atoms.
+
+#ifndef GEMMI_PEAKS_HPP_
+#define GEMMI_PEAKS_HPP_
+
+#include <algorithm>      // for min, max, sort
+#include <cmath>          // for sqrt, isfinite, NAN
+#include <unordered_set>
+#include <vector>
+#include "grid.hpp"       // for Grid, GridOp
+#include "parallel.hpp"   // for parallel_for
+#include "subcells.hpp"   // for SubCells
+
+namespace gemmi {
+
+struct Peak {
+  Position pos;    // refined (subvoxel) position
+  double height;   // refined value at pos
+  int u, v, w;     // grid point of the local maximum
+  SubCells::Mark* nearest = nullptr;  // set by assign_nearest_atoms()
+  double nearest_dist = NAN;
+};
+
+namespace impl {
+// Vertex of the parabola through (-1, fm), (0, f0) and (1, fp); f0 is
+// not lower than fm and fp, so the vertex is within [-0.5, 0.5].
+// Infinite or NaN neighbours (e.g. masked points) are not used.
+inline void parabola_vertex(double fm, double f0, double fp,
+                            double& x, double& height) {
+  double denom = fm - 2 * f0 + fp;
+  if (denom < 0 && std::isfinite(denom)) {
+    x = 0.5 * (fm - fp) / denom;
+    height = f0 - 0.125 * (fm - fp) * (fm - fp) / denom;
+  } else {
+    x = 0.;
+    height = f0;
+  }
+}
+} // namespace impl
+
+// Finds local maxima with values above cutoff (or, if negative is true,
+// local minima below -cutoff, e.g. in a difference map). A point is
+// a local maximum if none of its 26 neighbours is higher; from adjacent
+// points with equal values only the first one (in the grid order) is taken.
+// The position and height of each peak are refined by fitting a parabola
+// along each grid axis to the point and its two neighbours.
+//
+// The grid is split into slabs along w, searched in parallel. Neighbours
+// across slab boundaries and periodic boundaries are read directly
+// from the (read-only) grid, so slabs need no copied halos.
+//
+// If the grid has a space group and covers the unit cell, only one peak
+// from each set of symmetry mates is returned (mates are found using
+// GridOps, which map grid points onto grid points).
+// Peaks are sorted by height (absolute value, if negative is true).
+template<typename T>
+std::vector<Peak> find_peaks(const Grid<T>& grid, double cutoff,
+                             bool negative=false, int n_threads=0) {
+  const int nu = grid.nu, nv = grid.nv, nw = grid.nw;
+  const int uv = nu * nv;
+  const double sign = negative ? -1. : 1.;
+  // indices of the previous and next point along each axis
+  auto neighbour_table = [](int n, int mult) {
+    std::vector<int> t(3 * n);
+    for (int i = 0; i != n; ++i) {
+      t[3*i+0] = (i == 0 ? n - 1 : i - 1) * mult;
+      t[3*i+1] = i * mult;
+      t[3*i+2] = (i == n - 1 ? 0 : i + 1) * mult;
+    }
+    return t;
+  };
+  std::vector<int> tu = neighbour_table(nu, 1);
+  std::vector<int> tv = neighbour_table(nv, nu);
+  std::vector<int> tw = neighbour_table(nw, uv);
+  if (n_threads <= 0)
+    n_threads = default_thread_count();
+  const int n_slabs = std::max(1, std::min(n_threads, nw));
+  auto slab_begin = [&](int n) { return int((long) nw * n / n_slabs); };
+  std::vector<std::vector<Peak>> slab_peaks(n_slabs);
+
+  parallel_for(n_slabs, n_threads, [&](size_t slab) {
+    std::vector<Peak>& peaks = slab_peaks[slab];
+    for (int w = slab_begin((int) slab); w != slab_begin((int) slab + 1); ++w)
+      for (int v = 0; v != nv; ++v)
+        for (int u = 0; u != nu; ++u) {
+          const int idx = w * uv + v * nu + u;
+          const double f0 = sign * grid.data[idx];
+          if (!(f0 > cutoff))
+            continue;
+          bool is_max = true;
+          for (int i = 0; i != 27 && is_max; ++i) {
+            if (i == 13)  // the point itself
+              continue;
+            int n_idx = tw[3*w + i / 9] + tv[3*v + i / 3 % 3] + tu[3*u + i % 3];
+            double f = sign * grid.data[n_idx];
+            if (f > f0 || (f == f0 && n_idx < idx))
+              is_max = false;
+          }
+          if (!is_max)
+            continue;
+          double frac[3];
+          double height = f0;
+          const int axis_idx[3][2] = {{tu[3*u], tu[3*u+2]},
+                                      {tv[3*v], tv[3*v+2]},
+                                      {tw[3*w], tw[3*w+2]}};
+          const int self[3] = {tu[3*u+1], tv[3*v+1], tw[3*w+1]};
+          for (int j = 0; j != 3; ++j) {
+            int base = idx - self[j];
+            double h;
+            impl::parabola_vertex(sign * grid.data[base + axis_idx[j][0]], f0,
+                                  sign * grid.data[base + axis_idx[j][1]],
+                                  frac[j], h);
+            height += h - f0;
+          }
+          Peak peak;
+          peak.u = u;
+          peak.v = v;
+          peak.w = w;
+          peak.height = sign * height;
+          peak.pos = grid.unit_cell.orthogonalize(
+                        Fractional((u + frac[0]) / nu,
+                                   (v + frac[1]) / nv,
+                                   (w + frac[2]) / nw));
+          peaks.push_back(peak);
+        }
+  });
+
+  std::vector<Peak> result;
+  for (const std::vector<Peak>& peaks : slab_peaks)
+    result.insert(result.end(), peaks.begin(), peaks.end());
+  // stable sort keeps the grid order for equal heights
+  std::stable_sort(result.begin(), result.end(),
+                   [sign](const Peak& a, const Peak& b) {
+                     return sign * a.height > sign * b.height;
+                   });
+  if (grid.spacegroup && grid.full_canonical) {
+    std::vector<GridOp> ops = grid.get_scaled_ops_except_id();
+    if (!ops.empty()) {
+      // grid points of already reported peaks and of their symmetry mates
+      std::unordered_set<int> taken;
+      size_t n = 0;
+      for (size_t i = 0; i != result.size(); ++i) {
+        const Peak& peak = result[i];
+        if (!taken.insert(grid.index_q(peak.u, peak.v, peak.w)).second)
+          continue;
+        for (const GridOp& op : ops) {
+          std::array<int, 3> t = op.apply(peak.u, peak.v, peak.w);
+          taken.insert(grid.index_n(t[0], t[1], t[2]));
+        }
+        result[n++] = peak;
+      }
+      result.resize(n);
+    }
+  }
+  return result;
+}
+
+// Sets Peak::nearest to the nearest atom (any symmetry image) within
+// sc.radius_specified, and Peak::nearest_dist to the distance.
+inline void assign_nearest_atoms(std::vector<Peak>& peaks, SubCells& sc,
+                                 int n_threads=0) {
+  float radius = (float) sc.radius_specified;
+  parallel_for(peaks.size(), n_threads, [&](size_t i) {
+    Peak& peak = peaks[i];
+    float min_dist_sq = radius * radius;
+    peak.nearest = nullptr;
+    sc.for_each(peak.pos, '\0', radius, [&](SubCells::Mark& m, float dist_sq) {
+      if (dist_sq < min_dist_sq) {
+        min_dist_sq = dist_sq;
+        peak.nearest = &m;
+      }
+    });
+    peak.nearest_dist = peak.nearest ? std::sqrt(min_dist_sq) : NAN;
+  });
+}
+
+} // namespace gemmi
+#endif
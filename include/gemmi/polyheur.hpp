@@ -6,17 +6,18 @@
 #ifndef GEMMI_POLYHEUR_HPP_
 #define GEMMI_POLYHEUR_HPP_
 
+#include <unordered_map>
 #include <vector>
 #include "model.hpp"
-#include "resinfo.hpp"  // for find_tabulated_residue
+#include "resinfo.hpp"  // for find_tabulated_residue, ResidueInfoCache
 #include "util.hpp"     // for vector_remove_if
 
 namespace gemmi {
 
-// A simplistic classification. It may change in the future.
-// It returns PolymerType which corresponds to _entity_poly.type,
-// but here we use only PeptideL, Rna, Dna, DnaRnaHybrid and Unknown.
-inline PolymerType check_polymer_type(const ConstResidueSpan& polymer) {
+namespace impl {
+// lookup(const std::string&) returns ResidueInfo
+template<typename Lookup>
+PolymerType check_polymer_type(const ConstResidueSpan& polymer, Lookup lookup) {
   if (polymer.size() < 2)
     return PolymerType::Unknown;
   size_t counts[ResidueInfo::ELS+1] = {0};
@@ -25,7 +26,7 @@ inline PolymerType check_polymer_type(const ConstResidueSpan& polymer) {
   for (const Residue& r : polymer)
     if (r.entity_type == EntityType::Unknown ||
         r.entity_type == EntityType::Polymer) {
-      ResidueInfo info = find_tabulated_residue(r.name);
+      ResidueInfo info = lookup(r.name);
       if (info.found())
         counts[info.kind]++;
       else if (r.get_ca())
@@ -50,8 +51,8 @@ inline PolymerType check_polymer_type(const ConstResidueSpan& polymer) {
   return PolymerType::Unknown;
 }
 
-inline bool is_polymer_residue(const Residue& res, PolymerType ptype) {
-  ResidueInfo info = find_tabulated_residue(res.name);
+inline bool is_polymer_residue(const Residue& res, PolymerType ptype,
+                               ResidueInfo info) {
   // If a standard residue is HETATM we assume that it is in the buffer.
   if (info.found() && info.is_standard() && res.het_flag == 'H')
     return false;
@@ -70,6 +71,28 @@ inline bool is_polymer_residue(const Residue& res, PolymerType ptype) {
       return false;
   }
 }
+} // namespace impl
+
+// A simplistic classification. It may change in the future.
+// It returns PolymerType which corresponds to _entity_poly.type,
+// but here we use only PeptideL, Rna, Dna, DnaRnaHybrid and Unknown.
+inline PolymerType check_polymer_type(const ConstResidueSpan& polymer) {
+  return impl::check_polymer_type(polymer, find_tabulated_residue);
+}
+inline PolymerType check_polymer_type(const ConstResidueSpan& polymer,
+                                      ResidueInfoCache& cache) {
+  return impl::check_polymer_type(polymer, [&](const std::string& name) {
+      return cache.get(name);
+  });
+}
+
+inline bool is_polymer_residue(const Residue& res, PolymerType ptype) {
+  return impl::is_polymer_residue(res, ptype, find_tabulated_residue(res.name));
+}
+inline bool is_polymer_residue(const Residue& res, PolymerType ptype,
+                               ResidueInfoCache& cache) {
+  return impl::is_polymer_residue(res, ptype, cache.get(res.name));
+}
 
 inline bool are_connected(const Residue& r1, const Residue& r2,
                           PolymerType ptype) {
@@ -103,6 +126,79 @@ inline bool are_connected2(const Residue& r1, const Residue& r2,
   return false;
 }
 
+// Backbone atoms used by are_connected*(), found in a single pass over
+// atoms. Useful when connections of the same residue are checked many
+// times (contact search) or with both neighbours (walking a chain).
+struct BackboneAtoms {
+  const Atom* n = nullptr;
+  const Atom* ca = nullptr;
+  const Atom* c = nullptr;
+  const Atom* p = nullptr;
+  const Atom* o3prim = nullptr;
+
+  BackboneAtoms() = default;
+  // the same atoms as from Residue::get_n(), get_ca(), etc.
+  explicit BackboneAtoms(const Residue& res) {
+    for (const Atom& a : res.atoms) {
+      const std::string& name = a.name;
+      if (name.size() == 1) {
+        if (name[0] == 'N' && a.element == El::N && !n)
+          n = &a;
+        else if (name[0] == 'C' && a.element == El::C && !c)
+          c = &a;
+        else if (name[0] == 'P' && a.element == El::P && !p)
+          p = &a;
+      } else if (name.size() == 2) {
+        if (name[0] == 'C' && name[1] == 'A' && a.element == El::C && !ca)
+          ca = &a;
+      } else if (name.size() == 3) {
+        if (name[0] == 'O' && name[1] == '3' && name[2] == '\'' &&
+            a.element == El::O && !o3prim)
+          o3prim = &a;
+      }
+    }
+  }
+};
+
+namespace impl {
+inline bool atoms_within(const Atom* a1, const Atom* a2, double max_dist) {
+  return a1 && a2 && a1->pos.dist_sq(a2->pos) < sq(max_dist);
+}
+} // namespace impl
+
+inline bool are_connected(const BackboneAtoms& r1, const BackboneAtoms& r2,
+                          PolymerType ptype) {
+  if (is_polypeptide(ptype))
+    return impl::atoms_within(r1.c, r2.n, 1.341 * 1.5);
+  if (is_polynucleotide(ptype))
+    return impl::atoms_within(r1.o3prim, r2.p, 1.6 * 1.5);
+  return false;
+}
+
+inline bool are_connected2(const BackboneAtoms& r1, const BackboneAtoms& r2,
+                           PolymerType ptype) {
+  if (is_polypeptide(ptype))
+    return impl::atoms_within(r1.ca, r2.ca, 5.0);
+  if (is_polynucleotide(ptype))
+    return impl::atoms_within(r1.p, r2.p, 7.5);
+  return false;
+}
+
+inline bool are_connected3(const BackboneAtoms& r1, const BackboneAtoms& r2,
+                           PolymerType ptype) {
+  if (is_polypeptide(ptype)) {
+    if (r1.c && r2.n)
+      return impl::atoms_within(r1.c, r2.n, 1.341 * 1.5);
+    return impl::atoms_within(r1.ca, r2.ca, 5.0);
+  }
+  if (is_polynucleotide(ptype)) {
+    if (r1.o3prim && r2.p)
+      return impl::atoms_within(r1.o3prim, r2.p, 1.6 * 1.5);
+    return impl::atoms_within(r1.p, r2.p, 7.5);
+  }
+  return false;
+}
+
 // are_connected3() = are_connected() + fallback to are_connected2()
 inline bool are_connected3(const Residue& r1, const Residue& r2,
                            PolymerType ptype) {
@@ -126,14 +222,18 @@ inline bool are_connected3(const Residue& r1, const Residue& r2,
 
 inline std::string make_one_letter_sequence(const ConstResidueSpan& polymer) {
   std::string seq;
-  const Residue* prev = nullptr;
-  PolymerType ptype = check_polymer_type(polymer);
+  ResidueInfoCache cache;
+  PolymerType ptype = check_polymer_type(polymer, cache);
+  BackboneAtoms prev;
+  bool first = true;
   for (const Residue& residue : polymer.first_conformer()) {
-    ResidueInfo info = find_tabulated_residue(residue.name);
-    if (prev && !are_connected2(*prev, residue, ptype))
+    ResidueInfo info = cache.get(residue.name);
+    BackboneAtoms backbone(residue);
+    if (!first && !are_connected2(prev, backbone, ptype))
       seq += '-';
     seq += (info.one_letter_code != ' ' ? info.one_letter_code : 'X');
-    prev = &residue;
+    prev = backbone;
+    first = false;
   }
   return seq;
 }
@@ -143,12 +243,13 @@ inline bool has_subchains_assigned(const Chain& chain) {
                      [](const Residue& r) { return !r.subchain.empty(); });
 }
 
-inline void add_entity_types(Chain& chain, bool overwrite) {
-  PolymerType ptype = check_polymer_type(chain.whole());
+inline void add_entity_types(Chain& chain, bool overwrite,
+                             ResidueInfoCache& cache) {
+  PolymerType ptype = check_polymer_type(chain.whole(), cache);
   auto it = chain.residues.begin();
   for (; it != chain.residues.end(); ++it)
     if (overwrite || it->entity_type == EntityType::Unknown) {
-      if (!is_polymer_residue(*it, ptype))
+      if (!is_polymer_residue(*it, ptype, cache))
         break;
       it->entity_type = EntityType::Polymer;
     } else if (it->entity_type != EntityType::Polymer) {
@@ -160,10 +261,16 @@ inline void add_entity_types(Chain& chain, bool overwrite) {
                                        : EntityType::NonPolymer;
 }
 
+inline void add_entity_types(Chain& chain, bool overwrite) {
+  ResidueInfoCache cache;
+  add_entity_types(chain, overwrite, cache);
+}
+
 inline void add_entity_types(Structure& st, bool overwrite) {
+  ResidueInfoCache cache;
   for (Model& model : st.models)
     for (Chain& chain : model.chains)
-      add_entity_types(chain, overwrite);
+      add_entity_types(chain, overwrite, cache);
 }
 
 // The subchain field in the residue is where we store_atom_site.label_asym_id
@@ -188,20 +295,64 @@ inline void assign_subchain_names(Chain& chain) {
   }
 }
 
+// add_entity_types(chain, false) followed by assign_subchain_names(chain),
+// fused into a single pass over residues (after check_polymer_type()).
+inline void assign_subchains(Chain& chain, ResidueInfoCache& cache) {
+  PolymerType ptype = check_polymer_type(chain.whole(), cache);
+  const std::string poly_name = chain.name + "poly";
+  const std::string water_name = chain.name + "wat";
+  bool in_polymer = true;
+  for (Residue& res : chain.residues) {
+    if (in_polymer && res.entity_type == EntityType::Unknown) {
+      if (is_polymer_residue(res, ptype, cache))
+        res.entity_type = EntityType::Polymer;
+      else
+        in_polymer = false;
+    } else if (res.entity_type != EntityType::Polymer) {
+      in_polymer = false;
+    }
+    if (!in_polymer && res.entity_type == EntityType::Unknown)
+      res.entity_type = res.is_water() ? EntityType::Water
+                                       : EntityType::NonPolymer;
+    switch (res.entity_type) {
+      case EntityType::Polymer:    res.subchain = poly_name;  break;
+      case EntityType::NonPolymer: res.subchain = chain.name;
+                                   res.subchain += res.seqid.str(); break;
+      case EntityType::Water:      res.subchain = water_name; break;
+      case EntityType::Unknown:    res.subchain = chain.name; break;
+    }
+  }
+}
+
 inline void assign_subchains(Structure& st, bool force) {
+  ResidueInfoCache cache;
   for (Model& model : st.models)
     for (Chain& chain : model.chains)
-      if (force || !has_subchains_assigned(chain)) {
-        add_entity_types(chain, false);
-        assign_subchain_names(chain);
-      }
+      if (force || !has_subchains_assigned(chain))
+        assign_subchains(chain, cache);
 }
 
+// Entities are indexed by name and by subchain, so that files with
+// thousands of ligands (each in its own subchain) are done in linear time.
 inline void ensure_entities(Structure& st) {
+  std::unordered_map<std::string, size_t> by_name;
+  std::unordered_map<std::string, size_t> by_subchain;
+  for (size_t i = 0; i != st.entities.size(); ++i) {
+    by_name.emplace(st.entities[i].name, i);
+    // the first entity wins, as in get_entity_of()
+    for (const std::string& sub : st.entities[i].subchains)
+      by_subchain.emplace(sub, i);
+  }
+  ResidueInfoCache cache;
   for (Model& model : st.models)
     for (Chain& chain : model.chains)
       for (ResidueSpan& sub : chain.subchains()) {
-        Entity* ent = st.get_entity_of(sub);
+        Entity* ent = nullptr;
+        if (sub && !sub.subchain_id().empty()) {
+          auto it = by_subchain.find(sub.subchain_id());
+          if (it != by_subchain.end())
+            ent = &st.entities[it->second];
+        }
         if (!ent) {
           EntityType etype = sub[0].entity_type;
           std::string name;
@@ -212,28 +363,45 @@ inline void ensure_entities(Structure& st) {
           else if (etype == EntityType::Water)
             name = "water";
           if (!name.empty()) {
-            ent = &impl::find_or_add(st.entities, name);
+            auto it = by_name.emplace(name, st.entities.size()).first;
+            if (it->second == st.entities.size())
+              st.entities.emplace_back(name);
+            ent = &st.entities[it->second];
             ent->entity_type = etype;
             ent->subchains.push_back(sub.subchain_id());
+            by_subchain.emplace(sub.subchain_id(), it->second);
           }
         }
         // ensure we have polymer_type set where needed
         if (ent && ent->entity_type == EntityType::Polymer &&
             ent->polymer_type == PolymerType::Unknown)
-          ent->polymer_type = check_polymer_type(sub);
+          ent->polymer_type = check_polymer_type(sub, cache);
       }
 }
 
 
 inline void deduplicate_entities(Structure& st) {
-  for (auto i = st.entities.begin(); i != st.entities.end(); ++i)
-    if (!i->full_sequence.empty())
-      for (auto j = i + 1; j != st.entities.end(); ++j)
-        if (j->polymer_type == i->polymer_type &&
-            j->full_sequence == i->full_sequence) {
-          vector_move_extend(i->subchains, std::move(j->subchains));
-          st.entities.erase(j--);
-        }
+  // polymer type and sequence of the first entity with this sequence
+  std::unordered_map<std::string, size_t> first;
+  std::vector<Entity> kept;
+  kept.reserve(st.entities.size());
+  for (Entity& ent : st.entities) {
+    if (!ent.full_sequence.empty()) {
+      std::string key(1, (char) ent.polymer_type);
+      for (const std::string& mon : ent.full_sequence) {
+        key += mon;
+        key += '\n';
+      }
+      auto it = first.emplace(key, kept.size()).first;
+      if (it->second != kept.size()) {
+        vector_move_extend(kept[it->second].subchains,
+                           std::move(ent.subchains));
+        continue;
+      }
+    }
+    kept.push_back(std::move(ent));
+  }
+  st.entities = std::move(kept);
 }
 
 inline void setup_entities(Structure& st) {
@@ -264,21 +432,27 @@ template<> inline void remove_waters(Chain& ch) {
 }
 
 // Remove ligands and waters. It may leave empty chains.
-inline void remove_ligands_and_waters(Chain& ch) {
-  PolymerType ptype = check_polymer_type(ch.whole());
+inline void remove_ligands_and_waters(Chain& ch, ResidueInfoCache& cache) {
+  PolymerType ptype = check_polymer_type(ch.whole(), cache);
   vector_remove_if(ch.residues, [&](const Residue& res) {
       if (res.entity_type == EntityType::Unknown) {
         // TODO: check connectivity
-        return !is_polymer_residue(res, ptype);
+        return !is_polymer_residue(res, ptype, cache);
       }
       return res.entity_type != EntityType::Polymer;
   });
 }
 
+inline void remove_ligands_and_waters(Chain& ch) {
+  ResidueInfoCache cache;
+  remove_ligands_and_waters(ch, cache);
+}
+
 inline void remove_ligands_and_waters(Structure& st) {
+  ResidueInfoCache cache;
   for (Model& model : st.models)
     for (Chain& chain : model.chains)
-      remove_ligands_and_waters(chain);
+      remove_ligands_and_waters(chain, cache);
 }
 
 // Remove empty chains.
@@ -6,10 +6,12 @@
 #define GEMMI_REFLN_HPP_
 
 #include <array>
+#include <cmath>          // for NAN
 #include "cifdoc.hpp"
 #include "fail.hpp"       // for fail
 #include "mmcif_impl.hpp" // for set_cell_from_mmcif, read_spacegroup_from_block
 #include "numb.hpp"       // for as_number
+#include "parallel.hpp"   // for parallel_for
 #include "symmetry.hpp"   // for SpaceGroup
 #include "unitcell.hpp"   // for UnitCell
 
@@ -41,8 +43,8 @@ struct ReflnBlock {
   bool ok() const { return default_loop != nullptr; }
   void check_ok() const { if (!ok()) fail("Invalid ReflnBlock"); }
 
-  // position after "_refln." or "_diffrn_refln".
-  int tag_offset() const { return refln_loop ? 7 : 13; }
+  // position after "_refln." or "_diffrn_refln."
+  int tag_offset() const { return default_loop == refln_loop ? 7 : 14; }
 
   void use_unmerged(bool unmerged) {
     default_loop = unmerged ? diffrn_refln_loop : refln_loop;
@@ -168,5 +170,77 @@ struct ReflnDataProxy {
   const SpaceGroup* spacegroup() const { return rb_.spacegroup; }
 };
 
+// Like ReflnDataProxy, but the Miller indices and the selected columns
+// are converted from strings only once (using n_threads threads).
+// The selected columns are then at positions 3, 4, ... (after h, k, l).
+// Miller indices are stored as int, other values as float (null -> NaN).
+struct ReflnDecodedDataProxy {
+  ReflnDecodedDataProxy(const ReflnBlock& rb, const std::vector<size_t>& cols,
+                        int n_threads=0)
+    : cell_(rb.cell), spacegroup_(rb.spacegroup) {
+    decode(rb, cols, n_threads);
+  }
+  ReflnDecodedDataProxy(const ReflnBlock& rb,
+                        const std::vector<std::string>& tags,
+                        int n_threads=0)
+    : cell_(rb.cell), spacegroup_(rb.spacegroup) {
+    std::vector<size_t> cols;
+    for (const std::string& tag : tags)
+      cols.push_back(rb.get_column_index(tag));
+    decode(rb, cols, n_threads);
+  }
+
+  bool ok() const { return true; }
+  std::array<size_t,3> hkl_col() const { return {{0, 1, 2}}; }
+  size_t stride() const { return width_ + 3; }
+  size_t size() const { return hkl_.size() / 3 * stride(); }
+  size_t nreflections() const { return hkl_.size() / 3; }
+  int get_int(size_t n) const {
+    size_t row = n / stride(), col = n % stride();
+    return col < 3 ? hkl_[3 * row + col] : (int) values_[width_ * row + col-3];
+  }
+  float get_num(size_t n) const {
+    size_t row = n / stride(), col = n % stride();
+    return col < 3 ? (float) hkl_[3 * row + col] : values_[width_ * row + col-3];
+  }
+  // direct access, without going through the flat index
+  const int* hkl(size_t row) const { return &hkl_[3 * row]; }
+  float value(size_t row, size_t k) const { return values_[width_ * row + k]; }
+  const UnitCell& unit_cell() const { return cell_; }
+  const SpaceGroup* spacegroup() const { return spacegroup_; }
+
+private:
+  UnitCell cell_;
+  const SpaceGroup* spacegroup_;
+  size_t width_ = 0;  // number of selected (non-hkl) columns
+  std::vector<int> hkl_;
+  std::vector<float> values_;
+
+  void decode(const ReflnBlock& rb, const std::vector<size_t>& cols,
+              int n_threads) {
+    rb.check_ok();
+    const cif::Loop& loop = *rb.default_loop;
+    std::array<size_t,3> hkl_idx = rb.get_hkl_column_indices();
+    for (size_t col : cols)
+      if (col >= loop.width())
+        fail("ReflnDecodedDataProxy: column index out of range");
+    size_t nrefl = loop.length();
+    size_t loop_width = loop.width();
+    width_ = cols.size();
+    hkl_.resize(3 * nrefl);
+    values_.resize(width_ * nrefl);
+    parallel_for(nrefl, n_threads, [&](size_t row) {
+      const std::string* v = &loop.values[row * loop_width];
+      for (int j = 0; j != 3; ++j)
+        hkl_[3 * row + j] = cif::as_int(v[hkl_idx[j]]);
+      for (size_t j = 0; j != width_; ++j) {
+        const std::string& s = v[cols[j]];
+        values_[width_ * row + j] = cif::is_null(s) ? (float) NAN
+                                                    : (float) cif::as_number(s);
+      }
+    }, 4096);
+  }
+};
+
 } // namespace gemmi
 #endif
@@ -0,0 +1,76 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Resampling a map onto another grid (different cell, spacing or
+// orientation), for NCS averaging, map superposition, extracting a box
+// around a ligand, etc.
+
+#ifndef GEMMI_RESAMPLE_HPP_
+#define GEMMI_RESAMPLE_HPP_
+
+#include <cmath>         // for ceil
+#include "grid.hpp"      // for Grid
+#include "math.hpp"      // for Transform, BoundingBox
+#include "parallel.hpp"  // for parallel_for
+
+namespace gemmi {
+
+enum class Interpolation { Trilinear, Tricubic };
+
+// Sets each point of dest to the value of src interpolated at position
+// tr.apply(p), where p is the orthogonal position of the point in
+// dest.unit_cell. dest must have the unit cell and size already set.
+// src is periodic (it covers the whole unit cell).
+// Sections of dest (constant w) are processed in parallel;
+// within a row, the position in src is advanced by a constant step.
+template<typename T>
+void resample_grid(const Grid<T>& src, Grid<T>& dest, const Transform& tr,
+                   Interpolation interpolation=Interpolation::Tricubic,
+                   int n_threads=0) {
+  if (dest.data.size() != (size_t) dest.point_count())
+    fail("resample_grid: size of the destination grid is not set");
+  // dest grid coordinates -> src grid coordinates
+  Transform dest_scale;
+  dest_scale.mat[0][0] = 1.0 / dest.nu;
+  dest_scale.mat[1][1] = 1.0 / dest.nv;
+  dest_scale.mat[2][2] = 1.0 / dest.nw;
+  Transform src_scale;
+  src_scale.mat[0][0] = src.nu;
+  src_scale.mat[1][1] = src.nv;
+  src_scale.mat[2][2] = src.nw;
+  Transform g = src_scale.combine(src.unit_cell.frac.combine(
+                    tr.combine(dest.unit_cell.orth.combine(dest_scale))));
+  Vec3 step(g.mat[0][0], g.mat[1][0], g.mat[2][0]);
+  parallel_for(dest.nw, n_threads, [&](size_t w) {
+    for (int v = 0; v != dest.nv; ++v) {
+      Vec3 p = g.apply(Vec3(0, v, (double) w));
+      T* out = &dest.data[dest.index_q(0, v, (int) w)];
+      for (int u = 0; u != dest.nu; ++u, p += step)
+        out[u] = (T) (interpolation == Interpolation::Tricubic
+                      ? src.tricubic_interpolation(p.x, p.y, p.z)
+                      : src.trilinear_interpolation(p.x, p.y, p.z));
+    }
+  });
+}
+
+// Returns a map of a rectangular box (stored as a grid with the box as
+// the unit cell), with spacing not larger than max_spacing. The origin
+// of the box grid corresponds to box.low in src.
+template<typename T>
+Grid<T> extract_box(const Grid<T>& src, const BoundingBox& box,
+                    double max_spacing,
+                    Interpolation interpolation=Interpolation::Tricubic,
+                    int n_threads=0) {
+  Vec3 size = box.get_size();
+  Grid<T> dest;
+  dest.set_unit_cell(size.x, size.y, size.z, 90, 90, 90);
+  dest.set_size_without_checking((int) std::ceil(size.x / max_spacing),
+                                 (int) std::ceil(size.y / max_spacing),
+                                 (int) std::ceil(size.z / max_spacing));
+  Transform tr;
+  tr.vec = box.low;
+  resample_grid(src, dest, tr, interpolation, n_threads);
+  return dest;
+}
+
+} // namespace gemmi
+#endif
@@ -436,5 +436,45 @@ inline ResidueInfo find_tabulated_residue(const std::string& name) {
   return { ResidueInfo::UNKNOWN, ' ', 0 };
 }
 
+// Memoizes find_tabulated_residue() for residue names of one structure,
+// which usually has only tens of distinct names. Names of up to 3 characters
+// are packed into an int and kept in a small open-addressing table.
+// If the table gets full, other names are looked up without caching.
+class ResidueInfoCache {
+public:
+  ResidueInfo get(const std::string& name) {
+    if (name.empty() || name.size() > 3 || name[0] == '\0')
+      return find_tabulated_residue(name);
+    std::uint32_t key = 0;
+    for (char c : name)
+      key = key << 8 | (unsigned char) c;
+    for (std::uint32_t idx = (key * 2654435761u) >> (32 - Bits); ;
+         idx = (idx + 1) & (Size - 1)) {
+      Slot& slot = slots_[idx];
+      if (slot.key == key)
+        return slot.info;
+      if (slot.key == 0) {
+        ResidueInfo info = find_tabulated_residue(name);
+        if (4 * count_ < 3 * Size) {
+          slot.key = key;
+          slot.info = info;
+          ++count_;
+        }
+        return info;
+      }
+    }
+  }
+
+private:
+  static const int Bits = 8;
+  static const std::uint32_t Size = 1 << Bits;
+  struct Slot {
+    std::uint32_t key = 0;
+    ResidueInfo info;
+  };
+  Slot slots_[Size];
+  std::uint32_t count_ = 0;
+};
+
 } // namespace gemmi
 #endif
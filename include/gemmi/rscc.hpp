@@ -0,0 +1,184 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Real-space correlation coefficient (RSCC) between a map and the density
+// calculated from the model, per residue and per chain.
+// The model density is calculated only at grid points near the atoms
+// of the residue, so the cost does not depend on the size of the map.
+
+#ifndef GEMMI_RSCC_HPP_
+#define GEMMI_RSCC_HPP_
+
+#include <algorithm>     // for sort, unique, min
+#include <cmath>         // for ceil, exp, log, sqrt
+#include <tuple>         // for tie
+#include <vector>
+#include "grid.hpp"      // for Grid
+#include "math.hpp"      // for Correlation, pi
+#include "model.hpp"     // for Model
+#include "subcells.hpp"  // for SubCells
+#include "parallel.hpp"  // for parallel_for
+
+namespace gemmi {
+
+// Electron density of an atom approximated by a single Gaussian:
+// Z * occ * (4pi/B)^1.5 * exp(-4pi^2 r^2 / B), where B = B_iso + b_blur.
+// b_blur accounts for the resolution cut-off; 4 d^2 (the Gaussian
+// falls to 1/e at resolution d) is a rough default.
+struct GaussianAtom {
+  double amplitude;
+  double exponent;
+  double cutoff_sq;  // density below 1e-3 of the peak is ignored
+
+  GaussianAtom(const Atom& atom, double b_blur) {
+    double b = std::max(atom.b_iso, 1.f) + b_blur;
+    double n4pi_b = 4 * pi() / b;
+    amplitude = atom.element.atomic_number() * atom.occ *
+                n4pi_b * std::sqrt(n4pi_b);
+    exponent = -pi() * n4pi_b;
+    cutoff_sq = std::log(1e-3) / exponent;
+  }
+  double density(double r_sq) const {
+    return r_sq < cutoff_sq ? amplitude * std::exp(exponent * r_sq) : 0.;
+  }
+};
+
+struct ResidueCorrelation {
+  int chain_idx;
+  int residue_idx;
+  Correlation cc;  // x - model density, y - map values
+};
+
+struct RsccResult {
+  std::vector<ResidueCorrelation> residues;  // in the order of the model
+  // Correlation over the points near the chain; each point is counted
+  // once, for the residue with the nearest atom.
+  std::vector<Correlation> chains;
+};
+
+// The residue mask contains grid points within radius from (non-hydrogen)
+// atoms of the residue. Residues are processed in parallel, each with
+// its own Correlation objects that are merged at the end in a fixed order,
+// so the result does not depend on the number of threads.
+// The map is treated as periodic; cell is used for finding neighbouring
+// atoms (including symmetry mates).
+template<typename T>
+RsccResult calculate_rscc(const Model& model, const UnitCell& cell,
+                          const Grid<T>& map, double b_blur,
+                          double radius=2.0, int n_threads=0) {
+  const UnitCell& map_cell = map.unit_cell;
+  RsccResult result;
+  result.chains.resize(model.chains.size());
+  double max_cutoff_sq = sq(radius);
+  for (int n_ch = 0; n_ch != (int) model.chains.size(); ++n_ch) {
+    const Chain& chain = model.chains[n_ch];
+    for (int n_res = 0; n_res != (int) chain.residues.size(); ++n_res) {
+      result.residues.push_back({n_ch, n_res, Correlation()});
+      for (const Atom& atom : chain.residues[n_res].atoms)
+        if (!atom.is_hydrogen())
+          max_cutoff_sq = std::max(max_cutoff_sq,
+                                   GaussianAtom(atom, b_blur).cutoff_sq);
+    }
+  }
+  // atoms contributing to the model density at mask points
+  const double max_cutoff = std::min(std::sqrt(max_cutoff_sq), 3 * radius);
+  const float search_radius = float(radius + max_cutoff);
+  SubCells sc(model, cell, search_radius);
+  sc.populate(/*include_h=*/false);
+  const UnitCell& sc_cell = sc.grid.unit_cell;
+
+  struct NearAtom {
+    SubCells::Mark* mark;
+    Position pos;  // the image nearest to the residue
+    GaussianAtom gauss;
+  };
+  struct Point {
+    int idx;
+    Position pos;
+    bool operator<(const Point& o) const { return idx < o.idx; }
+  };
+  std::vector<Correlation> owned(result.residues.size());
+  parallel_for(result.residues.size(), n_threads, [&](size_t i) {
+    const ResidueCorrelation& rc = result.residues[i];
+    const Residue& res = model.chains[rc.chain_idx].residues[rc.residue_idx];
+    std::vector<Point> points;
+    std::vector<NearAtom> near_atoms;
+    for (const Atom& atom : res.atoms) {
+      if (atom.is_hydrogen())
+        continue;
+      Fractional fctr = map_cell.fractionalize(atom.pos);
+      int u0 = iround(fctr.x * map.nu);
+      int v0 = iround(fctr.y * map.nv);
+      int w0 = iround(fctr.z * map.nw);
+      int du = (int) std::ceil(radius / map.spacing[0]);
+      int dv = (int) std::ceil(radius / map.spacing[1]);
+      int dw = (int) std::ceil(radius / map.spacing[2]);
+      for (int w = w0-dw; w <= w0+dw; ++w)
+        for (int v = v0-dv; v <= v0+dv; ++v)
+          for (int u = u0-du; u <= u0+du; ++u) {
+            Fractional fr(double(u) / map.nu, double(v) / map.nv,
+                          double(w) / map.nw);
+            Position pos = map_cell.orthogonalize(fr);
+            if (pos.dist_sq(atom.pos) < sq(radius))
+              points.push_back({map.index_n(u, v, w), pos});
+          }
+      sc.for_each(atom.pos, '\0', search_radius,
+                  [&](SubCells::Mark& m, float) {
+        Position pos = sc_cell.orthogonalize_in_pbc(atom.pos,
+                                            sc_cell.fractionalize(m.pos()));
+        near_atoms.push_back({&m, pos,
+                              GaussianAtom(*m.to_cra(model).atom, b_blur)});
+      });
+    }
+    std::sort(points.begin(), points.end());
+    points.erase(std::unique(points.begin(), points.end(),
+                             [](const Point& a, const Point& b) {
+                               return a.idx == b.idx;
+                             }),
+                 points.end());
+    // the same atom is found from each atom of the residue; the order
+    // is also used to break ties when looking for the nearest atom
+    auto key = [](const NearAtom& a) {
+      const SubCells::Mark& m = *a.mark;
+      return std::tie(m.chain_idx, m.residue_idx, m.atom_idx, m.image_idx);
+    };
+    std::sort(near_atoms.begin(), near_atoms.end(),
+              [&](const NearAtom& a, const NearAtom& b) {
+                return key(a) < key(b);
+              });
+    near_atoms.erase(std::unique(near_atoms.begin(), near_atoms.end(),
+                                 [&](const NearAtom& a, const NearAtom& b) {
+                                   return key(a) == key(b);
+                                 }),
+                     near_atoms.end());
+
+    Correlation cc;
+    Correlation owned_cc;
+    for (const Point& point : points) {
+      double model_density = 0.;
+      double nearest_sq = INFINITY;
+      const SubCells::Mark* nearest = nullptr;
+      for (const NearAtom& a : near_atoms) {
+        double d_sq = point.pos.dist_sq(a.pos);
+        model_density += a.gauss.density(d_sq);
+        // only residues at the original position have their masks
+        if (d_sq < nearest_sq && a.mark->image_idx == 0) {
+          nearest_sq = d_sq;
+          nearest = a.mark;
+        }
+      }
+      double map_value = map.data[point.idx];
+      cc.add_point(model_density, map_value);
+      if (nearest && nearest->chain_idx == rc.chain_idx &&
+          nearest->residue_idx == rc.residue_idx)
+        owned_cc.add_point(model_density, map_value);
+    }
+    result.residues[i].cc = cc;
+    owned[i] = owned_cc;
+  }, 16);
+  for (size_t i = 0; i != owned.size(); ++i)
+    result.chains[result.residues[i].chain_idx].merge(owned[i]);
+  return result;
+}
+
+} // namespace gemmi
+#endif
@@ -6,13 +6,16 @@
 #ifndef GEMMI_SMCIF_HPP_
 #define GEMMI_SMCIF_HPP_
 
-#include <algorithm>     // for any_of
+#include <algorithm>     // for min, max, none_of
+#include <array>
+#include <cmath>         // for isfinite
 #include <string>
 #include <vector>
 #include "cifdoc.hpp"
 #include "numb.hpp"      // for as_number
 #include "symmetry.hpp"  // SpaceGroup
 #include "unitcell.hpp"  // UnitCell, Fractional
+#include "parallel.hpp"  // for parallel_for
 
 namespace gemmi {
 
@@ -23,12 +26,21 @@ struct AtomicStructure {
     Fractional fract;
     float occ = 1.0f;
   };
+  // symmetry image of sites[site_idx], without copying the strings
+  struct SiteImage {
+    int site_idx;
+    int image_idx;  // 0 = identity, n > 0 = cell.images[n-1]
+    Fractional fract;
+  };
   std::string name;
   UnitCell cell;
   std::string spacegroup_hm;
   std::vector<Site> sites;
 
-  std::vector<Site> get_all_unit_cell_sites() const;
+  // Symmetry images of all sites, skipping images that are closer than
+  // 0.5A to an earlier image of the same site (special positions).
+  std::vector<SiteImage> get_all_unit_cell_images(int n_threads=0) const;
+  std::vector<Site> get_all_unit_cell_sites(int n_threads=0) const;
 };
 
 inline
@@ -80,21 +92,101 @@ AtomicStructure make_atomic_structure_from_block(const cif::Block& block_) {
   return st;
 }
 
-inline std::vector<AtomicStructure::Site>
-AtomicStructure::get_all_unit_cell_sites() const {
-  std::vector<Site> all;
-  for (const Site& site : sites) {
-    size_t start = all.size();
-    all.push_back(site);
-    for (const FTransform& image : cell.images) {
-      Fractional fpos = image.apply(site.fract);
-      if (std::any_of(all.begin() + start, all.end(), [&](const Site& other) {
-            return cell.distance_sq(fpos, other.fract) < 0.5 * 0.5;
-          }))
+// Duplicates are found using a spatial hash: the unit cell is divided
+// into bins at least 0.5A wide (in the direction perpendicular to
+// the faces), so only 27 neighbouring bins need to be checked.
+inline std::vector<AtomicStructure::SiteImage>
+AtomicStructure::get_all_unit_cell_images(int n_threads) const {
+  const double max_dist_sq = 0.5 * 0.5;
+  // the distance between the planes of bins is 1/(n*ar) >= 0.5A
+  auto bin_count = [](double r) {
+    return r > 0 ? std::max(1, std::min(1024, int(2.0 / r))) : 1;
+  };
+  const int nu = bin_count(cell.ar);
+  const int nv = bin_count(cell.br);
+  const int nw = bin_count(cell.cr);
+  const int n_images = (int) cell.images.size() + 1;
+  size_t table_size = 16;
+  while (table_size < 2 * (size_t) n_images)
+    table_size *= 2;
+  std::vector<std::vector<SiteImage>> per_site(sites.size());
+  parallel_for(sites.size(), n_threads, [&](size_t site_idx) {
+    const Site& site = sites[site_idx];
+    std::vector<SiteImage>& out = per_site[site_idx];
+    // NaN or infinite coordinates cannot be binned; all images are compared
+    // (and, since such distances are NaN, all are kept)
+    if (!std::isfinite(site.fract.x) || !std::isfinite(site.fract.y) ||
+        !std::isfinite(site.fract.z)) {
+      for (int image_idx = 0; image_idx != n_images; ++image_idx) {
+        Fractional fpos = image_idx == 0 ? site.fract
+                          : cell.images[image_idx - 1].apply(site.fract);
+        if (std::none_of(out.begin(), out.end(), [&](const SiteImage& other) {
+              return cell.distance_sq(fpos, other.fract) < max_dist_sq;
+            }))
+          out.push_back(SiteImage{(int) site_idx, image_idx, fpos});
+      }
+      return;
+    }
+    // hash table with chaining: head[hash] and next[] index out
+    std::vector<int> head(table_size, -1);
+    std::vector<int> next;
+    std::vector<std::array<int, 3>> bins;
+    auto hash = [&](int u, int v, int w) {
+      return ((u * 73856093u) ^ (v * 19349663u) ^ (w * 83492791u))
+             & (table_size - 1);
+    };
+    auto find_bins = [&](const Fractional& f) {
+      Fractional w = f.wrap_to_unit();
+      return std::array<int, 3>{{std::min(int(w.x * nu), nu - 1),
+                                 std::min(int(w.y * nv), nv - 1),
+                                 std::min(int(w.z * nw), nw - 1)}};
+    };
+    auto has_neighbour = [&](const Fractional& fpos,
+                             const std::array<int, 3>& b) {
+      // with fewer than 3 bins in a direction, all bins are checked
+      int du0 = nu < 3 ? -b[0] : -1, du1 = nu < 3 ? nu - 1 - b[0] : 1;
+      int dv0 = nv < 3 ? -b[1] : -1, dv1 = nv < 3 ? nv - 1 - b[1] : 1;
+      int dw0 = nw < 3 ? -b[2] : -1, dw1 = nw < 3 ? nw - 1 - b[2] : 1;
+      for (int du = du0; du <= du1; ++du)
+        for (int dv = dv0; dv <= dv1; ++dv)
+          for (int dw = dw0; dw <= dw1; ++dw) {
+            int u = (b[0] + du + nu) % nu;
+            int v = (b[1] + dv + nv) % nv;
+            int w = (b[2] + dw + nw) % nw;
+            for (int i = head[hash(u, v, w)]; i != -1; i = next[i])
+              if (bins[i][0] == u && bins[i][1] == v && bins[i][2] == w &&
+                  cell.distance_sq(fpos, out[i].fract) < max_dist_sq)
+                return true;
+          }
+      return false;
+    };
+    for (int image_idx = 0; image_idx != n_images; ++image_idx) {
+      Fractional fpos = image_idx == 0 ? site.fract
+                        : cell.images[image_idx - 1].apply(site.fract);
+      std::array<int, 3> b = find_bins(fpos);
+      if (image_idx != 0 && has_neighbour(fpos, b))
         continue;
-      all.push_back(site);
-      all.back().fract = fpos;
+      size_t h = hash(b[0], b[1], b[2]);
+      next.push_back(head[h]);
+      head[h] = (int) out.size();
+      bins.push_back(b);
+      out.push_back(SiteImage{(int) site_idx, image_idx, fpos});
     }
+  }, 64);
+  std::vector<SiteImage> all;
+  for (const std::vector<SiteImage>& v : per_site)
+    all.insert(all.end(), v.begin(), v.end());
+  return all;
+}
+
+inline std::vector<AtomicStructure::Site>
+AtomicStructure::get_all_unit_cell_sites(int n_threads) const {
+  std::vector<SiteImage> images = get_all_unit_cell_images(n_threads);
+  std::vector<Site> all;
+  all.reserve(images.size());
+  for (const SiteImage& im : images) {
+    all.push_back(sites[im.site_idx]);
+    all.back().fract = im.fract;
   }
   return all;
 }
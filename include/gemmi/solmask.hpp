@@ -0,0 +1,198 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Bulk-solvent mask and grid kernels used in density modification:
+// solvent flattening and histogram matching.
+// All functions work in-place on existing grids, so they can be called
+// in a loop together with transform_map_to_f_phi_() and
+// transform_f_phi_grid_to_map_() from fourier.hpp without reallocation.
+
+#ifndef GEMMI_SOLMASK_HPP_
+#define GEMMI_SOLMASK_HPP_
+
+#include <algorithm>      // for min, max
+#include <array>
+#include <cmath>          // for ceil
+#include <vector>
+#include "grid.hpp"       // for Grid
+#include "gridstats.hpp"  // for calculate_statistics, calculate_histogram
+#include "model.hpp"      // for Model
+#include "parallel.hpp"   // for parallel_for
+
+namespace gemmi {
+
+// Approximate van der Waals radii (Bondi) of common elements.
+inline float vdw_radius_for_mask(El el) {
+  switch (el) {
+    case El::H: case El::D: return 1.20f;
+    case El::C: return 1.70f;
+    case El::N: return 1.55f;
+    case El::O: return 1.52f;
+    case El::F: return 1.47f;
+    case El::P: return 1.80f;
+    case El::S: return 1.80f;
+    case El::Cl: return 1.75f;
+    case El::Se: return 1.90f;
+    case El::Br: return 1.85f;
+    case El::I: return 1.98f;
+    default: return 1.80f;
+  }
+}
+
+// Mask with 1 for solvent and 0 for the macromolecule, made as in
+// Jiang & Brunger (1994) J Mol Biol 243, 100: points within vdW radius
+// + rprobe from any atom are not solvent, then the macromolecular region
+// is shrunk by rshrink, except points within vdW radius from atoms.
+struct SolventMasker {
+  double rprobe = 1.0;
+  double rshrink = 1.1;
+  double constant_r = 0.;  // if > 0, used for all atoms instead of vdW radii
+  bool include_h = false;
+
+  // grid must have size, unit cell and space group set
+  void put_mask_on_grid(Grid<signed char>& grid, const Model& model,
+                        int n_threads=0) const {
+    const signed char solvent = 1, macro = 0, shell = -1;
+    grid.fill(solvent);
+    // atoms are from the asymmetric unit; symmetry is applied below
+    for (int pass = 0; pass != 2; ++pass)
+      for (const Chain& chain : model.chains)
+        for (const Residue& res : chain.residues)
+          for (const Atom& atom : res.atoms) {
+            if (!include_h && atom.is_hydrogen())
+              continue;
+            double r = constant_r > 0 ? constant_r
+                                      : vdw_radius_for_mask(atom.element.elem);
+            if (pass == 0)
+              grid.set_points_around(atom.pos, r + rprobe, shell);
+            else
+              grid.set_points_around(atom.pos, r, macro);
+          }
+    grid.symmetrize([&](signed char a, signed char b) {
+        return a == macro || b == macro ? macro : std::min(a, b);
+    });
+    if (rshrink > 0)
+      shrink_shell(grid, n_threads);
+    for (signed char& d : grid.data)
+      if (d == shell)
+        d = macro;
+  }
+
+  // shell points that have a solvent point within rshrink become solvent
+  void shrink_shell(Grid<signed char>& grid, int n_threads) const {
+    const signed char solvent = 1, shell = -1;
+    std::vector<std::array<int, 3>> offsets;
+    int du = (int) std::ceil(rshrink / grid.spacing[0]);
+    int dv = (int) std::ceil(rshrink / grid.spacing[1]);
+    int dw = (int) std::ceil(rshrink / grid.spacing[2]);
+    for (int w = -dw; w <= dw; ++w)
+      for (int v = -dv; v <= dv; ++v)
+        for (int u = -du; u <= du; ++u) {
+          Fractional f(double(u) / grid.nu, double(v) / grid.nv,
+                       double(w) / grid.nw);
+          if (grid.unit_cell.orthogonalize_difference(f).length_sq() <
+              rshrink * rshrink)
+            offsets.push_back({{u, v, w}});
+        }
+    // changes are collected first, because they must not affect
+    // the neighbourhood of other points
+    std::vector<std::vector<int>> to_solvent(grid.nw);
+    parallel_for(grid.nw, n_threads, [&](size_t w) {
+      for (int v = 0; v != grid.nv; ++v)
+        for (int u = 0; u != grid.nu; ++u) {
+          int idx = grid.index_q(u, v, (int) w);
+          if (grid.data[idx] != shell)
+            continue;
+          for (const std::array<int, 3>& o : offsets)
+            if (grid.data[grid.index_n(u + o[0], v + o[1],
+                                       (int) w + o[2])] == solvent) {
+              to_solvent[w].push_back(idx);
+              break;
+            }
+        }
+    });
+    for (const std::vector<int>& section : to_solvent)
+      for (int idx : section)
+        grid.data[idx] = solvent;
+  }
+};
+
+// Sets map values in the solvent region (mask != 0) to the mean value
+// of the solvent. Returns the mean.
+template<typename T>
+double flatten_solvent(Grid<T>& map, const Grid<signed char>& mask,
+                       int n_threads=0) {
+  if (mask.data.size() != map.data.size())
+    fail("flatten_solvent: mask and map differ in size");
+  double mean = calculate_masked_statistics(map, mask, n_threads).dmean;
+  T value = (T) mean;
+  parallel_for(map.data.size(), n_threads, [&](size_t i) {
+    if (mask.data[i] != 0)
+      map.data[i] = value;
+  }, 1 << 16);
+  return mean;
+}
+
+// Values of the macromolecular region (mask == 0) of the map
+// at cumulative fractions 0, 1/n, 2/n, ..., 1 (approximated using
+// a histogram); used as a reference in match_histogram().
+template<typename T>
+std::vector<double> calculate_macro_quantiles(const Grid<T>& map,
+                                              const Grid<signed char>& mask,
+                                              int n, int n_threads=0) {
+  if (mask.data.size() != map.data.size())
+    fail("calculate_macro_quantiles: mask and map differ in size");
+  auto is_macro = [&](size_t i) { return mask.data[i] == 0; };
+  GridStats st = impl::calculate_statistics(map.data, n_threads, is_macro);
+  std::vector<double> quantiles(n + 1, st.dmin);
+  if (!(st.dmin < st.dmax))
+    return quantiles;
+  Histogram hist = impl::calculate_histogram(map.data, 16 * n, st.dmin,
+                                             st.dmax, n_threads, is_macro);
+  for (int i = 0; i <= n; ++i)
+    quantiles[i] = hist.percentile(100. * i / n);
+  quantiles[0] = st.dmin;
+  quantiles[n] = st.dmax;
+  return quantiles;
+}
+
+// Histogram matching: transforms values in the macromolecular region
+// (mask == 0) so that their distribution follows the reference quantiles
+// (from calculate_macro_quantiles()). The rank of each value is estimated
+// from a histogram with n_bins bins and mapped to the reference value
+// with the same rank.
+template<typename T>
+void match_histogram(Grid<T>& map, const Grid<signed char>& mask,
+                     const std::vector<double>& reference, int n_bins=4096,
+                     int n_threads=0) {
+  if (mask.data.size() != map.data.size())
+    fail("match_histogram: mask and map differ in size");
+  if (reference.size() < 2)
+    fail("match_histogram: reference quantiles needed");
+  auto is_macro = [&](size_t i) { return mask.data[i] == 0; };
+  GridStats st = impl::calculate_statistics(map.data, n_threads, is_macro);
+  if (!(st.dmin < st.dmax))
+    return;
+  Histogram hist = impl::calculate_histogram(map.data, n_bins, st.dmin,
+                                             st.dmax, n_threads, is_macro);
+  // fraction of values below the start of each bin
+  std::vector<double> cumulative(n_bins + 1, 0.);
+  for (int i = 0; i != n_bins; ++i)
+    cumulative[i+1] = cumulative[i] + (double) hist.counts[i] / hist.total;
+  const double scale = n_bins / (st.dmax - st.dmin);
+  const int n_ref = (int) reference.size() - 1;
+  parallel_for(map.data.size(), n_threads, [&](size_t i) {
+    if (!is_macro(i))
+      return;
+    double x = (map.data[i] - st.dmin) * scale;
+    int bin = std::min((int) x, n_bins - 1);
+    double p = cumulative[bin] + (x - bin) * (cumulative[bin+1] -
+                                              cumulative[bin]);
+    double r = std::min(std::max(p, 0.), 1.) * n_ref;
+    int k = std::min((int) r, n_ref - 1);
+    map.data[i] = (T) (reference[k] + (r - k) * (reference[k+1] -
+                                                 reference[k]));
+  }, 1 << 16);
+}
+
+} // namespace gemmi
+#endif
@@ -6,6 +6,7 @@
 #ifndef GEMMI_SUBCELLS_HPP_
 #define GEMMI_SUBCELLS_HPP_
 
+#include <algorithm>  // for min
 #include <vector>
 #include <cmath>  // for INFINITY, sqrt
 
@@ -132,9 +133,16 @@ inline void SubCells::initialize(const Model& model_, const UnitCell& cell,
                                    std::max(grid.nw, 3));
 }
 
+// Does the same as calling add_atom() for each atom, but coordinates
+// are converted for blocks of atoms at once (see transform_soa()).
 inline void SubCells::populate(bool include_h) {
   if (!model)
     fail("SubCells not initialized");
+  struct AtomRef {
+    const Atom* atom;
+    int n_ch, n_res, n_atom;
+  };
+  std::vector<AtomRef> refs;
   for (int n_ch = 0; n_ch != (int) model->chains.size(); ++n_ch) {
     const Chain& chain = model->chains[n_ch];
     for (int n_res = 0; n_res != (int) chain.residues.size(); ++n_res) {
@@ -142,7 +150,53 @@ inline void SubCells::populate(bool include_h) {
       for (int n_atom = 0; n_atom != (int) res.atoms.size(); ++n_atom) {
         const Atom& atom = res.atoms[n_atom];
         if (include_h || !atom.is_hydrogen())
-          add_atom(atom, n_ch, n_res, n_atom);
+          refs.push_back({&atom, n_ch, n_res, n_atom});
+      }
+    }
+  }
+  const UnitCell& gcell = grid.unit_cell;
+  const size_t block = 256;
+  const size_t n_im = gcell.images.size() + 1;
+  // for each image: fractional x, y, z and orthogonal x, y, z
+  std::vector<double> buf(6 * block * n_im);
+  for (size_t start = 0; start < refs.size(); start += block) {
+    size_t len = std::min(block, refs.size() - start);
+    for (size_t k = 0; k != n_im; ++k) {
+      double* f = &buf[6 * block * k];
+      double* o = f + 3 * block;
+      if (k == 0) {
+        for (size_t i = 0; i != len; ++i) {
+          const Position& pos = refs[start + i].atom->pos;
+          o[i] = pos.x;
+          o[block + i] = pos.y;
+          o[2 * block + i] = pos.z;
+        }
+        transform_soa(gcell.frac, o, o + block, o + 2 * block,
+                      f, f + block, f + 2 * block, len);
+      } else {
+        const double* f0 = &buf[0];
+        transform_soa(gcell.images[k - 1], f0, f0 + block, f0 + 2 * block,
+                      f, f + block, f + 2 * block, len);
+      }
+    }
+    // image 0 is wrapped only after it was used to calculate other images
+    for (size_t k = 0; k != n_im; ++k) {
+      double* f = &buf[6 * block * k];
+      double* o = f + 3 * block;
+      wrap_to_unit_soa(f, f + block, f + 2 * block, len);
+      transform_soa(gcell.orth, f, f + block, f + 2 * block,
+                    o, o + block, o + 2 * block, len);
+    }
+    for (size_t i = 0; i != len; ++i) {
+      const AtomRef& r = refs[start + i];
+      for (size_t k = 0; k != n_im; ++k) {
+        const double* f = &buf[6 * block * k];
+        const double* o = f + 3 * block;
+        Fractional frac(f[i], f[block + i], f[2 * block + i]);
+        Position pos(o[i], o[block + i], o[2 * block + i]);
+        get_subcell(frac).emplace_back(pos, r.atom->altloc,
+                                       r.atom->element.elem, (int) k,
+                                       r.n_ch, r.n_res, r.n_atom);
       }
     }
   }
@@ -0,0 +1,147 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Superposition and RMSD of many models (e.g. an NMR ensemble):
+// one-vs-many and all-vs-all, on multiple threads.
+// The superposition of two sets of positions is in calculate.hpp.
+
+#ifndef GEMMI_SUPERPOSE_HPP_
+#define GEMMI_SUPERPOSE_HPP_
+
+#include <algorithm>      // for sort
+#include <string>
+#include <unordered_map>
+#include <utility>        // for pair
+#include <vector>
+#include "calculate.hpp"  // for superpose_positions
+#include "model.hpp"      // for Model
+#include "parallel.hpp"   // for parallel_for
+
+namespace gemmi {
+
+enum class SupSelect {
+  CaP,        // CA in amino acids, P in nucleotides
+  MainChain,  // N, CA, C, O and the sugar-phosphate backbone
+  All         // all non-hydrogen atoms
+};
+
+// Atoms of one model selected for superposition. The same atom (chain name,
+// sequence number, atom name and altloc) has the same key in all models,
+// so atoms are matched by merging sorted keys.
+struct SupAtoms {
+  std::vector<int> keys;  // sorted
+  std::vector<Position> positions;
+};
+
+namespace impl {
+inline bool is_selected_for_sup(const Atom& atom, SupSelect sel) {
+  if (atom.is_hydrogen())
+    return false;
+  const std::string& name = atom.name;
+  switch (sel) {
+    case SupSelect::CaP:
+      return (name == "CA" && atom.element == El::C) ||
+             (name == "P" && atom.element == El::P);
+    case SupSelect::MainChain:
+      for (const char* mc : {"N", "CA", "C", "O", "P", "OP1", "OP2",
+                             "O5'", "C5'", "C4'", "C3'", "O3'"})
+        if (name == mc)
+          return true;
+      return false;
+    case SupSelect::All:
+      return true;
+  }
+  return false;
+}
+} // namespace impl
+
+inline std::vector<SupAtoms> prepare_sup_atoms(const std::vector<Model>& models,
+                                               SupSelect sel) {
+  std::unordered_map<std::string, int> key_map;
+  std::vector<SupAtoms> result(models.size());
+  std::vector<std::pair<int, Position>> atoms;
+  for (size_t i = 0; i != models.size(); ++i) {
+    atoms.clear();
+    for (const Chain& chain : models[i].chains)
+      for (const Residue& res : chain.residues) {
+        std::string prefix = chain.name + '/' + res.seqid.str() + '/';
+        for (const Atom& atom : res.atoms)
+          if (impl::is_selected_for_sup(atom, sel)) {
+            std::string key = prefix + atom.name + '/' + atom.altloc;
+            auto it = key_map.emplace(key, (int) key_map.size()).first;
+            atoms.emplace_back(it->second, atom.pos);
+          }
+      }
+    std::sort(atoms.begin(), atoms.end(),
+              [](const std::pair<int, Position>& a,
+                 const std::pair<int, Position>& b) {
+                return a.first < b.first;
+              });
+    SupAtoms& sa = result[i];
+    sa.keys.reserve(atoms.size());
+    sa.positions.reserve(atoms.size());
+    for (const auto& a : atoms) {
+      // the same atom listed twice (it should not happen) is used once
+      if (!sa.keys.empty() && sa.keys.back() == a.first)
+        continue;
+      sa.keys.push_back(a.first);
+      sa.positions.push_back(a.second);
+    }
+  }
+  return result;
+}
+
+// Superposes matching atoms of b onto a. pos1 and pos2 are buffers,
+// passed to avoid re-allocation when called in a loop.
+inline SupResult superpose_sup_atoms(const SupAtoms& a, const SupAtoms& b,
+                                     std::vector<Position>& pos1,
+                                     std::vector<Position>& pos2) {
+  pos1.clear();
+  pos2.clear();
+  size_t i = 0, j = 0;
+  while (i != a.keys.size() && j != b.keys.size()) {
+    if (a.keys[i] < b.keys[j]) {
+      ++i;
+    } else if (b.keys[j] < a.keys[i]) {
+      ++j;
+    } else {
+      pos1.push_back(a.positions[i++]);
+      pos2.push_back(b.positions[j++]);
+    }
+  }
+  return superpose_positions(pos1.data(), pos2.data(), pos1.size());
+}
+
+// One-vs-many: superposes each model onto models[ref].
+inline std::vector<SupResult> superpose_models_onto(
+    const std::vector<Model>& models, size_t ref, SupSelect sel,
+    int n_threads=0) {
+  std::vector<SupAtoms> sup_atoms = prepare_sup_atoms(models, sel);
+  std::vector<SupResult> result(models.size());
+  parallel_for(models.size(), n_threads, [&](size_t i) {
+    std::vector<Position> pos1, pos2;
+    result[i] = superpose_sup_atoms(sup_atoms.at(ref), sup_atoms[i],
+                                    pos1, pos2);
+  });
+  return result;
+}
+
+// All-vs-all: returns n x n matrix (row-major) of RMSDs after
+// superposition of each pair of models.
+inline std::vector<double> calculate_rmsd_matrix(
+    const std::vector<Model>& models, SupSelect sel, int n_threads=0) {
+  std::vector<SupAtoms> sup_atoms = prepare_sup_atoms(models, sel);
+  size_t n = models.size();
+  std::vector<double> matrix(n * n, 0.);
+  parallel_for(n, n_threads, [&](size_t i) {
+    std::vector<Position> pos1, pos2;
+    for (size_t j = i + 1; j < n; ++j) {
+      double rmsd = superpose_sup_atoms(sup_atoms[i], sup_atoms[j],
+                                        pos1, pos2).rmsd;
+      matrix[i * n + j] = matrix[j * n + i] = rmsd;
+    }
+  });
+  return matrix;
+}
+
+} // namespace gemmi
+#endif
@@ -50,6 +50,16 @@ struct Fractional : Vec3 {
   }
 };
 
+// Fractional::wrap_to_unit() for coordinates stored as separate arrays,
+// see transform_soa().
+inline void wrap_to_unit_soa(double* x, double* y, double* z, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    x[i] -= std::floor(x[i]);
+    y[i] -= std::floor(y[i]);
+    z[i] -= std::floor(z[i]);
+  }
+}
+
 enum class Asu : unsigned char { Same, Different, Any };
 
 // Result of find_nearest_image
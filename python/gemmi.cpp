@@ -57,21 +57,30 @@ void add_misc(py::module& m) {
     .def_readwrite("cell", &AtomicStructure::cell)
     .def_readonly("spacegroup_hm", &AtomicStructure::spacegroup_hm)
     .def_readonly("sites", &AtomicStructure::sites)
-    .def("get_all_unit_cell_sites", &AtomicStructure::get_all_unit_cell_sites)
+    .def("get_all_unit_cell_sites", &AtomicStructure::get_all_unit_cell_sites,
+         py::arg("n_threads")=0)
     .def("__repr__", [](const AtomicStructure& self) {
         return "<gemmi.AtomicStructure: " + std::string(self.name) + ">";
     });
 
-  py::class_<gemmi::CifWalk>(m, "CifWalk")
-    .def(py::init<const char*>())
-    .def("__iter__", [](gemmi::CifWalk& self) {
+  // CifWalk and CoorFileWalk list directories in background threads
+  // and can prefetch upcoming files (see ParallelFileWalk).
+  py::class_<gemmi::ParallelCifWalk>(m, "CifWalk")
+    .def(py::init<const std::string&, int, int>(),
+         py::arg("path"), py::arg("n_threads")=0, py::arg("prefetch")=0)
+    .def("__iter__", [](gemmi::ParallelCifWalk& self) {
         return py::make_iterator(self);
     }, py::keep_alive<0, 1>());
-  py::class_<gemmi::CoorFileWalk>(m, "CoorFileWalk")
-    .def(py::init<const char*>())
-    .def("__iter__", [](gemmi::CoorFileWalk& self) {
+  py::class_<gemmi::ParallelCoorFileWalk>(m, "CoorFileWalk")
+    .def(py::init<const std::string&, int, int>(),
+         py::arg("path"), py::arg("n_threads")=0, py::arg("prefetch")=0)
+    .def("__iter__", [](gemmi::ParallelCoorFileWalk& self) {
         return py::make_iterator(self);
     }, py::keep_alive<0, 1>());
+  py::class_<gemmi::FilePrefetcher>(m, "FilePrefetcher")
+    .def(py::init<>())
+    .def("add", &gemmi::FilePrefetcher::add, py::arg("path"))
+    .def_static("prefetch", &gemmi::FilePrefetcher::prefetch, py::arg("path"));
   m.def("is_pdb_code", &gemmi::is_pdb_code);
   m.def("expand_pdb_code_to_path", &gemmi::expand_pdb_code_to_path);
   m.def("expand_if_pdb_code", &gemmi::expand_if_pdb_code,
@@ -7,6 +7,8 @@
 #include "gemmi/polyheur.hpp"  // for remove_hydrogens
 #include "gemmi/math.hpp"      // for Variance
 #include "gemmi/subcells.hpp"  // for SubCells
+#include "gemmi/blob.hpp"      // for find_blobs
+#include "gemmi/peaks.hpp"     // for find_peaks
 #include "mapcoef.h"
 
 #define GEMMI_PROG blobs
@@ -16,7 +18,7 @@ namespace cif = gemmi::cif;
 
 enum OptionIndex { SigmaCutoff=AfterMapOptions, AbsCutoff,
                    MaskRadius, MaskWater,
-                   MinVolume, MinScore, MinSigma, MinDensity };
+                   Peaks, MinVolume, MinScore, MinSigma, MinDensity, Jobs };
 
 static const option::Descriptor Usage[] = {
   { NoOp, 0, "", "", Arg::None,
@@ -40,6 +42,8 @@ static const option::Descriptor Usage[] = {
     "  --sigma=NUMBER  \tSigma (RMSD) level (default: 1.0)." },
   { AbsCutoff, 0, "", "abs", Arg::Float,
     "  --abs=NUMBER  \tAbsolute level in electrons/A^3." },
+  { Peaks, 0, "", "peaks", Arg::None,
+    "  --peaks  \tList peaks (local maxima) instead of blobs." },
 
   { NoOp, 0, "", "", Arg::None, "\nBlob criteria:" },
   { MinVolume, 0, "", "min-volume", Arg::Float,
@@ -60,110 +64,12 @@ static const option::Descriptor Usage[] = {
   MapUsage[ExactDims],
   MapUsage[Sample],
   MapUsage[GridQuery],
+  { Jobs, 0, "j", "jobs", Arg::Int,
+    "  -j, --jobs=N  \tUse N threads (default: all CPUs)." },
   { 0, 0, 0, 0, 0, 0 }
 };
 
 
-struct GridPos {
-  int u, v, w;
-  int idx;
-};
-
-struct Blob {
-  std::vector<GridPos> points;
-  gemmi::Position pos;
-  double volume = 0.0;
-  double score = 0.0;
-  double max_value = 0.0;
-  gemmi::const_CRA cra = {nullptr, nullptr, nullptr};
-};
-
-struct BlobCriteria {
-  double min_volume = 10.0;
-  double min_score = 15.0;
-  double min_peak = 0.0;
-  double cutoff;
-};
-
-inline bool finalize_blob(Blob& blob, const gemmi::Grid<float>& grid,
-                          const BlobCriteria& criteria) {
-  size_t point_count = blob.points.size();
-  double volume_per_point = grid.unit_cell.volume / grid.point_count();
-  blob.volume = point_count * volume_per_point;
-  if (point_count < 3 ||  blob.volume < criteria.min_volume)
-    return false;
-  double sum[3] = {0., 0., 0.};
-  for (const GridPos& point : blob.points) {
-    double value = grid.data[point.idx];
-    blob.score += value;
-    if (value > blob.max_value)
-      blob.max_value = value;
-    sum[0] += point.u * value;
-    sum[1] += point.v * value;
-    sum[2] += point.w * value;
-  }
-  double sum_mult = 1.0 / blob.score;
-  if (blob.max_value < criteria.min_peak)
-    return false;
-  blob.score *= volume_per_point;
-  if (blob.score < criteria.min_score)
-    return false;
-  gemmi::Fractional fract(sum_mult * sum[0] / grid.nu,
-                          sum_mult * sum[1] / grid.nv,
-                          sum_mult * sum[2] / grid.nw);
-  blob.pos = grid.unit_cell.orthogonalize(fract);
-  return true;
-}
-
-std::vector<Blob> find_blobs_by_flood_fill(const gemmi::Grid<float>& grid,
-                                           const BlobCriteria& criteria) {
-  std::vector<Blob> blobs;
-  std::array<std::array<int, 3>, 6> moves = {{{{-1, 0, 0}}, {{1, 0, 0}},
-                                              {{0 ,-1, 0}}, {{0, 1, 0}},
-                                              {{0, 0, -1}}, {{0, 0, 1}}}};
-  // the mask will be used as follows:
-  // 1=in blob,  0=in asu, not in blob (so far),  -1=in neither
-  std::vector<signed char> mask = grid.get_asu_mask<signed char>(0, -1);
-  std::vector<gemmi::GridOp> ops = grid.get_scaled_ops_except_id();
-  int idx = 0;
-  for (int w = 0; w != grid.nw; ++w)
-    for (int v = 0; v != grid.nv; ++v)
-      for (int u = 0; u != grid.nu; ++u, ++idx) {
-        assert(idx == grid.index_q(u, v, w));
-        if (mask[idx] != 0)
-          continue;
-        float value = grid.data[idx];
-        if (value < criteria.cutoff)
-          continue;
-        Blob blob;
-        blob.points.push_back({u, v, w, idx});
-        mask[idx] = 1;
-        for (size_t j = 0; j < blob.points.size()/*increasing!*/; ++j)
-          for (const std::array<int, 3>& mv : moves) {
-            GridPos nabe = { blob.points[j].u + mv[0],
-                             blob.points[j].v + mv[1],
-                             blob.points[j].w + mv[2],
-                             0 };
-            nabe.idx = grid.index_s(nabe.u, nabe.v, nabe.w);
-            if (mask[nabe.idx] != 1 && grid.data[nabe.idx] > criteria.cutoff) {
-              if (mask[nabe.idx] != 0)
-                for (const gemmi::GridOp& op : ops) {
-                  auto t = op.apply(nabe.u, nabe.v, nabe.w);
-                  int mate_idx = grid.index_s(t[0], t[1], t[2]);
-                  if (mask[mate_idx] == 0)
-                    mask[mate_idx] = -1;
-                }
-              mask[nabe.idx] = 1;
-              blob.points.push_back(nabe);
-            }
-          }
-        if (finalize_blob(blob, grid, criteria))
-          blobs.push_back(blob);
-      }
-  return blobs;
-}
-
-
 static int run(OptParser& p) {
   std::string sf_path = p.nonOption(0);
   std::string model_path = p.coordinate_input_file(1);
@@ -198,12 +104,12 @@ static int run(OptParser& p) {
     fprintf(stderr, "Warning: different unit cells in model and data.");
 
   // calculate map RMSD and setup blob criteria
-  BlobCriteria criteria;
+  gemmi::BlobCriteria criteria;
   gemmi::Variance grid_variance(grid.data.begin(), grid.data.end());
   double rmsd = std::sqrt(grid_variance.for_population());
   double sigma_level = 1.0;
   if (p.options[AbsCutoff]) {
-    criteria.cutoff = std::strtod(p.options[SigmaCutoff].arg, nullptr);
+    criteria.cutoff = std::strtod(p.options[AbsCutoff].arg, nullptr);
     sigma_level = criteria.cutoff / rmsd;
   } else {
     if (p.options[SigmaCutoff])
@@ -219,8 +125,9 @@ static int run(OptParser& p) {
     criteria.min_peak = std::strtod(p.options[MinSigma].arg, nullptr) * rmsd;
   if (p.options[MinDensity])
     criteria.min_peak = std::strtod(p.options[MinDensity].arg, nullptr);
-  printf("Map RMSD: %.3f. Searching blobs above %.3f e/A^3 (%.3f sigma).\n",
-         rmsd, criteria.cutoff, sigma_level);
+  printf("Map RMSD: %.3f. Searching %s above %.3f e/A^3 (%.3f sigma).\n",
+         rmsd, p.options[Peaks] ? "peaks" : "blobs",
+         criteria.cutoff, sigma_level);
 
   // mask model by zeroing map values
   double radius = 2.0;
@@ -236,34 +143,59 @@ static int run(OptParser& p) {
     printf("Masked points: %d of %d.\n", n, grid.point_count());
   }
 
+  int n_threads = p.options[Jobs] ? std::atoi(p.options[Jobs].arg) : 0;
+  gemmi::SubCells sc(model, grid.unit_cell, 10.0);
+  sc.populate();
+  // move position to the symmetry image nearest to the model
+  auto near_model = [&](const gemmi::SubCells::Mark* mark,
+                        gemmi::Position& pos) -> std::string {
+    if (!mark)
+      return "none";
+    gemmi::const_CRA cra = mark->to_cra(model);
+    const gemmi::Position& ref = cra.atom->pos;
+    gemmi::Fractional fpos = grid.unit_cell.fractionalize(pos);
+    grid.unit_cell.apply_transform_inverse(fpos, mark->image_idx);
+    pos = grid.unit_cell.orthogonalize_in_pbc(ref, fpos);
+    return cra.chain->name + cra.residue->str();
+  };
+
+  if (p.options[Peaks]) {
+    std::vector<gemmi::Peak> peaks = gemmi::find_peaks(grid, criteria.cutoff,
+                                                       false, n_threads);
+    if (p.options[Verbose])
+      printf("%zu peak%s found.\n", peaks.size(), peaks.size() == 1 ? "" : "s");
+    gemmi::assign_nearest_atoms(peaks, sc, n_threads);
+    int n = 0;
+    for (gemmi::Peak& peak : peaks) {
+      std::string residue_info = near_model(peak.nearest, peak.pos);
+      printf("#%-2d %6.3f e/A^3, %4.1f rmsd, (%6.1f,%6.1f,%6.1f) near %s",
+             n++, peak.height, peak.height / rmsd,
+             peak.pos.x, peak.pos.y, peak.pos.z, residue_info.c_str());
+      if (peak.nearest)
+        printf(" %s at %.2f A", peak.nearest->to_cra(model).atom->name.c_str(),
+               peak.nearest_dist);
+      printf("\n");
+    }
+    return 0;
+  }
+
   // find and sort blobs
-  std::vector<Blob> blobs = find_blobs_by_flood_fill(grid, criteria);
+  std::vector<gemmi::Blob> blobs = gemmi::find_blobs(grid, criteria, n_threads);
   if (p.options[Verbose])
     printf("%zu blob%s found.\n", blobs.size(), blobs.size() == 1 ? "" : "s");
   std::sort(blobs.begin(), blobs.end(),
-            [](const Blob& a, const Blob& b) { return a.score > b.score; });
-
-  gemmi::SubCells sc(model, grid.unit_cell, 10.0);
-  sc.populate();
-  for (Blob& blob : blobs)
-    if (const gemmi::SubCells::Mark* mark = sc.find_nearest_atom(blob.pos)) {
-      blob.cra = mark->to_cra(model);
-      const gemmi::Position& ref = blob.cra.atom->pos;
-      gemmi::Fractional fpos = grid.unit_cell.fractionalize(blob.pos);
-      grid.unit_cell.apply_transform_inverse(fpos, mark->image_idx);
-      blob.pos = grid.unit_cell.orthogonalize_in_pbc(ref, fpos);
-    }
+            [](const gemmi::Blob& a, const gemmi::Blob& b) {
+              return a.score > b.score;
+  });
 
-  // output results
   int n = 0;
-  for (const Blob& b : blobs) {
-    std::string residue_info = "none";
-    if (b.cra.chain && b.cra.residue)
-      residue_info = b.cra.chain->name + b.cra.residue->str();
+  for (gemmi::Blob& blob : blobs) {
+    std::string residue_info = near_model(sc.find_nearest_atom(blob.pos),
+                                          blob.pos);
     printf("#%-2d %5.1f el in %5.1f A^3, %4.1f rmsd,"
            " (%6.1f,%6.1f,%6.1f) near %s\n",
-           n++, b.score, b.volume, b.max_value / rmsd,
-           b.pos.x, b.pos.y, b.pos.z, residue_info.c_str());
+           n++, blob.score, blob.volume, blob.peak_value / rmsd,
+           blob.pos.x, blob.pos.y, blob.pos.z, residue_info.c_str());
   }
   return 0;
 }
@@ -9,7 +9,9 @@
 # define GEMMI_WRITE_IMPLEMENTATION 1
 #endif
 #include <gemmi/atox.hpp>     // for read_word
+#include <gemmi/cif.hpp>      // for parse_events
 #include <gemmi/fileutil.hpp> // for file_open
+#include <gemmi/gz.hpp>       // for MaybeGzipped
 #include <gemmi/gzread.hpp>   // for read_cif_gz
 #include <gemmi/mtz.hpp>      // for Mtz
 #include <gemmi/refln.hpp>    // for ReflnBlock
@@ -19,7 +21,8 @@
 
 namespace cif = gemmi::cif;
 
-enum OptionIndex { Verbose=3, BlockName, Dir, Title, History, Unmerged };
+enum OptionIndex { Verbose=3, BlockName, Dir, Title, History, Unmerged,
+                   Stream };
 
 static const option::Descriptor Usage[] = {
   { NoOp, 0, "", "", Arg::None,
@@ -40,12 +43,16 @@ static const option::Descriptor Usage[] = {
     "  -H LINE, --history=LINE  \tAdd a history line." },
   { Unmerged, 0, "u", "unmerged", Arg::None,
     "  -u, --unmerged  \tWrite unmerged MTZ file(s)." },
+  { Stream, 0, "", "stream", Arg::None,
+    "  --stream  \tLow-memory mode for big files: convert while reading." },
   { NoOp, 0, "", "", Arg::None,
     "\nFirst variant: converts the first block of CIF_FILE, or the block"
     "\nspecified with --block=NAME, to MTZ file with given name."
     "\n\nSecond variant: converts each block of CIF_FILE to one MTZ file"
     "\n(block-name.mtz) in the specified DIRECTORY."
     "\n\nIf CIF_FILE is -, the input is read from stdin."
+    "\n\nWith --stream, the file is not stored in memory, but only"
+    "\nthe first reflection loop in each block is converted."
   },
   { 0, 0, 0, 0, 0, 0 }
 };
@@ -114,32 +121,31 @@ gemmi::ReflnBlock& get_block_by_name(std::vector<gemmi::ReflnBlock>& rblocks,
   gemmi::fail("block not found: " + name);
 }
 
-static
-void convert_cif_block_to_mtz(const gemmi::ReflnBlock& rb,
-                              const std::string& mtz_path,
-                              const std::vector<option::Option>& options) {
-  gemmi::Mtz mtz;
+static void init_mtz(gemmi::Mtz& mtz,
+                     const std::vector<option::Option>& options) {
   if (options[Title])
     mtz.title = options[Title].arg;
   for (const option::Option* opt = options[History]; opt; opt = opt->next())
     mtz.history.push_back(opt->arg);
-  mtz.cell = rb.cell;
-  mtz.spacegroup = rb.spacegroup;
   mtz.add_dataset("HKL_base");
-  mtz.add_dataset("unknown").wavelength = rb.wavelength;
-  const cif::Loop* loop = rb.refln_loop ? rb.refln_loop : rb.diffrn_refln_loop;
-  if (!loop)
-    gemmi::fail("_refln category not found in mmCIF block: " + rb.block.name);
-  if (options[Verbose])
+  mtz.add_dataset("unknown");
+}
+
+// Adds MTZ columns corresponding to the tags of the loop (and M/ISYM and
+// BATCH for unmerged data). Returns positions of the used tags in the loop,
+// in the order of MTZ columns (without M/ISYM and BATCH).
+static std::vector<int> add_columns(gemmi::Mtz& mtz, const cif::Loop& loop,
+                                    bool unmerged, bool verbose,
+                                    bool& uses_status) {
+  if (verbose)
     fprintf(stderr, "Searching tags with known MTZ equivalents ...\n");
-  bool uses_status = false;
+  uses_status = false;
   std::vector<int> indices;
-  std::string tag = loop->tags[0].substr(0, loop->tags[0].find('.') + 1);
+  std::string tag = loop.tags[0].substr(0, loop.tags[0].find('.') + 1);
   const size_t len = tag.length();
-  bool unmerged = options[Unmerged] || !rb.refln_loop;
   for (auto c = std::begin(conv_table); c != std::end(conv_table); ++c) {
     tag.replace(len, std::string::npos, c->refln_tag);
-    int index = loop->find_tag(tag);
+    int index = loop.find_tag(tag);
     if (index != -1) {
       // Some early unmerged depositions such as 1vly have data in _refln
       // and also have _refln.status (always 'o'). We skip it here.
@@ -157,15 +163,14 @@ void convert_cif_block_to_mtz(const gemmi::ReflnBlock& rb,
       while (!c->col_label)
         ++c;
       col.label = c->col_label;
-      if (options[Verbose])
+      if (verbose)
         fprintf(stderr, "  %s -> %s\n", tag.c_str(), col.label.c_str());
     } else if (c->col_type == 'H') {
       gemmi::fail("Miller index tag not found: " + tag);
     }
   }
-  std::unique_ptr<gemmi::UnmergedHklMover> hkl_mover;
   if (unmerged) {
-    if (options[Verbose])
+    if (verbose)
       fprintf(stderr, "Adding columns M/ISYM and BATCH for unmerged data...\n");
     auto col = mtz.columns.emplace(mtz.columns.begin() + 3);
     col->dataset_id = 1;
@@ -178,42 +183,65 @@ void convert_cif_block_to_mtz(const gemmi::ReflnBlock& rb,
     col->label = "BATCH";
 
     mtz.batches.emplace_back();
-    mtz.batches.back().set_cell(mtz.cell);
-    hkl_mover.reset(new gemmi::UnmergedHklMover(mtz));
   }
   for (size_t i = 0; i != mtz.columns.size(); ++i) {
     mtz.columns[i].parent = &mtz;
     mtz.columns[i].idx = i;
   }
-  mtz.nreflections = loop->length();
+  return indices;
+}
+
+static
+void convert_cif_block_to_mtz(const gemmi::ReflnBlock& rb,
+                              const std::string& mtz_path,
+                              const std::vector<option::Option>& options) {
+  gemmi::Mtz mtz;
+  mtz.cell = rb.cell;
+  mtz.spacegroup = rb.spacegroup;
+  init_mtz(mtz, options);
+  mtz.datasets[1].wavelength = rb.wavelength;
+  const cif::Loop* loop = rb.refln_loop ? rb.refln_loop : rb.diffrn_refln_loop;
+  if (!loop)
+    gemmi::fail("_refln category not found in mmCIF block: " + rb.block.name);
+  bool unmerged = options[Unmerged] || !rb.refln_loop;
+  bool uses_status;
+  std::vector<int> indices = add_columns(mtz, *loop, unmerged,
+                                         options[Verbose], uses_status);
+  std::unique_ptr<gemmi::UnmergedHklMover> hkl_mover;
+  if (unmerged) {
+    mtz.batches.back().set_cell(mtz.cell);
+    hkl_mover.reset(new gemmi::UnmergedHklMover(mtz));
+  }
+  // Miller indices and numeric columns are parsed in parallel upfront
+  size_t first_num = uses_status ? 4 : 3;
+  std::vector<size_t> num_cols(indices.begin() + first_num, indices.end());
+  gemmi::ReflnDecodedDataProxy decoded(rb, num_cols);
+  mtz.nreflections = (int) decoded.nreflections();
   mtz.data.resize(mtz.columns.size() * mtz.nreflections);
   int k = 0;
-  for (size_t i = 0; i < loop->values.size(); i += loop->tags.size()) {
-    size_t j = 0;
+  for (size_t row = 0; row != decoded.nreflections(); ++row) {
+    const int* dhkl = decoded.hkl(row);
     if (unmerged) {
-      std::array<int, 3> hkl;
-      for (int ii = 0; ii != 3; ++ii)
-        hkl[ii] = cif::as_int(loop->values[i + indices[ii]]);
+      std::array<int, 3> hkl{{dhkl[0], dhkl[1], dhkl[2]}};
       int isym = hkl_mover->move_to_asu(hkl);
-      for (; j != 3; ++j)
+      for (int j = 0; j != 3; ++j)
         mtz.data[k++] = (float) hkl[j];
       mtz.data[k++] = (float) isym;
       mtz.data[k++] = 1.0f; // batch number
     } else {
-      for (; j != 3; ++j)
-        mtz.data[k++] = (float) cif::as_int(loop->values[i + indices[j]]);
+      for (int j = 0; j != 3; ++j)
+        mtz.data[k++] = (float) dhkl[j];
     }
+    size_t i = row * loop->width();
     if (uses_status)
-      mtz.data[k++] = status_to_freeflag(loop->values[i + indices[j++]]);
-    for (; j != indices.size(); ++j) {
-      const std::string& v = loop->values[i + indices[j]];
-      if (cif::is_null(v)) {
-        mtz.data[k] = (float) NAN;
-      } else {
-        mtz.data[k] = (float) cif::as_number(v);
-        if (std::isnan(mtz.data[k]))
+      mtz.data[k++] = status_to_freeflag(loop->values[i + indices[3]]);
+    for (size_t j = 0; j != num_cols.size(); ++j) {
+      mtz.data[k] = decoded.value(row, j);
+      if (std::isnan(mtz.data[k])) {
+        const std::string& v = loop->values[i + num_cols[j]];
+        if (!cif::is_null(v))
           fprintf(stderr, "Value #%zu in the loop is not a number: %s\n",
-                  i + indices[j], v.c_str());
+                  i + num_cols[j], v.c_str());
       }
       ++k;
     }
@@ -228,6 +256,326 @@ void convert_cif_block_to_mtz(const gemmi::ReflnBlock& rb,
   }
 }
 
+// Low-memory conversion (option --stream). The file is parsed with
+// cif::parse_events() and values from the reflection loop are converted
+// to floats and written to the MTZ file in batches of rows, without
+// storing the document. Only the first _refln or _diffrn_refln loop
+// of each converted block is used.
+class StreamingConverter : public cif::EventHandler {
+public:
+  StreamingConverter(const std::vector<option::Option>& options,
+                     const char* mtz_path)
+    : options_(options), mtz_path_(mtz_path) {}
+
+  // returns false if some blocks (in --dir mode) were not converted
+  bool finish() {
+    finish_block();
+    if (block_count_ == -1)
+      gemmi::fail("no data blocks in the file");
+    if (options_[BlockName] && !block_found_)
+      gemmi::fail(std::string("block not found: ") + options_[BlockName].arg);
+    return ok_;
+  }
+
+  void start_block(const char* name, size_t len) {
+    finish_block();
+    block_ = cif::Block(std::string(name, len));
+    ++block_count_;
+    if (options_[BlockName])
+      selected_ = (block_.name == options_[BlockName].arg);
+    else
+      selected_ = options_[Dir] || block_count_ == 0;
+    if (selected_)
+      block_found_ = true;
+  }
+  void start_frame(const char*, size_t) { in_frame_ = true; }
+  void end_frame() { in_frame_ = false; }
+  void pair_tag(const char* tag, size_t len) {
+    pair_tag_.assign(tag, len);
+    if (selected_ && !in_frame_)
+      block_.items.emplace_back(std::string(pair_tag_));
+  }
+  void pair_value(const char* value, size_t len) {
+    if (selected_ && !in_frame_)
+      block_.items.back().pair[1].assign(value, len);
+    // blocks without space group use the one from the first block
+    if (!first_sg_ &&
+        gemmi::iequal(pair_tag_, "_symmetry.space_group_name_h-m"))
+      first_sg_ = gemmi::find_spacegroup_by_name(
+                                cif::as_string(std::string(value, len)));
+  }
+  void start_loop() {
+    loop_tags_.clear();
+    n_values_ = 0;
+    loop_kind_ = LoopKind::Skip;
+  }
+  void loop_tag(const char* tag, size_t len) {
+    loop_tags_.emplace_back(tag, len);
+  }
+  void loop_value(const char* value, size_t len) {
+    if (n_values_ == 0)
+      start_loop_values();
+    size_t col = n_values_++ % loop_tags_.size();
+    if (loop_kind_ == LoopKind::Store)
+      block_.items.back().loop.values.emplace_back(value, len);
+    else if (loop_kind_ == LoopKind::Reflections)
+      add_value(col, value, len);
+  }
+  void end_loop() {
+    if (n_values_ % loop_tags_.size() != 0)
+      gemmi::fail("Wrong number of values in the loop");
+    if (loop_kind_ == LoopKind::Reflections)
+      write_batch();
+  }
+
+private:
+  enum class LoopKind { Skip, Store, Reflections };
+  const size_t batch_rows_ = 1 << 16;
+
+  const std::vector<option::Option>& options_;
+  const char* mtz_path_;  // null in --dir mode
+  bool ok_ = true;
+  int block_count_ = -1;
+  bool block_found_ = false;
+  bool selected_ = false;
+  bool in_frame_ = false;
+  const gemmi::SpaceGroup* first_sg_ = nullptr;
+  // pairs and small loops of the current block
+  cif::Block block_;
+  std::string pair_tag_;
+  std::vector<std::string> loop_tags_;
+  size_t n_values_ = 0;
+  LoopKind loop_kind_ = LoopKind::Skip;
+  std::string value_;
+
+  // state of the reflection loop being converted
+  gemmi::Mtz mtz_;
+  std::string path_;
+  gemmi::fileptr_t file_{nullptr, nullptr};
+  bool unmerged_ = false;
+  std::unique_ptr<gemmi::UnmergedHklMover> hkl_mover_;
+  std::vector<int> slots_;  // MTZ column for each loop column, or -1
+  int status_slot_ = -1;
+  std::vector<float> batch_;
+  size_t rows_in_batch_ = 0;
+  bool cell_known_ = false;
+  double min_1_d2_ = INFINITY;
+  double max_1_d2_ = 0.;
+
+  bool is_reflection_tag(const std::string& tag) const {
+    return gemmi::istarts_with(tag, "_refln.") ||
+           gemmi::istarts_with(tag, "_diffrn_refln.");
+  }
+
+  void start_loop_values() {
+    if (!selected_ || in_frame_)
+      return;
+    if (!is_reflection_tag(loop_tags_[0])) {
+      block_.items.emplace_back(cif::LoopArg{});
+      block_.items.back().loop.tags = loop_tags_;
+      loop_kind_ = LoopKind::Store;
+    } else if (!file_) {
+      start_reflections();
+      loop_kind_ = LoopKind::Reflections;
+    }
+  }
+
+  void start_reflections() {
+    bool verbose = options_[Verbose];
+    unmerged_ = options_[Unmerged] ||
+                gemmi::istarts_with(loop_tags_[0], "_diffrn_refln.");
+    mtz_ = gemmi::Mtz();
+    init_mtz(mtz_, options_);
+    cif::Loop loop;
+    loop.tags = loop_tags_;
+    bool uses_status;
+    std::vector<int> indices = add_columns(mtz_, loop, unmerged_, verbose,
+                                           uses_status);
+    slots_.assign(loop_tags_.size(), -1);
+    for (size_t i = 0; i != indices.size(); ++i)
+      slots_[indices[i]] = int(i < 3 || !unmerged_ ? i : i + 2);
+    status_slot_ = uses_status ? 3 : -1;
+    gemmi::impl::set_cell_from_mmcif(block_, mtz_.cell);
+    cell_known_ = mtz_.cell.is_crystal() && mtz_.cell.a > 0;
+    min_1_d2_ = INFINITY;
+    max_1_d2_ = 0.;
+    if (unmerged_) {
+      mtz_.spacegroup = gemmi::impl::read_spacegroup_from_block(block_);
+      if (!mtz_.spacegroup)
+        mtz_.spacegroup = first_sg_;
+      if (!mtz_.spacegroup)
+        gemmi::fail("In --stream mode, the space group must be given before"
+                    " unmerged data.");
+      hkl_mover_.reset(new gemmi::UnmergedHklMover(mtz_));
+    }
+    if (mtz_path_) {
+      path_ = mtz_path_;
+    } else {
+      path_ = options_[Dir].arg;
+      path_ += '/';
+      path_ += block_.name;
+      path_ += ".mtz";
+    }
+    if (verbose)
+      fprintf(stderr, "Writing %s ...\n", path_.c_str());
+    file_ = gemmi::file_open(path_.c_str(), "w+b");  // + for read-back
+    mtz_.nreflections = 0;
+    mtz_.write_first_bytes(file_.get());  // re-written in finish_block()
+    batch_.resize(batch_rows_ * mtz_.columns.size());
+    rows_in_batch_ = 0;
+  }
+
+  void add_value(size_t col, const char* value, size_t len) {
+    int slot = slots_[col];
+    if (slot >= 0) {
+      float& dest = batch_[rows_in_batch_ * mtz_.columns.size() + slot];
+      value_.assign(value, len);
+      if (slot < 3) {
+        dest = (float) cif::as_int(value_);
+      } else if (slot == status_slot_) {
+        dest = status_to_freeflag(value_);
+      } else if (cif::is_null(value_)) {
+        dest = (float) NAN;
+      } else {
+        dest = (float) cif::as_number(value_);
+        if (std::isnan(dest))
+          fprintf(stderr, "Value #%zu in the loop is not a number: %s\n",
+                  n_values_ - 1, value_.c_str());
+      }
+    }
+    if (col + 1 == slots_.size() && ++rows_in_batch_ == batch_rows_)
+      write_batch();
+  }
+
+  void write_batch() {
+    const size_t ncol = mtz_.columns.size();
+    if (unmerged_)
+      gemmi::parallel_for(rows_in_batch_, 0, [&](size_t row) {
+        float* r = &batch_[row * ncol];
+        std::array<int, 3> hkl{{(int) r[0], (int) r[1], (int) r[2]}};
+        int isym = hkl_mover_->move_to_asu(hkl);
+        for (int j = 0; j != 3; ++j)
+          r[j] = (float) hkl[j];
+        r[3] = (float) isym;
+        r[4] = 1.0f; // batch number
+      }, 4096);
+    for (size_t row = 0; row != rows_in_batch_; ++row) {
+      const float* r = &batch_[row * ncol];
+      for (size_t j = 0; j != ncol; ++j) {
+        gemmi::Mtz::Column& col = mtz_.columns[j];
+        if (std::isnan(r[j]))
+          continue;
+        if (!(r[j] >= col.min_value))  // also true if min_value is NaN
+          col.min_value = r[j];
+        if (!(r[j] <= col.max_value))
+          col.max_value = r[j];
+      }
+      if (cell_known_) {
+        double d = mtz_.cell.calculate_1_d2(r[0], r[1], r[2]);
+        min_1_d2_ = std::min(min_1_d2_, d);
+        max_1_d2_ = std::max(max_1_d2_, d);
+      }
+    }
+    size_t n = rows_in_batch_ * ncol;
+    if (std::fwrite(batch_.data(), 4, n, file_.get()) != n)
+      gemmi::fail("Writing MTZ file failed: " + path_);
+    mtz_.nreflections += (int) rows_in_batch_;
+    rows_in_batch_ = 0;
+  }
+
+  // When the cell is given after the reflections, the resolution range
+  // is calculated by reading back Miller indices from the file.
+  void read_back_resolution() {
+    const size_t ncol = mtz_.columns.size();
+    std::fflush(file_.get());
+    if (std::fseek(file_.get(), 80, SEEK_SET) != 0)
+      gemmi::fail("fseek failed: " + path_);
+    for (int done = 0; done < mtz_.nreflections; ) {
+      size_t rows = std::min(batch_rows_, size_t(mtz_.nreflections - done));
+      if (std::fread(batch_.data(), 4, rows * ncol, file_.get()) != rows * ncol)
+        gemmi::fail("Reading back MTZ data failed: " + path_);
+      for (size_t row = 0; row != rows; ++row) {
+        const float* r = &batch_[row * ncol];
+        double d = mtz_.cell.calculate_1_d2(r[0], r[1], r[2]);
+        min_1_d2_ = std::min(min_1_d2_, d);
+        max_1_d2_ = std::max(max_1_d2_, d);
+      }
+      done += (int) rows;
+    }
+    std::fseek(file_.get(), 0, SEEK_END);
+  }
+
+  void finish_block() {
+    if (!selected_)
+      return;
+    selected_ = false;
+    if (!file_) {
+      std::string msg = "_refln category not found in mmCIF block: " +
+                        block_.name;
+      if (mtz_path_)
+        gemmi::fail(msg);
+      fprintf(stderr, "ERROR: %s\n", msg.c_str());
+      ok_ = false;
+      return;
+    }
+    gemmi::ReflnBlock rb(std::move(block_));
+    if (!rb.spacegroup)
+      rb.spacegroup = first_sg_;
+    if (!mtz_.spacegroup)
+      mtz_.spacegroup = rb.spacegroup;
+    if (!cell_known_) {
+      mtz_.cell = rb.cell;
+      if (mtz_.cell.is_crystal() && mtz_.cell.a > 0 && mtz_.nreflections > 0)
+        read_back_resolution();
+    }
+    for (gemmi::Mtz::Dataset& ds : mtz_.datasets)
+      ds.cell = mtz_.cell;
+    mtz_.datasets[1].wavelength = rb.wavelength;
+    if (!mtz_.batches.empty())
+      mtz_.batches.back().set_cell(mtz_.cell);
+    mtz_.min_1_d2 = min_1_d2_ == INFINITY ? 0. : min_1_d2_;
+    mtz_.max_1_d2 = max_1_d2_;
+    try {
+      mtz_.write_main_headers(file_.get());
+      if (std::fseek(file_.get(), 0, SEEK_SET) != 0)
+        gemmi::fail("fseek failed");
+      mtz_.write_first_bytes(file_.get());
+    } catch (std::runtime_error& e) {
+      gemmi::fail(std::string(e.what()) + ": " + path_);
+    }
+    file_.reset();
+  }
+};
+
+struct GzReader {
+  gzFile f;
+  size_t operator()(char* buf, size_t len) {
+    int n = gzread(f, buf, (unsigned) len);
+    if (n < 0)
+      gemmi::fail("gzread failed");
+    return (size_t) n;
+  }
+};
+
+// The input is read in chunks, so the whole file is never in memory.
+template<typename Handler>
+void parse_file_events(const char* path, Handler& handler) {
+  const size_t bufsize = 4 * 1024 * 1024;  // limits the size of a value
+  gemmi::MaybeGzipped input(path);
+  if (input.is_stdin()) {
+    cif::pegtl::cstream_input<> in(stdin, bufsize, "stdin");
+    cif::parse_events(in, handler);
+  } else if (input.is_compressed()) {
+    gemmi::MaybeGzipped::GzStream gz = input.get_uncompressing_stream();
+    cif::pegtl::buffer_input<GzReader> in(path, bufsize, GzReader{gz.f});
+    cif::parse_events(in, handler);
+  } else {
+    gemmi::fileptr_t f = gemmi::file_open(path, "rb");
+    cif::pegtl::cstream_input<> in(f.get(), bufsize, path);
+    cif::parse_events(in, handler);
+  }
+}
+
 int GEMMI_MAIN(int argc, char **argv) {
   OptParser p(EXE_NAME);
   p.simple_parse(argc, argv, Usage);
@@ -238,6 +586,16 @@ int GEMMI_MAIN(int argc, char **argv) {
   if (verbose)
     fprintf(stderr, "Reading %s ...\n", cif_path);
   try {
+    if (p.options[Stream]) {
+      StreamingConverter conv(p.options,
+                              convert_all ? nullptr : p.nonOption(1));
+      parse_file_events(cif_path, conv);
+      if (!conv.finish())
+        return 1;
+      if (verbose)
+        fprintf(stderr, "Done.\n");
+      return 0;
+    }
     auto rblocks = gemmi::as_refln_blocks(gemmi::read_cif_gz(cif_path).blocks);
     if (convert_all) {
       bool ok = true;
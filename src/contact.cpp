@@ -2,9 +2,7 @@
 //
 // Searches for contacts -- neighbouring atoms.
 
-#include <gemmi/subcells.hpp>
-#include <gemmi/polyheur.hpp>  // for are_connected
-#include <gemmi/elem.hpp>      // for is_hydrogen
+#include <gemmi/contact.hpp>   // for ContactSearch
 #include <gemmi/gzread.hpp>
 #include <gemmi/to_pdb.hpp>    // for padded_atom_name
 #define GEMMI_PROG contact
@@ -12,10 +10,18 @@
 #include <stdio.h>
 #include <cstdlib>  // for strtod
 #include <algorithm>  // for min, max
+#include <map>
 
 using namespace gemmi;
 
-enum OptionIndex { Verbose=3, Cov, CovMult, MaxDist, Occ, Any, NoH, Count };
+enum OptionIndex { Verbose=3, Cov, CovMult, MaxDist, Occ, Any, NoH, Count,
+                   Summary, Tsv, Jobs };
+
+struct ContactArg {
+  static option::ArgStatus Summary(const option::Option& option, bool msg) {
+    return Arg::Choice(option, msg, {"res", "el"});
+  }
+};
 
 static const option::Descriptor Usage[] = {
   { NoOp, 0, "", "", Arg::None,
@@ -38,6 +44,13 @@ static const option::Descriptor Usage[] = {
     "  --noh  \tIgnore hydrogen (and deuterium) atoms." },
   { Count, 0, "", "count", Arg::None,
     "  --count  \tPrint only a count of atom pairs." },
+  { Summary, 0, "", "summary", ContactArg::Summary,
+    "  --summary=KEY  \tPrint only counts of contacts per pair of "
+    "residue names (KEY=res) or elements (KEY=el)." },
+  { Tsv, 0, "", "tsv", Arg::None,
+    "  --tsv  \tTab-separated output with a header line." },
+  { Jobs, 0, "j", "jobs", Arg::Int,
+    "  -j, --jobs=N  \tUse N threads (default: all CPUs)." },
   { 0, 0, 0, 0, 0, 0 }
 };
 
@@ -46,16 +59,71 @@ struct Parameters {
   bool any;
   bool print_count;
   bool no_hydrogens;
+  bool tsv;
+  char summary = '\0';  // 'r' - residue names, 'e' - elements
   float cov_tol = 0.0f;
   float cov_mult = 1.0f;
   float max_dist = 3.0f;
   float occ_sum = 0.0f;
+  int n_threads = 0;
   int verbose;
 };
 
+static void format_contact(const Structure& st,
+                           const ContactSearch::Result& r, bool tsv,
+                           std::string& out) {
+  const Atom& a1 = *r.partner1.atom;
+  const Atom& a2 = *r.partner2.atom;
+  SymImage im = st.cell.find_nearest_pbc_image(a1.pos, a2.pos, r.image_idx);
+  char buf[160];
+  int len;
+  if (tsv)
+    len = snprintf(buf, sizeof(buf),
+                   "%s\t%c\t%s\t%s\t%s\t%s\t%c\t%s\t%s\t%s\t%s\t%.2f\n",
+                   a1.name.c_str(), a1.altloc ? a1.altloc : '.',
+                   r.partner1.residue->name.c_str(),
+                   r.partner1.chain->name.c_str(),
+                   r.partner1.residue->seqid.str().c_str(),
+                   a2.name.c_str(), a2.altloc ? a2.altloc : '.',
+                   r.partner2.residue->name.c_str(),
+                   r.partner2.chain->name.c_str(),
+                   r.partner2.residue->seqid.str().c_str(),
+                   im.pdb_symbol(true).c_str(), im.dist());
+  else
+    len = snprintf(buf, sizeof(buf),
+                   "            %-4s%c%3s%2s%5s   "
+                   "            %-4s%c%3s%2s%5s  %6s %6s %5.2f\n",
+                   padded_atom_name(a1).c_str(),
+                   a1.altloc ? std::toupper(a1.altloc) : ' ',
+                   r.partner1.residue->name.c_str(),
+                   r.partner1.chain->name.c_str(),
+                   r.partner1.residue->seqid.str().c_str(),
+                   padded_atom_name(a2).c_str(),
+                   a2.altloc ? std::toupper(a2.altloc) : ' ',
+                   r.partner2.residue->name.c_str(),
+                   r.partner2.chain->name.c_str(),
+                   r.partner2.residue->seqid.str().c_str(),
+                   "1555", im.pdb_symbol(false).c_str(), im.dist());
+  out.append(buf, std::min(len, (int) sizeof(buf) - 1));
+}
+
+static std::pair<std::string, std::string>
+summary_key(const ContactSearch::Result& r, char summary) {
+  std::string k1, k2;
+  if (summary == 'r') {
+    k1 = r.partner1.residue->name;
+    k2 = r.partner2.residue->name;
+  } else {
+    k1 = r.partner1.atom->element.name();
+    k2 = r.partner2.atom->element.name();
+  }
+  if (k2 < k1)
+    std::swap(k1, k2);
+  return {k1, k2};
+}
+
 static void print_contacts(const Structure& st, const Parameters& params) {
-  const float special_pos_cutoff = 0.8f;
-  float max_r = params.use_cov_radius ? params.max_dist : 4.f + params.cov_tol;
+  float max_r = params.use_cov_radius ? 4.f + params.cov_tol : params.max_dist;
   SubCells sc(st.models.at(0), st.cell, std::max(5.0f, max_r));
   sc.populate(/*include_h=*/!params.no_hydrogens);
 
@@ -76,73 +144,57 @@ static void print_contacts(const Structure& st, const Parameters& params) {
            min_count, max_count, double(total_count) / sc.grid.data.size());
   }
 
-  int counter = 0;
-  const Model& model = st.models.at(0);
-  for (int n_ch = 0; n_ch != (int) model.chains.size(); ++n_ch) {
-    const Chain& chain = model.chains[n_ch];
-    PolymerType pt = check_polymer_type(chain.get_polymer());
-    for (int n_res = 0; n_res != (int) chain.residues.size(); ++n_res) {
-      const Residue& res = chain.residues[n_res];
-      for (int n_atom = 0; n_atom != (int) res.atoms.size(); ++n_atom) {
-        const Atom& atom = res.atoms[n_atom];
-        if (params.no_hydrogens && is_hydrogen(atom.element))
-          continue;
-        double min_occ = params.occ_sum - atom.occ;
-        float d_part = 0.f;
-        if (params.use_cov_radius) {
-          d_part = params.cov_mult * atom.element.covalent_r() + params.cov_tol;
-          max_r = d_part + 2.4f;
-        }
-        sc.for_each(atom.pos, atom.altloc, max_r,
-                    [&](const SubCells::Mark& m, float dist_sq) {
-            if (!params.any) {
-              // do not consider connections inside a residue
-              // or between this and previous/next residue
-              if (m.image_idx == 0 && m.chain_idx == n_ch &&
-                  (m.residue_idx == n_res ||
-                   are_connected(res, chain.residues[m.residue_idx], pt) ||
-                   are_connected(chain.residues[m.residue_idx], res, pt)))
-                return;
-            }
-            // atom can be linked with its image, but if the image
-            // is too close the atom is likely on special position.
-            if (m.chain_idx == n_ch && m.residue_idx == n_res &&
-                m.atom_idx == n_atom && (m.image_idx == 0 ||
-                                         dist_sq < sq(special_pos_cutoff)))
-              return;
-            const_CRA cra = m.to_cra(model);
-            if (cra.atom->occ < min_occ)
-              return;
-            if (params.use_cov_radius) {
-              float limit = d_part + params.cov_mult *
-                                     cra.atom->element.covalent_r();
-              if (limit < 0 || dist_sq > sq(limit))
-                return;
-            }
-            ++counter;
-            if (params.print_count)
-              return;
-            SymImage im = st.cell.find_nearest_pbc_image(
-                                        atom.pos, cra.atom->pos, m.image_idx);
-            printf("            %-4s%c%3s%2s%5s   "
-                   "            %-4s%c%3s%2s%5s  %6s %6s %5.2f\n",
-                   padded_atom_name(atom).c_str(),
-                   atom.altloc ? std::toupper(atom.altloc) : ' ',
-                   res.name.c_str(),
-                   chain.name.c_str(),
-                   res.seqid.str().c_str(),
-                   padded_atom_name(*cra.atom).c_str(),
-                   cra.atom->altloc ? std::toupper(cra.atom->altloc) : ' ',
-                   cra.residue->name.c_str(),
-                   cra.chain->name.c_str(),
-                   cra.residue->seqid.str().c_str(),
-                   "1555", im.pdb_symbol(false).c_str(), im.dist());
-        });
-      }
+  ContactSearch search(max_r);
+  if (params.any)
+    search.ignore = ContactSearch::Ignore::Nothing;
+  search.skip_hydrogens = params.no_hydrogens;
+  search.min_occupancy_sum = params.occ_sum;
+  search.use_covalent_radius = params.use_cov_radius;
+  search.cov_mult = params.cov_mult;
+  search.cov_tol = params.cov_tol;
+  search.setup(sc);
+
+  // Atoms are processed in batches, to keep the memory bounded.
+  // Within a batch, atoms are searched (and contacts formatted)
+  // in parallel, and the output is written in the original order.
+  const bool print_lines = !params.print_count && !params.summary;
+  std::vector<ContactSearch::AtomIndex> atoms =
+                                      search.atoms_to_search(st.models.at(0));
+  const size_t batch_size = 8192;
+  std::vector<std::vector<ContactSearch::Result>> found;
+  std::vector<std::string> lines;
+  std::map<std::pair<std::string, std::string>, size_t> summary;
+  size_t counter = 0;
+  if (params.tsv && print_lines)
+    printf("atom1\talt1\tres1\tchain1\tseq1\t"
+           "atom2\talt2\tres2\tchain2\tseq2\tsym2\tdist\n");
+  for (size_t start = 0; start < atoms.size(); start += batch_size) {
+    size_t n = std::min(batch_size, atoms.size() - start);
+    found.assign(n, {});
+    lines.assign(print_lines ? n : 0, {});
+    parallel_for(n, params.n_threads, [&](size_t i) {
+      search.for_each_contact_of(sc, atoms[start + i],
+                                 [&](const ContactSearch::Result& r) {
+        if (print_lines)
+          format_contact(st, r, params.tsv, lines[i]);
+        else
+          found[i].push_back(r);
+      });
+    }, 64);
+    for (const std::string& s : lines)
+      fwrite(s.data(), 1, s.size(), stdout);
+    for (const std::vector<ContactSearch::Result>& v : found) {
+      counter += v.size();
+      if (params.summary)
+        for (const ContactSearch::Result& r : v)
+          ++summary[summary_key(r, params.summary)];
     }
   }
   if (params.print_count)
-    printf("%s:%g\n", st.name.c_str(), 0.5 * counter);
+    printf("%s:%zu\n", st.name.c_str(), counter);
+  for (const auto& item : summary)
+    printf("%s\t%s\t%zu\n", item.first.first.c_str(),
+           item.first.second.c_str(), item.second);
 }
 
 int GEMMI_MAIN(int argc, char **argv) {
@@ -163,12 +215,21 @@ int GEMMI_MAIN(int argc, char **argv) {
   params.any = p.options[Any];
   params.print_count = p.options[Count];
   params.no_hydrogens = p.options[NoH];
+  params.tsv = p.options[Tsv];
+  if (p.options[Summary])
+    params.summary = p.options[Summary].arg[0];
+  if (p.options[Jobs])
+    params.n_threads = std::atoi(p.options[Jobs].arg);
+  // large buffer for printing many contacts
+  std::setvbuf(stdout, nullptr, _IOFBF, 1 << 20);
   try {
     for (int i = 0; i < p.nonOptionsCount(); ++i) {
       std::string input = p.coordinate_input_file(i);
       if (params.verbose > 0 ||
-          (p.nonOptionsCount() > 1 && !params.print_count))
+          (p.nonOptionsCount() > 1 && !params.print_count &&
+           !params.tsv))
         std::printf("%sFile: %s\n", (i > 0 ? "\n" : ""), input.c_str());
+      std::fflush(stdout);
       Structure st = read_structure_gz(input);
       print_contacts(st, params);
     }
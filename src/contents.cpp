@@ -7,13 +7,15 @@
 #include <gemmi/resinfo.hpp>
 #include <gemmi/calculate.hpp>
 #include <gemmi/gzread.hpp>
+#include <gemmi/jobs.hpp>  // for JobScheduler
 #define GEMMI_PROG contents
 #include "options.h"
 #include <stdio.h>
+#include <stdlib.h>  // for atoi
 
 using namespace gemmi;
 
-enum OptionIndex { Verbose=3, Dihedrals };
+enum OptionIndex { Verbose=3, Dihedrals, Jobs };
 
 static const option::Descriptor Usage[] = {
   { NoOp, 0, "", "", Arg::None,
@@ -24,6 +26,8 @@ static const option::Descriptor Usage[] = {
   { Verbose, 0, "v", "verbose", Arg::None, "  --verbose  \tVerbose output." },
   { Dihedrals, 0, "", "dihedrals", Arg::None,
     "  --dihedrals  \tPrint peptide dihedral angles." },
+  { Jobs, 0, "j", "jobs", Arg::Int,
+    "  -j, --jobs=N  \tRead N files at once (default: all CPUs)." },
   { 0, 0, 0, 0, 0, 0 }
 };
 
@@ -56,9 +60,10 @@ static void print_content_info(const Structure& st, bool /*verbose*/) {
   double atom_count = 0;
   double protein_atom_count = 0;
   const Model& model = st.models.at(0);
+  ResidueInfoCache resinfo_cache;
   for (const Chain& chain : model.chains) {
     for (const Residue& res : chain.residues) {
-      ResidueInfo res_info = find_tabulated_residue(res.name);
+      ResidueInfo res_info = resinfo_cache.get(res.name);
       if (res_info.is_water())
         if (const Atom* oxygen = res.find_by_element(El::O))
           water_count += oxygen->occ;
@@ -151,24 +156,39 @@ int GEMMI_MAIN(int argc, char **argv) {
   p.simple_parse(argc, argv, Usage);
   p.require_input_files_as_args();
   bool verbose = p.options[Verbose];
-  try {
-    for (int i = 0; i < p.nonOptionsCount(); ++i) {
-      std::string input = p.coordinate_input_file(i);
-      if (i > 0)
-        std::printf("\n");
-      if (verbose || p.nonOptionsCount() > 1)
-        std::printf("File: %s\n", input.c_str());
-      Structure st = read_structure_gz(input);
-      print_content_info(st, verbose);
-      print_atoms_on_special_positions(st);
-      if (p.options[Dihedrals])
-        print_dihedrals(st);
+  int n_threads = p.options[Jobs] ? std::atoi(p.options[Jobs].arg) : 0;
+  struct Input {
+    std::string path;
+    Structure st;
+  };
+  // files are read in parallel and printed in the original order
+  JobScheduler scheduler(n_threads);
+  bool failed = false;
+  scheduler.run_n((size_t) p.nonOptionsCount(), [&](size_t i, int) {
+    Input input;
+    input.path = p.coordinate_input_file((int) i);
+    input.st = read_structure_gz(input.path);
+    return input;
+  }, [&](size_t i, JobResult<Input>& result) {
+    if (i > 0)
+      std::printf("\n");
+    if (verbose || p.nonOptionsCount() > 1)
+      std::printf("File: %s\n", result.ok() ? result.value.path.c_str()
+                                             : p.nonOption((int) i));
+    if (!result.ok()) {
+      std::fflush(stdout);
+      std::fprintf(stderr, "ERROR: %s\n", result.error.c_str());
+      failed = true;
+      scheduler.cancel();
+      return;
     }
-  } catch (std::runtime_error& e) {
-    std::fprintf(stderr, "ERROR: %s\n", e.what());
-    return 1;
-  }
-  return 0;
+    const Structure& st = result.value.st;
+    print_content_info(st, verbose);
+    print_atoms_on_special_positions(st);
+    if (p.options[Dihedrals])
+      print_dihedrals(st);
+  });
+  return failed ? 1 : 0;
 }
 
 // vim:sw=2:ts=2:et:path^=../include,../third_party
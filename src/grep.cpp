@@ -5,9 +5,13 @@
 #include "gemmi/cif.hpp"
 #include "gemmi/gz.hpp"
 #include "gemmi/dirwalk.hpp"
+#include "gemmi/jobs.hpp"      // for JobScheduler
 #include "gemmi/fileutil.hpp"  // for is_pdb_code, expand_if_pdb_code
+#include <algorithm>  // for max
 #include <cstdio>
+#include <cstdlib>    // for atoi
 #include <cstring>
+#include <memory>     // for unique_ptr
 #include <stdexcept>
 #include <string>
 
@@ -23,7 +27,8 @@ namespace rules = gemmi::cif::rules;
 
 enum OptionIndex { FromFile=3, Recurse, MaxCount, OneBlock, And, Delim,
                    WithFileName, NoBlockName, WithLineNumbers, WithTag,
-                   Summarize, MatchingFiles, NonMatchingFiles, Count, Raw };
+                   Summarize, MatchingFiles, NonMatchingFiles, Count, Raw,
+                   Jobs };
 
 static const option::Descriptor Usage[] = {
   { NoOp, 0, "", "", Arg::None,
@@ -65,6 +70,8 @@ static const option::Descriptor Usage[] = {
     "  -w, --raw  \tinclude '?', '.', and string quotes" },
   { Summarize, 0, "s", "summarize", Arg::None,
     "  -s, --summarize  \tdisplay joint statistics for all files" },
+  { Jobs, 0, "j", "jobs", Arg::Int,
+    "  -j, --jobs=N  \tsearch N files at once (default: number of CPUs)" },
   { 0, 0, 0, 0, 0, 0 }
 };
 
@@ -92,7 +99,9 @@ struct Parameters {
   int table_width = 0;
   int column = 0;
   std::vector<int> counters;
-  size_t total_count = 0;
+  size_t total_count = 0;  // in the current file
+  std::string output;
+  std::string error;
   bool last_block = false;
   std::vector<int> multi_match_columns;
   std::vector<std::vector<std::string>> multi_values;
@@ -108,21 +117,22 @@ void process_match(const Input& in, Parameters& par, int n) {
   if (par.print_count)
     return;
   const char* sep = par.delim.empty() ? ":" : par.delim.c_str();
+  std::string& out = par.output;
   if (par.with_filename)
-    printf("%s%s", par.path, sep);
+    out.append(par.path).append(sep);
   if (par.with_blockname)
-    printf("%s%s", par.block_name.c_str(), sep);
+    out.append(par.block_name).append(sep);
   if (par.with_line_numbers)
-    printf("%zu%s", in.iterator().line, sep);
+    out.append(std::to_string(in.iterator().line)).append(sep);
   if (par.with_tag) {
     const std::string& tag = n < 0 ? par.search_tag : par.multi_tags[n];
     if (par.delim.empty())
-      printf("[%s] ", tag.c_str());
+      out.append("[").append(tag).append("] ");
     else
-      printf("%s%s", tag.c_str(), sep);
+      out.append(tag).append(sep);
   }
-  std::string value = par.raw ? in.string() : cif::as_string(in.string());
-  printf("%s\n", value.c_str());
+  out += par.raw ? in.string() : cif::as_string(in.string());
+  out += '\n';
   if (par.counters[0] == par.max_count)
     throw true;
 }
@@ -185,29 +195,30 @@ static void process_multi_match(Parameters& par) {
     if (cif::is_null(par.multi_values[0][i]) && !par.raw)
       continue;
     const char* sep = par.delim.empty() ? ":" : par.delim.c_str();
+    std::string& out = par.output;
     if (par.with_filename)
-      printf("%s%s", par.path, sep);
+      out.append(par.path).append(sep);
     if (par.with_blockname)
-      printf("%s%s", par.block_name.c_str(), sep);
+      out.append(par.block_name).append(sep);
     if (par.with_tag) {
       if (par.delim.empty())
-        printf("[%s] ", par.multi_tags[0].c_str());
+        out.append("[").append(par.multi_tags[0]).append("] ");
       else
-        printf("%s%s", par.multi_tags[0].c_str(), sep);
+        out.append(par.multi_tags[0]).append(sep);
     }
     for (size_t j = 0; j != par.multi_values.size(); ++j) {
       if (j != 0)
-        std::fputs(par.delim.empty() ? ";" : par.delim.c_str(), stdout);
+        out += par.delim.empty() ? ";" : par.delim.c_str();
       const auto& v = par.multi_values[j];
       if (!v.empty()) {
         const std::string& raw_str = v[i < v.size() ? i : 0];
         std::string s = par.raw ? raw_str : cif::as_string(raw_str);
         if (s.find_first_of(need_escaping) != std::string::npos)
           s = escape(s, need_escaping[2]);
-        printf("%s", s.c_str());
+        out += s;
       }
     }
-    std::putc('\n', stdout);
+    out += '\n';
     if (par.counters[0] == par.max_count)
       break;
   }
@@ -215,20 +226,21 @@ static void process_multi_match(Parameters& par) {
     mv.clear();
 }
 
-static void print_count(const Parameters& par) {
+static void print_count(Parameters& par) {
   const char* sep = par.delim.empty() ? ":" : par.delim.c_str();
+  std::string& out = par.output;
   if (par.with_filename)
-    printf("%s%s", par.path, sep);
+    out.append(par.path).append(sep);
   if (par.with_blockname)
-    printf("%s%s", par.block_name.c_str(), sep);
+    out.append(par.block_name).append(sep);
   bool first = true;
   for (int c : par.counters) {
     if (!first)
-      std::fputs(par.delim.empty() ? ";" : par.delim.c_str(), stdout);
-    printf("%d", c);
+      out += par.delim.empty() ? ";" : par.delim.c_str();
+    out += std::to_string(c);
     first = false;
   }
-  std::putc('\n', stdout);
+  out += '\n';
 }
 
 
@@ -421,9 +433,12 @@ void run_parse(Input&& in, Parameters& par) {
     pegtl::parse<rules::file, MultiSearch, cif::Errors>(in, par);
 }
 
-static
-void grep_file(const std::string& path, Parameters& par, int& err_count) {
+// The output is stored in par.output, errors in par.error.
+static void grep_file(const std::string& path, Parameters& par) {
   par.path = path.c_str();
+  par.output.clear();
+  par.error.clear();
+  par.total_count = 0;
   par.block_name.clear();
   par.counters.clear();
   if (par.globbing)
@@ -452,21 +467,18 @@ void grep_file(const std::string& path, Parameters& par, int& err_count) {
   } catch (bool) {
     // ok, "throw true" is used as goto
   } catch (std::runtime_error& e) {
-    std::fflush(stdout);
-    fprintf(stderr, "Error when parsing %s:\n\t%s\n", path.c_str(), e.what());
-    err_count++;
+    par.error = e.what();
     return;
   }
   if (par.print_count) {
     print_count(par);
   } else if (par.only_filenames) {
     if (par.inverse == (par.counters[0] == 0))
-      printf("%s\n", par.path);
+      par.output.append(par.path).append("\n");
   } else {
     process_multi_match(par);
   }
   par.total_count += par.counters[0];
-  std::fflush(stdout);
 }
 
 
@@ -543,39 +555,89 @@ int GEMMI_MAIN(int argc, char **argv) {
       params.globbing = true;
   }
 
+  struct GrepInput {
+    std::string path;
+    bool one_block;
+  };
+  struct GrepOutput {
+    std::string text;
+    std::string error;
+    size_t count = 0;
+  };
+  int n_threads = p.options[Jobs] ? std::atoi(p.options[Jobs].arg) : 0;
+  gemmi::JobScheduler scheduler(n_threads);
+  size_t path_idx = 0;
+  std::unique_ptr<gemmi::ParallelCifWalk> walk;
+  auto next_input = [&](GrepInput& input) {
+    input.one_block = params.last_block;
+    for (;;) {
+      if (walk) {
+        if (walk->next(input.path))
+          return true;
+        walk.reset();
+      }
+      if (path_idx == paths.size())
+        return false;
+      const std::string& path = paths[path_idx++];
+      if (path == "-") {
+        input.path = path;
+        return true;
+      }
+      if (p.options[FromFile] ? starts_with_pdb_code(path)
+                              : gemmi::is_pdb_code(path)) {
+        input.path = gemmi::expand_if_pdb_code(path.substr(0, 4));
+        input.one_block = true;  // PDB code implies -O
+        return true;
+      }
+      // directories are listed in background threads and the next
+      // files are prefetched while the previous ones are searched
+      int prefetch = std::max(8, 2 * scheduler.n_workers());
+      walk.reset(new gemmi::ParallelCifWalk(path, 0, prefetch));
+    }
+  };
+  // each worker has own copy of Parameters
+  std::vector<Parameters> worker_params(scheduler.n_workers(), params);
+  auto search = [&](const GrepInput& input, int worker) {
+    Parameters& par = worker_params[worker];
+    par.last_block = input.one_block;
+    grep_file(input.path, par);
+    GrepOutput out;
+    out.text.swap(par.output);
+    out.error.swap(par.error);
+    out.count = par.total_count;
+    return out;
+  };
   size_t file_count = 0;
+  size_t total_count = 0;
   int err_count = 0;
-  for (const std::string& path : paths) {
-    if (path == "-") {
-      grep_file(path, params, err_count);
-      file_count++;
-    } else if (p.options[FromFile] ? starts_with_pdb_code(path)
-                                   : gemmi::is_pdb_code(path)) {
-      std::string real_path = gemmi::expand_if_pdb_code(path.substr(0, 4));
-      params.last_block = true;  // PDB code implies -O
-      grep_file(real_path, params, err_count);
-      params.last_block = p.options[OneBlock];
-      file_count++;
-    } else {
-      try {
-        for (const char* file : gemmi::CifWalk(path)) {
-          grep_file(file, params, err_count);
-          file_count++;
-        }
-      } catch (std::runtime_error &e) {
-        fprintf(stderr, "Error: %s\n", e.what());
-        return 2;
-      }
+  auto print = [&](const GrepInput& input,
+                   gemmi::JobResult<GrepOutput>& result) {
+    file_count++;
+    const GrepOutput& out = result.value;
+    std::fwrite(out.text.data(), 1, out.text.size(), stdout);
+    std::fflush(stdout);
+    const std::string& error = result.ok() ? out.error : result.error;
+    if (!error.empty()) {
+      fprintf(stderr, "Error when parsing %s:\n\t%s\n",
+              input.path.c_str(), error.c_str());
+      err_count++;
     }
+    total_count += out.count;
+  };
+  try {
+    scheduler.run<GrepInput>(next_input, search, print);
+  } catch (std::runtime_error &e) {
+    fprintf(stderr, "Error: %s\n", e.what());
+    return 2;
   }
   if (p.options[Summarize]) {
-    printf("Total count in %zu files: %zu\n", file_count, params.total_count);
+    printf("Total count in %zu files: %zu\n", file_count, total_count);
     if (err_count > 0)
       printf("Errors encountered when reading %d files.\n", err_count);
   }
   if (err_count > 0)
     return 2;
-  return params.total_count != 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  return total_count != 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 // vim:sw=2:ts=2:et:path^=../include,../third_party
@@ -1,12 +1,15 @@
 // Copyright 2017 Global Phasing Ltd.
 
 #include "gemmi/ccp4.hpp"
+#include "gemmi/fourier.hpp"  // for transform_map_to_f_phi, apply_b_factor
 #include "gemmi/gz.hpp"  // for MaybeGzipped
 #include "gemmi/util.hpp"  // for trim_str
 #include "gemmi/symmetry.hpp"
-#include <cmath>     // for floor
+#include <cmath>     // for floor, isnan
 #include <cstdio>    // for fprintf
-#include <algorithm> // for nth_element, count_if
+#include <cstdlib>   // for strtod
+#include <utility>   // for move
+#include <algorithm> // for max_element, all_of, any_of
 #define USE_UNICODE
 #ifdef USE_UNICODE
 #include <clocale>  // for setlocale
@@ -15,7 +18,8 @@
 #define GEMMI_PROG map
 #include "options.h"
 
-enum OptionIndex { Verbose=3, Deltas, CheckSym, Reorder, Full };
+enum OptionIndex { Verbose=3, Deltas, CheckSym, Reorder, Full, Sharpen,
+                   Lowpass };
 
 static const option::Descriptor Usage[] = {
   { NoOp, 0, "", "", Arg::None,
@@ -31,6 +35,13 @@ static const option::Descriptor Usage[] = {
     "  --write-xyz=FILE  \tWrite transposed map with fast X axis and slow Z." },
   { Full, 0, "", "write-full", Arg::Required,
     "  --write-full=FILE  \tWrite map extended to cover whole unit cell." },
+  { NoOp, 0, "", "", Arg::None,
+    "\nFiltering in reciprocal space, applied before other options"
+    "\n(the map must cover the unit cell):" },
+  { Sharpen, 0, "", "sharpen", Arg::Float,
+    "  --sharpen=B  \tSharpen (B>0) or blur (B<0) the map." },
+  { Lowpass, 0, "", "lowpass", Arg::Float,
+    "  --lowpass=D  \tRemove Fourier terms with resolution beyond D (in A)." },
   { 0, 0, 0, 0, 0, 0 }
 };
 
@@ -43,13 +54,9 @@ void print_histogram(const std::vector<T>& data, double min, double max) {
   constexpr int rows = 24;
 #endif
   const int cols = 80; // TODO: use $COLUMNS
-  std::vector<int> bins(cols+1, 0);
-  double delta = max - min;
-  for (T d : data) {
-    int n = (int) std::floor((d - min) * (cols / delta));
-    bins[n >= 0 ? (n < cols ? n : cols - 1) : 0]++;
-  }
-  double max_h = *std::max_element(std::begin(bins), std::end(bins));
+  std::vector<size_t> bins = gemmi::calculate_histogram(data, cols,
+                                                        min, max).counts;
+  double max_h = (double) *std::max_element(bins.begin(), bins.end());
   for (int i = rows; i > 0; --i) {
     for (int j = 0; j < cols; ++j) {
       double h = bins[j] / max_h * rows;
@@ -109,15 +116,14 @@ gemmi::GridStats print_info(const gemmi::Ccp4<T>& map) {
     std::printf("Non-zero origin: %d %d %d\n", origin[0], origin[1], origin[2]);
 
   std::printf("\nStatistics from HEADER and DATA\n");
-  gemmi::GridStats st = gemmi::calculate_grid_statistics(grid.data);
+  gemmi::GridStats st = gemmi::calculate_grid_statistics(grid.data, 0);
   std::printf("Minimum: %12.5f  %12.5f\n", map.hstats.dmin, st.dmin);
   std::printf("Maximum: %12.5f  %12.5f\n", map.hstats.dmax, st.dmax);
   std::printf("Mean:    %12.5f  %12.5f\n", map.hstats.dmean, st.dmean);
   std::printf("RMS:     %12.5f  %12.5f\n", map.hstats.rms, st.rms);
-  std::vector<T> data = grid.data;  // copy b/c nth_element() reorders data
-  size_t mpos = data.size() / 2;
-  std::nth_element(data.begin(), data.begin() + mpos, data.end());
-  std::printf("Median:                %12.5f\n", data[mpos]);
+  const std::vector<T>& data = grid.data;
+  std::printf("Median:                %12.5f\n",
+              (double) gemmi::find_nth_smallest(data, data.size() / 2));
   bool mask = std::all_of(data.begin(), data.end(),
                           [&st](T x) { return x == st.dmin || x == st.dmax; });
   double margin = mask ? 7 * (st.dmax - st.dmin) : 0;
@@ -139,6 +145,24 @@ gemmi::GridStats print_info(const gemmi::Ccp4<T>& map) {
   return st;
 }
 
+// the map is replaced by the map in the whole unit cell
+template<typename T>
+void filter_map(gemmi::Ccp4<T>& map, double sharpen_b, double d_min) {
+  map.setup(gemmi::GridSetup::Full, NAN);
+  if (std::any_of(map.grid.data.begin(), map.grid.data.end(),
+                  [](T x) { return std::isnan(x); }))
+    gemmi::fail("the map does not cover the whole unit cell");
+  // the half of the hkl grid is enough if the map can be reconstructed
+  bool half_l = map.grid.nw % 2 == 0;
+  auto hkl = gemmi::transform_map_to_f_phi(map.grid, half_l);
+  if (sharpen_b != 0)
+    gemmi::apply_b_factor(hkl, -sharpen_b);
+  if (d_min > 0)
+    gemmi::apply_resolution_limits(hkl, d_min);
+  map.grid = gemmi::transform_f_phi_grid_to_map(std::move(hkl));
+  map.update_ccp4_header(2, true);
+}
+
 template<typename T>
 void print_deltas(const gemmi::Grid<T>& grid, double dmin, double dmax) {
   std::vector<double> deltas;
@@ -151,7 +175,7 @@ void print_deltas(const gemmi::Grid<T>& grid, double dmin, double dmax) {
         for (int u = f[0]; u < grid.nu; ++u)
           deltas.push_back(grid.get_value_q(u, v, w) -
                            grid.get_value_q(u - f[0], v - f[1], w - f[2]));
-    gemmi::GridStats st = gemmi::calculate_grid_statistics(deltas);
+    gemmi::GridStats st = gemmi::calculate_grid_statistics(deltas, 0);
     std::printf("\nd%c: min: %.5f  max: %.5f  mean: %.5f  std.dev: %.5f\n",
                 "XYZ"[i], st.dmin, st.dmax, st.dmean, st.rms);
     print_histogram(deltas, dmin, dmax);
@@ -180,6 +204,15 @@ int GEMMI_MAIN(int argc, char **argv) {
       if (verbose)
         std::fprintf(stderr, "Reading %s ...\n", input);
       map.read_ccp4(gemmi::MaybeGzipped(input));
+      if (p.options[Sharpen] || p.options[Lowpass]) {
+        double b = p.options[Sharpen]
+                   ? std::strtod(p.options[Sharpen].arg, nullptr) : 0.;
+        double d_min = p.options[Lowpass]
+                       ? std::strtod(p.options[Lowpass].arg, nullptr) : 0.;
+        if (verbose)
+          std::fprintf(stderr, "Filtering the map in reciprocal space ...\n");
+        filter_map(map, b, d_min);
+      }
       gemmi::GridStats stats = print_info(map);
       if (p.options[Deltas])
         print_deltas(map.grid, stats.dmin, stats.dmax);
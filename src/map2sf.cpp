@@ -4,13 +4,13 @@
 
 #include <stdio.h>
 #include <cctype>             // for toupper
-#include <cstdlib>            // for strtod
+#include <cstdlib>            // for strtod, atoi
 #ifndef GEMMI_ALL_IN_ONE
 # define GEMMI_WRITE_IMPLEMENTATION 1
 #endif
 #include <gemmi/mtz.hpp>      // for Mtz
 #include <gemmi/ccp4.hpp>     // for Ccp4
-#include <gemmi/fourier.hpp>  // for transform_map_to_sf
+#include <gemmi/fourier.hpp>  // for transform_map_to_f_phi_box
 #include <gemmi/gzread.hpp>   // for read_cif_gz
 #include <gemmi/refln.hpp>    // for ReflnBlock
 #include <gemmi/util.hpp>     // for fail, iends_with
@@ -22,7 +22,7 @@
 using gemmi::Mtz;
 using options_type = std::vector<option::Option>;
 
-enum OptionIndex { Verbose=3, Base, Section, DMin, FType, PhiType };
+enum OptionIndex { Verbose=3, Base, Section, DMin, FType, PhiType, Jobs };
 
 static const option::Descriptor Usage[] = {
   { NoOp, 0, "", "", Arg::None,
@@ -43,6 +43,8 @@ static const option::Descriptor Usage[] = {
     "  --ftype=TYPE   \tMTZ amplitude column type (default: F)." },
   { PhiType, 0, "", "phitype", Arg::Char,
     "  --phitype=TYPE  \tMTZ phase column type (default: P)." },
+  { Jobs, 0, "j", "jobs", Arg::Int,
+    "  -j, --jobs=N  \tUse N threads (default: all CPUs)." },
   { 0, 0, 0, 0, 0, 0 }
 };
 
@@ -60,11 +62,13 @@ static void transform_map_to_sf(OptParser& p) {
   char f_type = p.options[FType] ? std::toupper(p.options[FType].arg[0]) : 'F';
   char phi_type = p.options[PhiType] ? std::toupper(p.options[PhiType].arg[0])
                                      : 'P';
+  double dmin = 0;
   double min_1_d2 = 0;
   if (p.options[DMin]) {
-    double dmin = std::strtod(p.options[DMin].arg, nullptr);
+    dmin = std::strtod(p.options[DMin].arg, nullptr);
     min_1_d2 = 1. / (dmin * dmin);
   }
+  int n_threads = p.options[Jobs] ? std::atoi(p.options[Jobs].arg) : 0;
   if (verbose)
     fprintf(stderr, "Reading %s ...\n", map_path);
   gemmi::Ccp4<float> map;
@@ -76,7 +80,9 @@ static void transform_map_to_sf(OptParser& p) {
   if (verbose)
     fprintf(stderr, "Fourier transform of grid %d x %d x %d...\n",
             map.grid.nu, map.grid.nv, map.grid.nw);
-  auto hkl = gemmi::transform_map_to_f_phi(map.grid, /*half_l=*/true);
+  // only the coefficients up to dmin are calculated
+  gemmi::FPhiBox<float> box = gemmi::transform_map_to_f_phi_box(map.grid, dmin,
+                                                                n_threads);
   if (gemmi::iends_with(output_path, ".mtz")) {
     gemmi::Mtz mtz;
     if (p.options[Base]) {
@@ -101,13 +107,30 @@ static void transform_map_to_sf(OptParser& p) {
       mtz.add_column(phi_col, phi_type, dataset_id);
       mtz.expand_data_rows(2);
       size_t ncol = mtz.columns.size();
+      // without dmin, indices beyond the grid are wrapped (as they always
+      // were), so the box with Nyquist indices covers all reflections
+      auto wrap = [](int i, int n) {
+        i %= n;
+        return 2 * i > n ? i - n : 2 * i < -n ? i + n : i;
+      };
       for (int i = 0; i != mtz.nreflections; ++i) {
         int h = (int) mtz.data[i * ncol + 0];
         int k = (int) mtz.data[i * ncol + 1];
         int l = (int) mtz.data[i * ncol + 2];
-        std::complex<float> v = hkl.get_value(h, k, l);
-        mtz.data[i * ncol + f_idx] = (float) std::abs(v);
-        mtz.data[i * ncol + f_idx + 1] = get_phase_for_mtz(v);
+        if (dmin == 0) {
+          h = wrap(h, map.grid.nu);
+          k = wrap(k, map.grid.nv);
+          l = wrap(l, map.grid.nw);
+        }
+        if (box.has_index(h, k, l) &&
+            (min_1_d2 == 0. || mtz.cell.calculate_1_d2(h, k, l) < min_1_d2)) {
+          std::complex<float> v = box.get_value(h, k, l);
+          mtz.data[i * ncol + f_idx] = (float) std::abs(v);
+          mtz.data[i * ncol + f_idx + 1] = get_phase_for_mtz(v);
+        } else {
+          mtz.data[i * ncol + f_idx] = NAN;
+          mtz.data[i * ncol + f_idx + 1] = NAN;
+        }
       }
     } else {
       mtz.cell = map.grid.unit_cell;
@@ -120,20 +143,20 @@ static void transform_map_to_sf(OptParser& p) {
       mtz.add_dataset(p.options[Section] ? p.options[Section].arg : "unknown");
       mtz.add_column(f_col, f_type);
       mtz.add_column(phi_col, phi_type);
-      int max_h = (hkl.nu - 1) / 2;
-      int max_k = (hkl.nv - 1) / 2;
-      int max_l = hkl.nw - 1;
+      // the Nyquist index n/2 is aliased with -n/2, so it is written
+      // only as +nw/2 for l (as before) and not at all for h and k
+      int max_h = std::min(box.max_h, (map.grid.nu - 1) / 2);
+      int max_k = std::min(box.max_k, (map.grid.nv - 1) / 2);
+      int min_l = -std::min(box.max_l, (map.grid.nw - 1) / 2);
       gemmi::HklAsuChecker hkl_asu(mtz.spacegroup);
-      for (int h = -max_h; h < max_h + 1; ++h)
-        for (int k = -max_k; k < max_k + 1; ++k)
-          for (int l = 0; l < max_l + 1; ++l)
+      for (int h = -max_h; h <= max_h; ++h)
+        for (int k = -max_k; k <= max_k; ++k)
+          for (int l = min_l; l <= box.max_l; ++l)
             if (hkl_asu.is_in(h, k, l) &&
                 (min_1_d2 == 0. ||
                  mtz.cell.calculate_1_d2(h, k, l) < min_1_d2) &&
                 !(h == 0 && k == 0 && l == 0)) {
-              std::complex<float> v = hkl.get_value_q(h >= 0 ? h : h + hkl.nu,
-                                                      k >= 0 ? k : k + hkl.nv,
-                                                      l);
+              std::complex<float> v = box.get_value(h, k, l);
               mtz.data.push_back((float) h);
               mtz.data.push_back((float) k);
               mtz.data.push_back((float) l);
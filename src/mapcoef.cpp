@@ -149,15 +149,15 @@ read_sf_and_fft_to_map(const char* input_path,
     gemmi::ReflnBlock rblock = gemmi::get_refln_block(
                                    gemmi::read_cif_gz(input_path).blocks,
                                    {f_label, ph_label}, section);
-    gemmi::ReflnDataProxy data{rblock};
+    // the numbers are parsed once here and then read from memory
+    std::vector<std::string> tags{f_label, ph_label};
+    gemmi::ReflnDecodedDataProxy data(rblock, tags);
     adjust_size(data, size, sample_rate,
                 options[ExactDims], options[GridQuery]);
     if (output)
       fprintf(output, "Putting data from block %s into matrix...\n",
               rblock.block.name.c_str());
-    grid = gemmi::get_f_phi_on_grid<float>(gemmi::ReflnDataProxy{rblock},
-                                           rblock.find_column_index(f_label),
-                                           rblock.find_column_index(ph_label),
+    grid = gemmi::get_f_phi_on_grid<float>(data, 3, 4,
                                            size, half_l, hkl_orient);
   } else {
     Mtz mtz = gemmi::read_mtz(gemmi::MaybeGzipped(input_path), true);
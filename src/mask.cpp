@@ -98,11 +98,10 @@ int GEMMI_MAIN(int argc, char **argv) {
           std::fprintf(stderr, "Cannot use negative fraction.\n");
           return 2;
         }
-        auto data = mask.grid.data;  // making a copy for nth_element()
+        const std::vector<signed char>& data = mask.grid.data;
         size_t n = std::min(static_cast<size_t>(data.size() * fraction),
                             data.size() - 1);
-        std::nth_element(data.begin(), data.begin() + n, data.end());
-        threshold = data[n];
+        threshold = gemmi::find_nth_smallest(data, n);
       } else {
         std::fprintf(stderr, "You need to specify threshold (-t or -f).\n");
         return 2;
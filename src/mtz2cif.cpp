@@ -9,17 +9,20 @@
 //  - should we allow for repeated column name in MTZ?
 
 #include <algorithm>
+#include <cstdlib>            // for atoi
 #include <stdio.h>
 #include <gemmi/mtz.hpp>
+#include <gemmi/floatfmt.hpp> // for FloatFormat
 #include <gemmi/fileutil.hpp> // for file_open
 #include <gemmi/atox.hpp>     // for read_word
 #include <gemmi/gz.hpp>       // for MaybeGzipped
+#include <gemmi/parallel.hpp> // for parallel_for
 #include <gemmi/version.hpp>  // for GEMMI_VERSION
 #define GEMMI_PROG mtz2cif
 #include "options.h"
 
 enum OptionIndex { Verbose=3, Spec, PrintSpec, BlockName, SkipEmpty,
-                   NoComments };
+                   NoComments, Jobs };
 
 static const option::Descriptor Usage[] = {
   { NoOp, 0, "", "", Arg::None,
@@ -38,6 +41,8 @@ static const option::Descriptor Usage[] = {
     "  --skip-empty  \tSkip reflections with no values." },
   { NoComments, 0, "", "no-comments", Arg::None,
     "  --no-comments  \tDo not write comments in the mmCIF file." },
+  { Jobs, 0, "j", "jobs", Arg::Int,
+    "  -j, --jobs=N  \tUse N threads for formatting (default: all CPUs)." },
   { NoOp, 0, "", "", Arg::None,
     "\nIf CIF_FILE is -, the output is printed to stdout."
     "\nIf spec is -, it is read from stdin."
@@ -69,7 +74,7 @@ struct Trans {
   int col_idx;
   bool is_status = false;
   std::string refln_tag;
-  std::string format = "%g";
+  gemmi::FloatFormat format;
   int min_width = 0;
 };
 
@@ -80,6 +85,7 @@ struct Options {
   bool with_comments;
   const char* block_name;
   const char* mtz_path;
+  int n_threads;
 };
 
 static const char* default_spec[] = {
@@ -191,9 +197,7 @@ static std::vector<Trans> parse_spec(const gemmi::Mtz& mtz,
     std::string fmt = gemmi::read_word(p, &p);
     if (!fmt.empty() && !tr.is_status) {
       tr.min_width = check_format(fmt);
-      tr.format = "%" + fmt;
-      if (tr.format[1] == '_')
-        tr.format[1] = ' ';
+      tr.format.parse(fmt);
     }
     spec.push_back(tr);
   }
@@ -216,9 +220,46 @@ static std::vector<Trans> parse_spec(const gemmi::Mtz& mtz,
   return spec;
 }
 
-#if defined(__GNUC__)
-# pragma GCC diagnostic ignored "-Wformat-nonliteral"
-#endif
+static void format_rows(const gemmi::Mtz& mtz, const Options& opt,
+                        int start, int end, std::string& out) {
+  size_t max_row_len = 0;
+  for (const Trans& tr : opt.spec)
+    max_row_len += 65 + std::max(tr.format.width, tr.min_width);
+  std::vector<char> buf(max_row_len + 1);
+  out.clear();
+  for (int i = start; i != end; ++i) {
+    const float* row = &mtz.data[i * mtz.columns.size()];
+    if (!opt.value_indices.empty())
+      if (std::all_of(opt.value_indices.begin(), opt.value_indices.end(),
+                      [&](int n) { return std::isnan(row[n]); }))
+        continue;
+    char* p = buf.data();
+    bool first = true;
+    for (const Trans& tr : opt.spec) {
+      if (first)
+        first = false;
+      else
+        *p++ = ' ';
+      float v = row[tr.col_idx];
+      if (tr.is_status) {
+        char status = 'x';
+        if (opt.sigma_indices.empty() ||
+            !std::all_of(opt.sigma_indices.begin(), opt.sigma_indices.end(),
+                         [&](int n) { return std::isnan(row[n]); }))
+          status = v == 0. ? 'f' : 'o';
+        *p++ = status;
+      } else if (std::isnan(v)) {
+        for (int j = 1; j < tr.min_width; ++j)
+          *p++ = ' ';
+        *p++ = '?';
+      } else {
+        p = tr.format.write(p, v);
+      }
+    }
+    *p++ = '\n';
+    out.append(buf.data(), p);
+  }
+}
 
 static void write_cif(const gemmi::Mtz& mtz, const Options& opt, FILE* out) {
   std::string id = ".";
@@ -255,35 +296,23 @@ static void write_cif(const gemmi::Mtz& mtz, const Options& opt, FILE* out) {
     else
       fprintf(out, "_refln.%s\n", tr.refln_tag.c_str());
   }
-  for (int i = 0; i != mtz.nreflections; ++i) {
-    const float* row = &mtz.data[i * mtz.columns.size()];
-    if (!opt.value_indices.empty())
-      if (std::all_of(opt.value_indices.begin(), opt.value_indices.end(),
-                      [&](int n) { return std::isnan(row[n]); }))
-        continue;
-    bool first = true;
-    for (const Trans& tr : opt.spec) {
-      if (first)
-        first = false;
-      else
-        fputc(' ', out);
-      float v = row[tr.col_idx];
-      if (tr.is_status) {
-        char status = 'x';
-        if (opt.sigma_indices.empty() ||
-            !std::all_of(opt.sigma_indices.begin(), opt.sigma_indices.end(),
-                         [&](int n) { return std::isnan(row[n]); }))
-          status = v == 0. ? 'f' : 'o';
-        fputc(status, out);
-      } else if (std::isnan(v)) {
-        for (int j = 1; j < tr.min_width; ++j)
-          fputc(' ', out);
-        fputc('?', out);
-      } else {
-        fprintf(out, tr.format.c_str(), v);
-      }
-    }
-    fputc('\n', out);
+  // Rows are formatted in blocks, in parallel, and written in order.
+  const int block_size = 4096;
+  int n_blocks = (mtz.nreflections + block_size - 1) / block_size;
+  int n_threads = opt.n_threads > 0 ? opt.n_threads
+                                    : gemmi::default_thread_count();
+  std::vector<std::string> buffers(4 * n_threads);
+  for (int first = 0; first < n_blocks; first += (int) buffers.size()) {
+    int n = std::min((int) buffers.size(), n_blocks - first);
+    gemmi::parallel_for(n, n_threads, [&](size_t i) {
+      int start = (first + (int) i) * block_size;
+      int end = std::min(start + block_size, mtz.nreflections);
+      format_rows(mtz, opt, start, end, buffers[i]);
+    });
+    for (int i = 0; i != n; ++i)
+      if (std::fwrite(buffers[i].data(), buffers[i].size(), 1, out) != 1 &&
+          !buffers[i].empty())
+        gemmi::fail("Writing output failed");
   }
 }
 
@@ -345,6 +374,7 @@ int GEMMI_MAIN(int argc, char **argv) {
   }
   options.block_name = p.options[BlockName] ? p.options[BlockName].arg : "mtz";
   options.with_comments = !p.options[NoComments];
+  options.n_threads = p.options[Jobs] ? std::atoi(p.options[Jobs].arg) : 0;
   try {
     gemmi::fileptr_t f_out = gemmi::file_open_or(cif_path, "w", stdout);
     write_cif(mtz, options, f_out.get());
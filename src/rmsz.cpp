@@ -1,7 +1,7 @@
 // Copyright 2018 Global Phasing Ltd.
 
 #include <stdio.h>
-#include <cstdlib> // for getenv
+#include <cstdlib> // for getenv, atoi
 #include <stdexcept>
 #include "gemmi/gzread.hpp"
 #include "gemmi/model.hpp"     // for Structure, Atom, etc
@@ -10,6 +10,8 @@
 #include "gemmi/topo.hpp"      // for Topo
 #include "gemmi/calculate.hpp" // for find_best_plane, get_distance_from_plane
 #include "gemmi/polyheur.hpp"  // for setup_entities
+#include "gemmi/fileutil.hpp"  // for expand_if_pdb_code
+#include "gemmi/jobs.hpp"      // for JobScheduler
 
 #define GEMMI_PROG rmsz
 #include "options.h"
@@ -17,24 +19,29 @@
 namespace cif = gemmi::cif;
 using gemmi::Topo;
 
-enum OptionIndex { Verbose=3, Monomers, FormatIn, Cutoff };
+enum OptionIndex { Verbose=3, FromFile, Monomers, FormatIn, Cutoff, Jobs };
 
 static const option::Descriptor Usage[] = {
   { NoOp, 0, "", "", Arg::None,
     "Usage:"
-    "\n " EXE_NAME " [options] INPUT_FILE"
+    "\n " EXE_NAME " [options] INPUT_FILE[...]"
+    "\n " EXE_NAME " [options] -f LIST_FILE"
     "\n\nValidate geometry of a coordinate file with (Refmac) monomer library."
     "\n\nOptions:" },
   CommonUsage[Help],
   CommonUsage[Version],
   { Verbose, 0, "v", "verbose", Arg::None,
     "  -v, --verbose  \tVerbose output." },
+  { FromFile, 0, "f", "file", Arg::Required,
+    "  -f, --file=FILE  \tObtain paths or PDB IDs from FILE, one per line." },
   { Monomers, 0, "", "monomers", Arg::Required,
     "  --monomers=DIR  \tMonomer library dir (default: $CLIBD_MON)." },
   { FormatIn, 0, "", "format", Arg::CoorFormat,
     "  --format=FORMAT  \tInput format (default: from the file extension)." },
   { Cutoff, 0, "", "cutoff", Arg::Float,
     "  --cutoff=ZC  \tList bonds and angles with Z score > ZC (default: 2)." },
+  { Jobs, 0, "j", "jobs", Arg::Int,
+    "  -j, --jobs=N  \tCheck N files at once (default: all CPUs)." },
   { 0, 0, 0, 0, 0, 0 }
 };
 
@@ -63,17 +70,23 @@ static double check_restraint(const Topo::Force force,
                               double cutoff,
                               const char* tag,
                               RMSes* rmses,
-                              bool verbose) {
+                              bool verbose,
+                              std::string& out) {
+  char buf[512];
   switch (force.rkind) {
     case Topo::RKind::Bond: {
       const Topo::Bond& t = topo.bonds[force.index];
       double z = t.calculate_z();
       if (z > cutoff) {
-        int n = printf("%s bond %s: |Z|=%.1f", tag, t.restr->str().c_str(), z);
-        if (verbose)
-          printf(" %*.3f -> %.3f", std::max(50 - n, 7),
-                 t.restr->value, t.calculate());
-        puts("");
+        int n = snprintf(buf, sizeof buf, "%s bond %s: |Z|=%.1f",
+                         tag, t.restr->str().c_str(), z);
+        out += buf;
+        if (verbose) {
+          snprintf(buf, sizeof buf, " %*.3f -> %.3f", std::max(50 - n, 7),
+                   t.restr->value, t.calculate());
+          out += buf;
+        }
+        out += '\n';
       }
       rmses->z_bond.put(z);
       rmses->d_bond.put(z * t.restr->esd);
@@ -83,11 +96,15 @@ static double check_restraint(const Topo::Force force,
       const Topo::Angle& t = topo.angles[force.index];
       double z = t.calculate_z();
       if (z > cutoff) {
-        int n = printf("%s angle %s: |Z|=%.1f", tag, t.restr->str().c_str(), z);
-        if (verbose)
-          printf(" %*.1f -> %.1f", std::max(50 - n, 7),
-                 t.restr->value, gemmi::deg(t.calculate()));
-        puts("");
+        int n = snprintf(buf, sizeof buf, "%s angle %s: |Z|=%.1f",
+                         tag, t.restr->str().c_str(), z);
+        out += buf;
+        if (verbose) {
+          snprintf(buf, sizeof buf, " %*.1f -> %.1f", std::max(50 - n, 7),
+                   t.restr->value, gemmi::deg(t.calculate()));
+          out += buf;
+        }
+        out += '\n';
       }
       rmses->z_angle.put(z);
       rmses->d_angle.put(z * t.restr->esd);
@@ -98,12 +115,15 @@ static double check_restraint(const Topo::Force force,
       // TODO consider torsion period
       double z = t.calculate_z();
       if (z > cutoff) {
-        int n = printf("%s torsion %s: |Z|=%.1f",
-                       tag, t.restr->str().c_str(), z);
-        if (verbose)
-          printf(" %*.1f -> %.1f", std::max(50 - n, 7),
-                 t.restr->value, gemmi::deg(t.calculate()));
-        puts("");
+        int n = snprintf(buf, sizeof buf, "%s torsion %s: |Z|=%.1f",
+                         tag, t.restr->str().c_str(), z);
+        out += buf;
+        if (verbose) {
+          snprintf(buf, sizeof buf, " %*.1f -> %.1f", std::max(50 - n, 7),
+                   t.restr->value, gemmi::deg(t.calculate()));
+          out += buf;
+        }
+        out += '\n';
       }
       rmses->z_torsion.put(z);
       rmses->d_torsion.put(z * t.restr->esd);
@@ -113,7 +133,9 @@ static double check_restraint(const Topo::Force force,
       const Topo::Chirality& t = topo.chirs[force.index];
       rmses->all_chiralities++;
       if (!t.check()) {
-        printf("%s wrong chirality of %s\n", tag, t.restr->str().c_str());
+        snprintf(buf, sizeof buf, "%s wrong chirality of %s\n",
+                 tag, t.restr->str().c_str());
+        out += buf;
         rmses->wrong_chirality++;
         return 1.0;
       }
@@ -126,9 +148,11 @@ static double check_restraint(const Topo::Force force,
       for (const gemmi::Atom* atom : t.atoms) {
         double dist = gemmi::get_distance_from_plane(atom->pos, coeff);
         double z = dist / t.restr->esd;
-        if (z > cutoff)
-          printf("%s atom %s not in plane %s, |Z|=%.1f\n", tag,
-                 atom->name.c_str(), t.restr->str().c_str(), z);
+        if (z > cutoff) {
+          snprintf(buf, sizeof buf, "%s atom %s not in plane %s, |Z|=%.1f\n",
+                   tag, atom->name.c_str(), t.restr->str().c_str(), z);
+          out += buf;
+        }
         if (z > max_z)
             max_z = z;
       }
@@ -141,52 +165,42 @@ static double check_restraint(const Topo::Force force,
 }
 
 
-int GEMMI_MAIN(int argc, char **argv) {
-  OptParser p(EXE_NAME);
-  p.simple_parse(argc, argv, Usage);
-  p.require_positional_args(1);
-  const char* monomer_dir = p.options[Monomers] ? p.options[Monomers].arg
-                                                : std::getenv("CLIBD_MON");
-  if (monomer_dir == nullptr || *monomer_dir == '\0') {
-    fprintf(stderr, "Set $CLIBD_MON or use option --monomers.\n");
-    return 1;
-  }
-  double cutoff = 2.0;
-  if (p.options[Cutoff])
-    cutoff = std::strtod(p.options[Cutoff].arg, nullptr);
-  std::string input = p.coordinate_input_file(0);
-  try {
-    gemmi::CoorFormat format = coor_format_as_enum(p.options[FormatIn]);
-    gemmi::Structure st = gemmi::read_structure_gz(input, format);
-    if (st.input_format == gemmi::CoorFormat::Pdb ||
-        st.input_format == gemmi::CoorFormat::ChemComp)
-      gemmi::setup_entities(st);
-    for (gemmi::Model& model : st.models) {
-      if (st.models.size() > 1)
-        printf("### Model %s ###\n", model.name.c_str());
-      gemmi::MonLib monlib = gemmi::read_monomer_lib(monomer_dir,
-                                                  model.get_all_residue_names(),
-                                                  gemmi::read_cif_gz);
-      Topo topo;
-      topo.initialize_refmac_topology(model, st.entities, monlib);
-      topo.finalize_refmac_topology(monlib);
+// Returns the report for one file.
+static std::string check_file(const std::string& input,
+                              gemmi::CoorFormat format,
+                              const char* monomer_dir,
+                              double cutoff, bool verbose) {
+  std::string out;
+  char buf[512];
+  gemmi::Structure st = gemmi::read_structure_gz(input, format);
+  if (st.input_format == gemmi::CoorFormat::Pdb ||
+      st.input_format == gemmi::CoorFormat::ChemComp)
+    gemmi::setup_entities(st);
+  for (gemmi::Model& model : st.models) {
+    if (st.models.size() > 1)
+      out += "### Model " + model.name + " ###\n";
+    gemmi::MonLib monlib = gemmi::read_monomer_lib(monomer_dir,
+                                                model.get_all_residue_names(),
+                                                gemmi::read_cif_gz);
+    Topo topo;
+    topo.initialize_refmac_topology(model, st.entities, monlib);
+    topo.finalize_refmac_topology(monlib);
 
-      RMSes rmses;
-      for (const Topo::ChainInfo& chain_info : topo.chains)
-        for (const Topo::ResInfo& ri : chain_info.residues) {
-          std::string res = chain_info.name + " " + ri.res->str();
-          for (const Topo::Force& force : ri.forces)
-            if (force.provenance == Topo::Provenance::PrevLink ||
-                force.provenance == Topo::Provenance::Monomer)
-              check_restraint(force, topo, cutoff, res.c_str(), &rmses,
-                              p.options[Verbose]);
-        }
-      for (const Topo::ExtraLink& link : topo.extras) {
-        for (const Topo::Force& force : link.forces)
-          check_restraint(force, topo, cutoff, "link", &rmses,
-                          p.options[Verbose]);
+    RMSes rmses;
+    for (const Topo::ChainInfo& chain_info : topo.chains)
+      for (const Topo::ResInfo& ri : chain_info.residues) {
+        std::string res = chain_info.name + " " + ri.res->str();
+        for (const Topo::Force& force : ri.forces)
+          if (force.provenance == Topo::Provenance::PrevLink ||
+              force.provenance == Topo::Provenance::Monomer)
+            check_restraint(force, topo, cutoff, res.c_str(), &rmses,
+                            verbose, out);
       }
-      printf("Model rmsZ: "
+    for (const Topo::ExtraLink& link : topo.extras) {
+      for (const Topo::Force& force : link.forces)
+        check_restraint(force, topo, cutoff, "link", &rmses, verbose, out);
+    }
+    snprintf(buf, sizeof buf, "Model rmsZ: "
              "bond: %.3f, angle: %.3f, torsion: %.3f, planarity %.3f\n"
              "Model rmsD: "
              "bond: %.3f, angle: %.3f, torsion: %.3f, planarity %.3f\n"
@@ -200,15 +214,46 @@ int GEMMI_MAIN(int argc, char **argv) {
              rmses.d_torsion.get_value(),
              rmses.d_plane.get_value(),
              rmses.wrong_chirality, rmses.all_chiralities);
-    }
-  } catch (std::runtime_error& e) {
-    fprintf(stderr, "ERROR: %s\n", e.what());
-    return 1;
-  } catch (std::out_of_range& e) {
-    fprintf(stderr, "ERROR: %s\n", e.what());
+    out += buf;
+  }
+  return out;
+}
+
+int GEMMI_MAIN(int argc, char **argv) {
+  OptParser p(EXE_NAME);
+  p.simple_parse(argc, argv, Usage);
+  std::vector<std::string> paths = p.paths_from_args_or_file(FromFile, 0);
+  const char* monomer_dir = p.options[Monomers] ? p.options[Monomers].arg
+                                                : std::getenv("CLIBD_MON");
+  if (monomer_dir == nullptr || *monomer_dir == '\0') {
+    fprintf(stderr, "Set $CLIBD_MON or use option --monomers.\n");
     return 1;
   }
-  return 0;
+  double cutoff = 2.0;
+  if (p.options[Cutoff])
+    cutoff = std::strtod(p.options[Cutoff].arg, nullptr);
+  int n_threads = p.options[Jobs] ? std::atoi(p.options[Jobs].arg) : 0;
+  gemmi::CoorFormat format = coor_format_as_enum(p.options[FormatIn]);
+  bool verbose = p.options[Verbose];
+  // files are checked in parallel; a failure of one file is reported
+  // and the remaining files are still checked
+  bool ok = true;
+  gemmi::JobScheduler scheduler(n_threads);
+  scheduler.run_n(paths.size(), [&](size_t i, int) {
+    std::string input = gemmi::expand_if_pdb_code(paths[i]);
+    return check_file(input, format, monomer_dir, cutoff, verbose);
+  }, [&](size_t i, gemmi::JobResult<std::string>& result) {
+    if (paths.size() > 1)
+      printf("%sFile: %s\n", i == 0 ? "" : "\n", paths[i].c_str());
+    std::fflush(stdout);
+    if (!result.ok()) {
+      fprintf(stderr, "ERROR: %s\n", result.error.c_str());
+      ok = false;
+      return;
+    }
+    std::fputs(result.value.c_str(), stdout);
+  });
+  return ok ? 0 : 1;
 }
 
 // vim:sw=2:ts=2:et:path^=../include,../third_party
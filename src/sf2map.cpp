@@ -4,6 +4,7 @@
 
 #include <stdio.h>
 #include <gemmi/ccp4.hpp>     // for Ccp4
+#include <gemmi/parallel.hpp> // for parallel_for
 //#include <gemmi/util.hpp>     // for fail, giends_with
 //#include <gemmi/version.hpp>  // for GEMMI_VERSION
 #include "mapcoef.h"
@@ -50,11 +51,15 @@ static void transform_sf_to_map(OptParser& p) {
                                      p.options[Verbose] ? stderr : nullptr);
   if (p.options[Verbose])
     fprintf(stderr, "Writing %s ...\n", map_path);
-  ccp4.update_ccp4_header(2, true);
+  std::vector<float>& data = ccp4.grid.data;
+  ccp4.hstats = gemmi::calculate_grid_statistics(data, 0);
+  ccp4.update_ccp4_header(2);
   if (p.options[Normalize]) {
+    double mean = ccp4.hstats.dmean;
     double mult = 1.0 / ccp4.hstats.rms;
-    for (float& x : ccp4.grid.data)
-      x = float((x - ccp4.hstats.dmean) * mult);
+    gemmi::parallel_for(data.size(), 0, [&](size_t i) {
+      data[i] = float((data[i] - mean) * mult);
+    }, 1 << 16);
   }
   ccp4.write_ccp4_map(map_path);
 }
@@ -4,14 +4,19 @@
 #include "gemmi/gz.hpp"
 #include "gemmi/cifdoc.hpp"
 #include "gemmi/numb.hpp"
+#include "gemmi/memuse.hpp"  // for memory_usage
 #include "gemmi/tostr.hpp"
+#include "gemmi/parallel.hpp"  // for parallel_for
+#include "gemmi/jobs.hpp"      // for JobScheduler
 #include <cstdio>
 #include <cmath>      // for INFINITY
 #include <algorithm>  // for find
 #include <iostream>
+#include <sstream>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>    // for pair
 #include <vector>
 
@@ -27,20 +32,23 @@ namespace cif = gemmi::cif;
 // defined in validate_mon.cpp
 void check_monomer_doc(const cif::Document& doc);
 
-enum OptionIndex { Fast=3, Stat, Verbose, Quiet, Ddl, Monomer };
+enum OptionIndex { Fast=3, Stat, Verbose, Quiet, Ddl, Monomer, Jobs };
 const option::Descriptor Usage[] = {
   { NoOp, 0, "", "", Arg::None, "Usage: " EXE_NAME " [options] FILE [...]"
                                 "\n\nOptions:" },
   CommonUsage[Help],
   CommonUsage[Version],
   { Fast, 0, "f", "fast", Arg::None, "  -f, --fast  \tSyntax-only check." },
-  { Stat, 0, "s", "stat", Arg::None, "  -s, --stat  \tShow token statistics" },
+  { Stat, 0, "s", "stat", Arg::None,
+    "  -s, --stat  \tShow token statistics and estimated memory usage." },
   { Verbose, 0, "v", "verbose", Arg::None, "  --verbose  \tVerbose output." },
   { Quiet, 0, "q", "quiet", Arg::None, "  -q, --quiet  \tShow only errors." },
   { Ddl, 0, "d", "ddl", Arg::Required,
                                    "  -d, --ddl=PATH  \tDDL for validation." },
   { Monomer, 0, "m", "monomer", Arg::None,
     "  -m, --monomer  \tExtra checks for Refmac dictionary files." },
+  { Jobs, 0, "j", "jobs", Arg::Int,
+    "  -j, --jobs=N  \tUse N threads (default: all CPUs)." },
   { 0, 0, 0, 0, 0, 0 }
 };
 
@@ -134,6 +142,7 @@ static std::string token_stats(const cif::Document& d) {
                          ':', looptags_by_type[i]);
   info += "\n";
   info += "        " + format_7zd(nloopvals) + " values\n";
+  info += format_7zd(gemmi::memory_usage(d) / 1024) + " KiB in memory\n";
   return info;
 }
 
@@ -152,36 +161,159 @@ void check_empty_loops(const cif::Block& block) {
 }
 
 
+enum class Trinary : char { Unset, Yes, No };
+enum class ValType : char { Unset, Numb, Any };
+
+// Rules for one tag, compiled from a DDL1 block or DDL2 save frame.
+class TypeCheck {
+public:
+  void from_ddl1_block(cif::Block& b) {
+    if (const std::string* list = b.find_value("_list")) {
+      if (*list == "yes")
+        is_list_ = Trinary::Yes;
+      else if (*list == "no")
+        is_list_ = Trinary::No;
+    }
+    const std::string* type = b.find_value("_type");
+    if (type)
+      type_ = (*type == "numb" ? ValType::Numb : ValType::Any);
+    // Hypotetically _type_conditions could be a list, but it never is.
+    const std::string* conditions = b.find_value("_type_conditions");
+    if (conditions)
+      has_su_ = (*conditions == "esd" || *conditions == "su");
+    const std::string* range = b.find_value("_enumeration_range");
+    if (range) {
+      size_t colon_pos = range->find(':');
+      if (colon_pos != std::string::npos) {
+        std::string low = range->substr(0, colon_pos);
+        std::string high = range->substr(colon_pos+1);
+        range_inclusive_ = true;
+        range_.emplace_back(low.empty() ? -INFINITY : cif::as_number(low),
+                            high.empty() ? INFINITY : cif::as_number(high));
+      }
+    }
+    for (const std::string& e : b.find_loop("_enumeration"))
+      add_enumeration_value(e);
+    // type_construct regex - it is rarely used, ignore for now
+    // type_conditions seq - seems to be never used, ignore it
+    // For now we don't check at all relational attributes, i.e.
+    // _category, _list_* and _related_*
+  }
+
+  void from_ddl2_block(cif::Block& b) {
+    if (const std::string* code = b.find_value("_item_type.code")) {
+      std::string type_code = cif::as_string(*code);
+      if (type_code == "float" || type_code == "int")
+        type_ = ValType::Numb;
+    }
+    for (auto row : b.find("_item_range.", {"minimum", "maximum"}))
+      range_.emplace_back(cif::as_number(row[0], -INFINITY),
+                          cif::as_number(row[1], +INFINITY));
+    for (const std::string& e : b.find_loop("_item_enumeration.value"))
+      add_enumeration_value(e);
+  }
+
+  Trinary is_list() const { return is_list_; }
+
+  bool validate_value(const std::string& value, std::string* msg) const {
+    if (cif::is_null(value))
+      return true;
+    if (type_ == ValType::Numb && !cif::is_numb(value)) {
+      if (msg)
+        *msg = "expected number, got: " + value;
+      return false;
+    }
+    // ignoring has_su_ - not sure if we should check it
+    if (!range_.empty() && !validate_range(value, msg))
+      return false;
+    if (!enumeration_.empty() && !validate_enumeration(value, msg))
+      return false;
+    return true;
+  }
+
+private:
+  ValType type_ = ValType::Unset;
+  Trinary is_list_ = Trinary::Unset;  // DDL1 _list yes
+  bool has_su_ = false; // _type_conditions esd|su
+  bool range_inclusive_ = false;
+  std::vector<std::pair<double, double>> range_;
+  // the vector keeps the order (for messages), the set is for lookup
+  std::vector<std::string> enumeration_;
+  std::unordered_set<std::string> enumeration_set_;
+
+  void add_enumeration_value(const std::string& e) {
+    std::string value = cif::as_string(e);
+    if (enumeration_set_.insert(value).second)
+      enumeration_.push_back(value);
+  }
+
+  bool validate_range(const std::string& value, std::string *msg) const {
+    const double x = cif::as_number(value);
+    for (const auto& r : range_)
+      if (r.first == r.second ? x == r.first
+                              : r.first < x && x < r.second)
+        return true;
+    if (msg)
+      *msg = "value out of expected range: " + value;
+    return false;
+  }
+
+  bool validate_enumeration(const std::string& val, std::string *msg) const {
+    // as_string() is needed only for quoted values
+    if (enumeration_set_.count(val) != 0 ||
+        enumeration_set_.count(cif::as_string(val)) != 0)
+      return true;
+    // TODO: case-insensitive search when appropriate
+    if (msg) {
+      *msg = "'" + val + "' is not one of:";
+      for (const std::string& e : enumeration_)
+        *msg += " " + e + ",";
+      (*msg)[msg->size() - 1] = '.';
+    }
+    return false;
+  }
+};
+
+
 // Class DDL that represents DDL1 or DDL2 dictionary (ontology).
+// Rules for all tags are compiled when the dictionary is read, and the
+// dictionary document itself is not kept. After reading, the object
+// is not modified, so it can be used from multiple threads.
 class DDL {
 public:
   void open_file(const std::string& filename) {
-    ddl_ = cif::read_file(filename);
-    if (ddl_.blocks.size() > 1) {
-      version_ = 1;
+    cif::Document ddl = cif::read_file(filename);
+    if (ddl.blocks.size() > 1) {
       sep_ = "_";
-      read_ddl1();
+      read_ddl1(ddl);
     } else {
-      version_ = 2;
       sep_ = ".";
-      read_ddl2();
+      read_ddl2(ddl);
     }
   }
   // does the dictionary name/version correspond to _audit_conform_dict_*
   bool check_audit_conform(const cif::Document& doc, std::string* msg) const;
-  template <class Output>
-  bool validate(cif::Document& doc, Output& out, bool quiet);
+  // validates one block, writing errors to out
+  bool validate_block(const cif::Document& doc, const cif::Block& b,
+                      std::ostream& out, bool quiet) const;
 
 private:
-  cif::Block* find_rules(const std::string& name) {
-    auto iter = name_index_.find(name);
-    return iter != name_index_.end() ? iter->second : nullptr;
+  const TypeCheck* find_rules(const std::string& name) const {
+    auto iter = tag_index_.find(name);
+    return iter != tag_index_.end() ? &rules_[iter->second] : nullptr;
   }
 
-  void read_ddl1() {
-    for (cif::Block& b : ddl_.blocks) {
-      for (std::string& name : b.find_values("_name"))
-        name_index_.emplace(cif::as_string(name), &b);
+  void read_ddl1(cif::Document& ddl) {
+    for (cif::Block& b : ddl.blocks) {
+      int n = -1;
+      for (std::string& name : b.find_values("_name")) {
+        if (n == -1) {
+          n = (int) rules_.size();
+          rules_.emplace_back();
+          rules_.back().from_ddl1_block(b);
+        }
+        tag_index_.emplace(cif::as_string(name), n);
+      }
       if (b.name == "on_this_dictionary") {
         const std::string* dic_name = b.find_value("_dictionary_name");
         if (dic_name)
@@ -193,12 +325,19 @@ private:
     }
   }
 
-  void read_ddl2() {
-    for (cif::Block& block : ddl_.blocks) // a single block is expected
+  void read_ddl2(cif::Document& ddl) {
+    for (cif::Block& block : ddl.blocks) // a single block is expected
       for (cif::Item& item : block.items) {
         if (item.type == cif::ItemType::Frame) {
-          for (const std::string& name : item.frame.find_values("_item.name"))
-            name_index_.emplace(cif::as_string(name), &item.frame);
+          int n = -1;
+          for (const std::string& name : item.frame.find_values("_item.name")) {
+            if (n == -1) {
+              n = (int) rules_.size();
+              rules_.emplace_back();
+              rules_.back().from_ddl2_block(item.frame);
+            }
+            tag_index_.emplace(cif::as_string(name), n);
+          }
         } else if (item.type == cif::ItemType::Pair) {
           if (item.pair[0] == "_dictionary.title")
             dict_name_ = item.pair[1];
@@ -208,12 +347,8 @@ private:
       }
   }
 
-  template <class Output, class TypeCheckDDL>
-  bool do_validate(cif::Document& doc, Output& out, bool quiet);
-
-  int version_;
-  cif::Document ddl_;
-  std::unordered_map<std::string, cif::Block*> name_index_;
+  std::vector<TypeCheck> rules_;
+  std::unordered_map<std::string, int> tag_index_;
   std::string dict_name_;
   std::string dict_version_;
   // "_" or ".", used to unify handling of DDL1 and DDL2, for example when
@@ -251,181 +386,62 @@ bool DDL::check_audit_conform(const cif::Document& doc,
   return true;
 }
 
-enum class Trinary : char { Unset, Yes, No };
-enum class ValType : char { Unset, Numb, Any };
-
-class TypeCheckCommon {
-protected:
-  ValType type_ = ValType::Unset;
-  bool has_su_ = false; // _type_conditions esd|su
-  bool range_inclusive_ = false;
-  std::vector<std::pair<double, double>> range_;
-  std::vector<std::string> enumeration_;
-
-public:
-  bool validate_value(const std::string& value, std::string* msg) const {
-    if (cif::is_null(value))
-      return true;
-    if (type_ == ValType::Numb && !cif::is_numb(value)) {
-      if (msg)
-        *msg = "expected number, got: " + value;
-      return false;
-    }
-    // ignoring has_su_ - not sure if we should check it
-    if (!range_.empty() && !validate_range(value, msg))
-      return false;
-    if (!enumeration_.empty() && !validate_enumeration(value, msg))
-      return false;
-    return true;
-  }
-
-private:
-  bool validate_range(const std::string& value, std::string *msg) const {
-    const double x = cif::as_number(value);
-    for (const auto& r : range_)
-      if (r.first == r.second ? x == r.first
-                              : r.first < x && x < r.second)
-        return true;
-    if (msg)
-      *msg = "value out of expected range: " + value;
-    return false;
-  }
-
-  bool validate_enumeration(const std::string& val, std::string *msg) const {
-    if (std::find(enumeration_.begin(), enumeration_.end(), cif::as_string(val))
-          != enumeration_.end())
-      return true;
-    // TODO: case-insensitive search when appropriate
-    if (msg) {
-      *msg = "'" + val + "' is not one of:";
-      for (const std::string& e : enumeration_)
-        *msg += " " + e + ",";
-      (*msg)[msg->size() - 1] = '.';
-    }
-    return false;
-  }
-};
-
-class TypeCheckDDL1 : public TypeCheckCommon {
-public:
-  void from_block(cif::Block& b) {
-    if (const std::string* list = b.find_value("_list")) {
-      if (*list == "yes")
-        is_list_ = Trinary::Yes;
-      else if (*list == "no")
-        is_list_ = Trinary::No;
-    }
-    const std::string* type = b.find_value("_type");
-    if (type)
-      type_ = (*type == "numb" ? ValType::Numb : ValType::Any);
-    // Hypotetically _type_conditions could be a list, but it never is.
-    const std::string* conditions = b.find_value("_type_conditions");
-    if (conditions)
-      has_su_ = (*conditions == "esd" || *conditions == "su");
-    const std::string* range = b.find_value("_enumeration_range");
-    if (range) {
-      size_t colon_pos = range->find(':');
-      if (colon_pos != std::string::npos) {
-        std::string low = range->substr(0, colon_pos);
-        std::string high = range->substr(colon_pos+1);
-        range_inclusive_ = true;
-        range_.emplace_back(low.empty() ? -INFINITY : cif::as_number(low),
-                            high.empty() ? INFINITY : cif::as_number(high));
-      }
-    }
-    for (const std::string& e : b.find_loop("_enumeration"))
-      enumeration_.emplace_back(cif::as_string(e));
-  }
-
-  Trinary is_list() const { return is_list_; }
-
-private:
-  Trinary is_list_ = Trinary::Unset; // _list yes
-  // type_construct regex - it is rarely used, ignore for now
-  // type_conditions seq - seems to be never used, ignore it
-  // For now we don't check at all relational attributes, i.e.
-  // _category, _list_* and _related_*
-};
-
-
-class TypeCheckDDL2 : public TypeCheckCommon {
-public:
-  void from_block(cif::Block& b) {
-    if (const std::string* code = b.find_value("_item_type.code")) {
-      type_code_ = cif::as_string(*code);
-      if (type_code_ == "float" || type_code_ == "int")
-        type_ = ValType::Numb;
-    }
-    for (auto row : b.find("_item_range.", {"minimum", "maximum"}))
-      range_.emplace_back(cif::as_number(row[0], -INFINITY),
-                          cif::as_number(row[1], +INFINITY));
-    for (const std::string& e : b.find_loop("_item_enumeration.value"))
-      enumeration_.emplace_back(cif::as_string(e));
-  }
-
-  Trinary is_list() const { return Trinary::Unset; }
-
-private:
-  std::string type_code_;
-};
-
-template <class Output>
-bool DDL::validate(cif::Document& doc, Output& out, bool quiet) {
-  return version_ == 1 ? do_validate<Output, TypeCheckDDL1>(doc, out, quiet)
-                       : do_validate<Output, TypeCheckDDL2>(doc, out, quiet);
-}
-
-template <class Output, class TypeCheckDDL>
-bool DDL::do_validate(cif::Document& doc, Output& out, bool quiet) {
+bool DDL::validate_block(const cif::Document& doc, const cif::Block& b,
+                         std::ostream& out, bool quiet) const {
   std::string msg;
   bool ok = true;
-  auto err = [&](const cif::Block& b, const cif::Item& item,
-                 const std::string& s) {
+  auto err = [&](const cif::Item& item, const std::string& s) {
     ok = false;
     out << doc.source << ":" << item.line_number
         << " in data_" << b.name << ": " << s << "\n";
   };
-  for (cif::Block& b : doc.blocks) {
-    for (const cif::Item& item : b.items) {
-      if (item.type == cif::ItemType::Pair) {
-        cif::Block* dict_block = find_rules(item.pair[0]);
-        if (!dict_block) {
+  for (const cif::Item& item : b.items) {
+    if (item.type == cif::ItemType::Pair) {
+      const TypeCheck* tc = find_rules(item.pair[0]);
+      if (!tc) {
+        if (!quiet)
+          out << "Note: unknown tag: " << item.pair[0] << "\n";
+        continue;
+      }
+      if (tc->is_list() == Trinary::Yes)
+        err(item, item.pair[0] + " must be a list");
+      if (!tc->validate_value(item.pair[1], &msg))
+        err(item, msg);
+    } else if (item.type == cif::ItemType::Loop) {
+      const size_t ncol = item.loop.tags.size();
+      for (size_t i = 0; i != ncol; i++) {
+        const std::string& tag = item.loop.tags[i];
+        const TypeCheck* tc = find_rules(tag);
+        if (!tc) {
           if (!quiet)
-            out << "Note: unknown tag: " << item.pair[0] << "\n";
+            out << "Note: unknown tag: " << tag << "\n";
           continue;
         }
-        TypeCheckDDL tc;
-        tc.from_block(*dict_block);
-        if (tc.is_list() == Trinary::Yes)
-          err(b, item, item.pair[0] + " must be a list");
-        if (!tc.validate_value(item.pair[1], &msg))
-          err(b, item, msg);
-      } else if (item.type == cif::ItemType::Loop) {
-        const size_t ncol = item.loop.tags.size();
-        for (size_t i = 0; i != ncol; i++) {
-          const std::string& tag = item.loop.tags[i];
-          cif::Block* dict_block = find_rules(tag);
-          if (!dict_block) {
-            if (!quiet)
-              out << "Note: unknown tag: " << tag << "\n";
-            continue;
+        if (tc->is_list() == Trinary::No)
+          err(item, tag + " in list");
+        for (size_t j = i; j < item.loop.values.size(); j += ncol)
+          if (!tc->validate_value(item.loop.values[j], &msg)) {
+            err(item, tag + ": " + msg);
+            break; // stop after first error to avoid clutter
           }
-          TypeCheckDDL tc;
-          tc.from_block(*dict_block);
-          if (tc.is_list() == Trinary::No)
-            err(b, item, tag + " in list");
-          for (size_t j = i; j < item.loop.values.size(); j += ncol)
-            if (!tc.validate_value(item.loop.values[j], &msg)) {
-              err(b, item, tag + ": " + msg);
-              break; // stop after first error to avoid clutter
-            }
-        }
       }
     }
   }
   return ok;
 }
 
+// Validates blocks in parallel; the output is written in the block order.
+static bool validate_with_ddl(const DDL& dict, const cif::Document& doc,
+                              std::ostream& out, bool quiet, int n_threads) {
+  std::vector<std::ostringstream> outputs(doc.blocks.size());
+  std::vector<char> oks(doc.blocks.size(), 0);
+  gemmi::parallel_for(doc.blocks.size(), n_threads, [&](size_t i) {
+    oks[i] = dict.validate_block(doc, doc.blocks[i], outputs[i], quiet);
+  });
+  for (std::ostringstream& os : outputs)
+    out << os.str();
+  return std::find(oks.begin(), oks.end(), 0) == oks.end();
+}
 
 
 int GEMMI_MAIN(int argc, char **argv) {
@@ -438,9 +454,29 @@ int GEMMI_MAIN(int argc, char **argv) {
   p.require_input_files_as_args();
 
   bool quiet = p.options[Quiet];
-  bool total_ok = true;
-  for (int i = 0; i < p.nonOptionsCount(); ++i) {
-    const char* path = p.nonOption(i);
+  int n_threads = p.options[Jobs] ? std::atoi(p.options[Jobs].arg) : 0;
+  DDL dict;
+  try {
+    for (option::Option* ddl = p.options[Ddl]; ddl; ddl = ddl->next())
+      dict.open_file(ddl->arg);
+  } catch (std::runtime_error& e) {
+    fprintf(stderr, "ERROR: %s\n", e.what());
+    return 1;
+  }
+
+  // Files are validated in parallel, unless there is only one file
+  // (then blocks are validated in parallel) or --monomer is used
+  // (monomer checks print directly to stdout).
+  size_t n_files = p.nonOptionsCount();
+  bool parallel_files = n_files > 1 && !p.options[Monomer];
+  int block_threads = parallel_files ? 1 : n_threads;
+  struct FileOutput {
+    std::string text;
+    bool ok = true;
+  };
+  auto validate_file = [&](size_t i, int) {
+    const char* path = p.nonOption((int) i);
+    std::ostringstream out;
     std::string msg;
     bool ok = true;
     try {
@@ -453,29 +489,43 @@ int GEMMI_MAIN(int argc, char **argv) {
         if (p.options[Stat])
           msg = token_stats(d);
         if (p.options[Ddl]) {
-          DDL dict;
-          for (option::Option* ddl = p.options[Ddl]; ddl; ddl = ddl->next())
-            dict.open_file(ddl->arg);
           std::string ver_msg;
           dict.check_audit_conform(d, &ver_msg);
           if (!ver_msg.empty() && !quiet)
-            std::cout << "Note: " << ver_msg << std::endl;
-          ok = dict.validate(d, std::cout, quiet);
+            out << "Note: " << ver_msg << '\n';
+          ok = validate_with_ddl(dict, d, out, quiet, block_threads);
         }
-        if (p.options[Monomer])
+        if (p.options[Monomer]) {
+          std::cout << out.str() << std::flush;
+          out.str("");
           check_monomer_doc(d);
+          std::fflush(stdout);
+        }
       }
     } catch (std::runtime_error& e) {
       ok = false;
       msg = e.what();
     }
     if (!msg.empty())
-      std::cout << msg << std::endl;
+      out << msg << '\n';
 
     if (p.options[Verbose])
-      std::cout << (ok ? "OK" : "FAILED") << std::endl;
-    total_ok = total_ok && ok;
-  }
+      out << (ok ? "OK" : "FAILED") << '\n';
+    FileOutput result;
+    result.text = out.str();
+    result.ok = ok;
+    return result;
+  };
+  // output is printed in the order of files
+  bool total_ok = true;
+  gemmi::JobScheduler scheduler(parallel_files ? n_threads : 1);
+  scheduler.run_n(n_files, validate_file,
+                  [&](size_t, gemmi::JobResult<FileOutput>& result) {
+    if (!result.ok())
+      result.value.text = result.error + '\n';
+    std::cout << result.value.text << std::flush;
+    total_ok = total_ok && result.ok() && result.value.ok;
+  });
   return total_ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
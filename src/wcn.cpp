@@ -5,21 +5,24 @@
 #include <gemmi/subcells.hpp>
 #include <gemmi/elem.hpp>  // for is_hydrogen
 #include <gemmi/math.hpp>  // for Correlation
-#include <gemmi/resinfo.hpp>  // for find_tabulated_residue
+#include <gemmi/resinfo.hpp>  // for ResidueInfoCache
 #include <gemmi/polyheur.hpp> // for assign_subchains
 #include <gemmi/gzread.hpp>
 #include <gemmi/fileutil.hpp> // for expand_if_pdb_code
+#include <gemmi/parallel.hpp> // for parallel_for
+#include <gemmi/jobs.hpp>     // for JobScheduler
 #define GEMMI_PROG wcn
 #include "options.h"
 #include <stdio.h>
 #include <cstdlib>  // for strtod
 #include <algorithm>  // for sort
+#include <cmath>  // for isnan, NAN
 
 using namespace gemmi;
 
 enum OptionIndex { Verbose=3, FromFile, ListResidues, MinDist, MaxDist,
                    Exponent, Blur, Rom, ChainName, Sanity, SideChains,
-                   NoCrystal, OmitEnds, PrintRes, XyOut };
+                   NoCrystal, OmitEnds, PrintRes, XyOut, Jobs };
 
 struct WcnArg {
   static option::ArgStatus SideChains(const option::Option& option, bool msg) {
@@ -61,6 +64,8 @@ static const option::Descriptor Usage[] = {
     "  --print-res  \tPrint also resolution and R-free." },
   { XyOut, 0, "", "xy-out", Arg::Required,
     "  --xy-out=DIR  \tWrite DIR/name.xy files with WCN and B(exper)." },
+  { Jobs, 0, "j", "jobs", Arg::Int,
+    "  -j, --jobs=N  \tUse N threads (default: all CPUs)." },
   { 0, 0, 0, 0, 0, 0 }
 };
 
@@ -159,18 +164,20 @@ static bool is_protein_backbone(const std::string& name) {
   }
 }
 
-static Result test_bfactor_models(Structure& st, const Params& params) {
+static Result test_bfactor_models(Structure& st, const Params& params,
+                                  int n_threads) {
   Model& model = st.models.at(0);
 
   // prepare cell lists for neighbour search
   SubCells sc;
   if (!params.rotation_only || params.blur != 0) {
     sc.initialize(model, st.cell, params.max_dist);
+    ResidueInfoCache resinfo_cache;
     for (int n_ch = 0; n_ch != (int) model.chains.size(); ++n_ch) {
       const Chain& chain = model.chains[n_ch];
       for (int n_res = 0; n_res != (int) chain.residues.size(); ++n_res) {
         const Residue& res = chain.residues[n_res];
-        if (find_tabulated_residue(res.name).is_buffer_or_water())
+        if (resinfo_cache.get(res.name).is_buffer_or_water())
           continue;
         for (int n_atom = 0; n_atom != (int) res.atoms.size(); ++n_atom) {
           const Atom& atom = res.atoms[n_atom];
@@ -181,10 +188,14 @@ static Result test_bfactor_models(Structure& st, const Params& params) {
     }
   }
 
-  // calculate B-factor predictor
-  std::vector<double> b_exper;
-  std::vector<double> b_predict;
-  std::vector<const Atom*> atom_ptr;
+  // select atoms for which B-factor predictor is calculated
+  struct Candidate {
+    Atom* atom;
+    const Chain* chain;
+    const Residue* res;
+    double r2;
+  };
+  std::vector<Candidate> candidates;
   int n_residues = 0;
   for (Chain& chain : model.chains) {
     if (!params.chain_name.empty() && chain.name != params.chain_name)
@@ -202,56 +213,72 @@ static Result test_bfactor_models(Structure& st, const Params& params) {
         if ((params.sidechains == 'e' && !is_protein_backbone(atom.name)) ||
             (params.sidechains == 'o' && is_protein_backbone(atom.name)))
           continue;
-        double r2 = atom.pos.dist_sq(com);
-        double value;
-        if (params.rotation_only) {
-          if (params.exponent == 2)
-            value = r2;
-          else
-            value = std::pow(r2, 0.5 * params.exponent);
-        } else {
-          double wcn = 0;
-          sc.for_each(atom.pos, atom.altloc, params.max_dist,
-                      [&](const SubCells::Mark& m, float dist_sq) {
-              if (dist_sq > sq(params.min_dist)) {
-                CRA cra = m.to_cra(model);
-                float weight = calculate_weight(dist_sq, params);
-                // if an atom is one of multiple conformations we iterate here
-                // only over other atoms of the same conformation (and atoms
-                // with no altloc) so we don't weight by occupancy.
-                if (atom.altloc == '\0')
-                  weight *= cra.atom->occ;
-                wcn += weight;
-              }
-          });
-          if (wcn == 0.0) {
-            fprintf(stderr, "Warning: lonely atom %s %s %s\n",
-                    chain.name.c_str(), res->str().c_str(), atom.name.c_str());
-            continue;
-          }
-          value = 1 / wcn;
-        }
-        b_exper.push_back(atom.b_iso);
-        b_predict.push_back(value);
-        // re-purposing u11, u22 and name
-        atom.flag = 1;
-        atom.u11 = (float) value;
-        atom.u22 = (float) r2;
-        std::string names = chain.name;
-        names += '\t';
-        names += res->seqid.str();
-        names += '\t';
-        names += atom.name;
-        atom.name = std::move(names);
-        atom_ptr.push_back(&atom);
+        candidates.push_back({&atom, &chain, &*res, atom.pos.dist_sq(com)});
       }
     }
   }
 
+  // calculate B-factor predictor; each atom is independent, so the atoms
+  // are split between threads and the results are stored by index
+  std::vector<double> values(candidates.size(), NAN);
+  parallel_for(candidates.size(), n_threads, [&](size_t i) {
+    const Atom& atom = *candidates[i].atom;
+    double r2 = candidates[i].r2;
+    if (params.rotation_only) {
+      if (params.exponent == 2)
+        values[i] = r2;
+      else
+        values[i] = std::pow(r2, 0.5 * params.exponent);
+      return;
+    }
+    double wcn = 0;
+    sc.for_each(atom.pos, atom.altloc, params.max_dist,
+                [&](const SubCells::Mark& m, float dist_sq) {
+        if (dist_sq > sq(params.min_dist)) {
+          const_CRA cra = m.to_cra(model);
+          float weight = calculate_weight(dist_sq, params);
+          // if an atom is one of multiple conformations we iterate here
+          // only over other atoms of the same conformation (and atoms
+          // with no altloc) so we don't weight by occupancy.
+          if (atom.altloc == '\0')
+            weight *= cra.atom->occ;
+          wcn += weight;
+        }
+    });
+    if (wcn != 0.0)  // otherwise it remains NaN
+      values[i] = 1 / wcn;
+  }, 64);
+
+  std::vector<double> b_exper;
+  std::vector<double> b_predict;
+  std::vector<const Atom*> atom_ptr;
+  for (size_t i = 0; i != candidates.size(); ++i) {
+    const Candidate& c = candidates[i];
+    Atom& atom = *c.atom;
+    if (std::isnan(values[i])) {
+      fprintf(stderr, "Warning: lonely atom %s %s %s\n",
+              c.chain->name.c_str(), c.res->str().c_str(), atom.name.c_str());
+      continue;
+    }
+    b_exper.push_back(atom.b_iso);
+    b_predict.push_back(values[i]);
+    // re-purposing u11, u22 and name
+    atom.flag = 1;
+    atom.u11 = (float) values[i];
+    atom.u22 = (float) c.r2;
+    std::string names = c.chain->name;
+    names += '\t';
+    names += c.res->seqid.str();
+    names += '\t';
+    names += atom.name;
+    atom.name = std::move(names);
+    atom_ptr.push_back(&atom);
+  }
+
   // smoothing - average weighted by Gaussian(dist)
   if (params.blur > 0.f) {
     float mult = -0.5f / (params.blur * params.blur);
-    for (size_t i = 0; i != atom_ptr.size(); ++i) {
+    parallel_for(atom_ptr.size(), n_threads, [&](size_t i) {
       const Atom& atom = *atom_ptr[i];
       double b_sum = 0;
       double weight_sum = 0;
@@ -267,7 +294,7 @@ static Result test_bfactor_models(Structure& st, const Params& params) {
           }
       });
       b_predict[i] = b_sum / weight_sum;
-    }
+    }, 64);
   }
 
   // optionally, write xy file
@@ -340,60 +367,103 @@ int GEMMI_MAIN(int argc, char **argv) {
     params.omit_ends = std::max(std::atoi(p.options[OmitEnds].arg), 0);
   if (p.options[XyOut])
     params.xy_out = p.options[XyOut].arg;
-  double sum_cc = 0;
-  double sum_rmad = 0;
-  double sum_rank_cc = 0;
   printf("PDB\tChain\t");
   if (p.options[PrintRes])
     printf("Res[A]\tRFree\t");
   printf("#res\tN\t<B>\tstd(B)\tCC\t1-RMAD\trankCC\n");
-  try {
-    for (std::string& path : paths) {
-      if (verbose > 0)
-        fprintf(stderr, "File: %s\n", path.c_str());
-      if (p.options[FromFile] && !p.options[ChainName]) {
-        size_t sep = path.find_first_of(" \t");
-        if (sep != std::string::npos) {
-          params.chain_name = gemmi::trim_str(path.substr(sep));
-          path.resize(sep);
-        }
-      }
-      Structure st = read_structure_gz(gemmi::expand_if_pdb_code(path));
-      st.merge_chain_parts();
-      if (p.options[NoCrystal])
-        st.cell = UnitCell();
-      if (p.options[Sanity]) {
-        if (!check_sanity(st.models.at(0))) {
-          fprintf(stderr, "Skipping %s\n", path.c_str());
-          continue;
-        }
+
+  int n_threads = 0;  // all CPUs
+  if (p.options[Jobs])
+    n_threads = std::atoi(p.options[Jobs].arg);
+  // with many files, each file is processed in a separate thread;
+  // a single file is processed by multiple threads
+  int threads_per_file = paths.size() > 1 ? 1 : n_threads;
+
+  struct FileResult {
+    bool done = false;
+    std::string line;
+    Result r;
+  };
+  JobScheduler scheduler(paths.size() > 1 ? n_threads : 1);
+  if (verbose > 0)
+    scheduler.set_progress(10., print_job_progress);
+  auto process_file = [&](size_t i, int) {
+    std::string path = paths[i];
+    Params file_params = params;
+    if (verbose > 0)
+      fprintf(stderr, "File: %s\n", path.c_str());
+    if (p.options[FromFile] && !p.options[ChainName]) {
+      size_t sep = path.find_first_of(" \t");
+      if (sep != std::string::npos) {
+        file_params.chain_name = gemmi::trim_str(path.substr(sep));
+        path.resize(sep);
       }
-      gemmi::assign_subchains(st, false);
-      Result r = test_bfactor_models(st, params);
-      printf("%s\t%s\t",
-             st.name.c_str(),
-             params.chain_name.empty() ? "*" : params.chain_name.c_str());
-      if (p.options[PrintRes]) {
-        double rfree = 0;
-        if (st.meta.refinement.size() > 0)
-          rfree = st.meta.refinement[0].r_free;
-        printf("%.2f\t%.2f\t", st.resolution, rfree);
+    }
+    FileResult fr;
+    Structure st = read_structure_gz(gemmi::expand_if_pdb_code(path));
+    st.merge_chain_parts();
+    if (p.options[NoCrystal])
+      st.cell = UnitCell();
+    if (p.options[Sanity]) {
+      if (!check_sanity(st.models.at(0))) {
+        fprintf(stderr, "Skipping %s\n", path.c_str());
+        return fr;
       }
-      printf("%d\t%d\t%.2f\t%.1f\t%.4f\t%.4f\t%.4f\n",
-             r.n_residues, r.n, r.b_mean, r.b_stddev,
-             r.cc, 1.0 - r.relative_mean_abs_dev, r.rank_cc);
-      sum_cc += r.cc;
-      sum_rmad += r.relative_mean_abs_dev;
-      sum_rank_cc += r.rank_cc;
     }
-    int N = paths.size();
-    if (N > 1)
-      fprintf(stderr,
-              "average of %4d files    CC=%#.4g  1-RMAD=%#.4g  rankCC=%#.4g\n",
-              N, sum_cc / N, 1.0 - sum_rmad / N, sum_rank_cc / N);
-  } catch (std::runtime_error& e) {
-    std::fprintf(stderr, "ERROR: %s\n", e.what());
+    gemmi::assign_subchains(st, false);
+    fr.r = test_bfactor_models(st, file_params, threads_per_file);
+    const std::string& chain_name = file_params.chain_name;
+    fr.line = st.name + "\t" + (chain_name.empty() ? "*" : chain_name) + "\t";
+    char buf[128];
+    if (p.options[PrintRes]) {
+      double rfree = 0;
+      if (st.meta.refinement.size() > 0)
+        rfree = st.meta.refinement[0].r_free;
+      snprintf(buf, sizeof(buf), "%.2f\t%.2f\t", st.resolution, rfree);
+      fr.line += buf;
+    }
+    snprintf(buf, sizeof(buf), "%d\t%d\t%.2f\t%.1f\t%.4f\t%.4f\t%.4f\n",
+             fr.r.n_residues, fr.r.n, fr.r.b_mean, fr.r.b_stddev,
+             fr.r.cc, 1.0 - fr.r.relative_mean_abs_dev, fr.r.rank_cc);
+    fr.line += buf;
+    fr.done = true;
+    return fr;
+  };
+
+  // results are printed in the order of input files
+  double sum_cc = 0;
+  double sum_rmad = 0;
+  double sum_rank_cc = 0;
+  int n_atoms = 0;
+  int N = 0;
+  bool failed = false;
+  JobStats stats = scheduler.run_n(paths.size(), process_file,
+                                   [&](size_t, JobResult<FileResult>& res) {
+    if (!res.ok()) {
+      std::fprintf(stderr, "ERROR: %s\n", res.error.c_str());
+      failed = true;
+      scheduler.cancel();
+      return;
+    }
+    const FileResult& fr = res.value;
+    if (!fr.done)
+      return;
+    std::fputs(fr.line.c_str(), stdout);
+    sum_cc += fr.r.cc;
+    sum_rmad += fr.r.relative_mean_abs_dev;
+    sum_rank_cc += fr.r.rank_cc;
+    n_atoms += fr.r.n;
+    ++N;
+  });
+  if (failed)
     return 1;
+  if (paths.size() > 1) {
+    fprintf(stderr,
+            "average of %4d files    CC=%#.4g  1-RMAD=%#.4g  rankCC=%#.4g\n",
+            N, sum_cc / N, 1.0 - sum_rmad / N, sum_rank_cc / N);
+    fprintf(stderr, "%d files, %d atoms in %.2fs (%.1f files/s, %.0f atoms/s)\n",
+            N, n_atoms, stats.seconds, N / stats.seconds,
+            n_atoms / stats.seconds);
   }
   return 0;
 }
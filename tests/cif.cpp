@@ -3,6 +3,8 @@
 
 #include <algorithm>
 #include <gemmi/cif.hpp>
+#include <gemmi/memuse.hpp>
+#include <gemmi/refln.hpp>
 namespace cif = gemmi::cif;
 
 template<typename T> void check_with_two_elements(T duo) {
@@ -86,3 +88,73 @@ TEST_CASE("cif::Block::init_loop") {
   CHECK_EQ(block.find_values("_p.u").item(), nullptr);
   CHECK_EQ(block.find_values("_p.v").at(0), "30");
 }
+
+TEST_CASE("memory_usage(cif::Document)") {
+  cif::Document doc = cif::read_string("data_1 _short 1");
+  size_t small = gemmi::memory_usage(doc);
+  CHECK(small > sizeof(doc));
+  std::string long_value(1000, 'x');
+  doc.blocks[0].set_pair("_long", long_value);
+  CHECK(gemmi::memory_usage(doc) >= small + long_value.size());
+}
+
+TEST_CASE("ReflnDecodedDataProxy") {
+  cif::Document doc = cif::read_string("data_r _cell.length_a 10"
+      " loop_ _refln.index_h _refln.index_k _refln.index_l"
+      " _refln.F_meas_au _refln.phase_calc"
+      " 1 0 0 2.5 30   0 -2 1 ? 60.5   3 1 -4 7 .");
+  gemmi::ReflnBlock rblock(std::move(doc.blocks[0]));
+  gemmi::ReflnDataProxy slow{rblock};
+  gemmi::ReflnDecodedDataProxy fast(rblock, std::vector<std::string>{
+                                              "phase_calc", "F_meas_au"}, 2);
+  CHECK_EQ(fast.nreflections(), 3);
+  CHECK_EQ(fast.stride(), 5);
+  for (size_t row = 0; row != 3; ++row) {
+    for (int j = 0; j != 3; ++j)
+      CHECK_EQ(fast.get_int(row * 5 + j), slow.get_int(row * 5 + j));
+    CHECK_EQ(fast.hkl(row)[2], slow.get_int(row * 5 + 2));
+  }
+  CHECK_EQ(fast.get_num(3), 30.f);
+  CHECK_EQ(fast.get_num(4), 2.5f);
+  CHECK_EQ(fast.value(1, 0), 60.5f);
+  CHECK(std::isnan(fast.value(1, 1)));
+  CHECK(std::isnan(fast.value(2, 0)));
+}
+
+TEST_CASE("ReflnDecodedDataProxy, _diffrn_refln") {
+  cif::Document doc = cif::read_string("data_u _cell.length_a 10"
+      " loop_ _diffrn_refln.index_h _diffrn_refln.index_k"
+      " _diffrn_refln.index_l _diffrn_refln.intensity_net"
+      " 1 2 3 4.5   -1 0 2 6");
+  gemmi::ReflnBlock rblock(std::move(doc.blocks[0]));
+  CHECK(rblock.is_unmerged());
+  CHECK_EQ(rblock.column_labels()[3], "intensity_net");
+  gemmi::ReflnDecodedDataProxy fast(rblock, std::vector<std::string>{
+                                              "intensity_net"}, 1);
+  CHECK_EQ(fast.nreflections(), 2);
+  CHECK_EQ(fast.hkl(1)[0], -1);
+  CHECK_EQ(fast.hkl(0)[2], 3);
+  CHECK_EQ(fast.value(0, 0), 4.5f);
+  CHECK_EQ(fast.value(1, 0), 6.f);
+}
+
+TEST_CASE("cif::parse_events") {
+  struct Counter : cif::EventHandler {
+    std::string names;
+    int pairs = 0, loop_tags = 0, loop_values = 0, loops = 0;
+    void start_block(const char* s, size_t n) { names.append(s, n) += ' '; }
+    void pair_value(const char*, size_t) { ++pairs; }
+    void loop_tag(const char*, size_t) { ++loop_tags; }
+    void loop_value(const char*, size_t) { ++loop_values; }
+    void end_loop() { ++loops; }
+  } counter;
+  std::string input = "data_a _x 1 _y 'q q' loop_ _l.a _l.b 1 2 3 4\n"
+                      "data_b loop_ _m.c\n;text\n;\n";
+  cif::pegtl::memory_input<> in(input, "string");
+  cif::parse_events(in, counter);
+  CHECK_EQ(counter.names, "a b ");
+  CHECK_EQ(counter.pairs, 2);
+  CHECK_EQ(counter.loop_tags, 3);
+  CHECK_EQ(counter.loop_values, 5);
+  CHECK_EQ(counter.loops, 2);
+}
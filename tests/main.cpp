@@ -2,11 +2,37 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "doctest.h"
 
+#include <algorithm>  // for sort
 #include <cstdlib>  // for rand
 #include <climits>  // for INT_MIN, INT_MAX
+#include <cmath>    // for pow, NAN, INFINITY
+#include <cstdint>  // for uint32_t
+#include <cstdio>   // for fopen, snprintf
+#include <cstring>  // for memcpy
 #include <gemmi/atox.hpp>
 #include <gemmi/math.hpp>
+#include <gemmi/blob.hpp>
+#include <gemmi/bondgraph.hpp>
+#include <gemmi/dirwalk.hpp>
+#include <gemmi/elem.hpp>
+#include <gemmi/floatfmt.hpp>
+#include <gemmi/fourier.hpp>
+#include <gemmi/gridstats.hpp>
+#include <gemmi/jobs.hpp>
+#include <gemmi/patterson.hpp>
+#include <gemmi/peaks.hpp>
+#include <gemmi/polyheur.hpp>
+#include <gemmi/resample.hpp>
+#include <gemmi/smcif.hpp>
+#include <gemmi/rscc.hpp>
+#include <gemmi/solmask.hpp>
+#include <gemmi/superpose.hpp>
+#include <stdexcept>
 #include <linalg.h>
+#ifndef _WIN32
+# include <sys/stat.h>  // for mkdir
+# include <unistd.h>    // for rmdir, symlink, unlink
+#endif
 
 static double draw() { return 10.0 * std::rand() / RAND_MAX - 5; }
 
@@ -53,6 +79,27 @@ TEST_CASE("Transform::combine") {
     CHECK_EQ(result1.at(i), doctest::Approx(result2.at(i)));
 }
 
+TEST_CASE("transform_soa") {
+  gemmi::Transform tr = random_transform();
+  std::vector<double> x, y, z;
+  for (int i = 0; i != 37; ++i) {
+    x.push_back(draw());
+    y.push_back(draw());
+    z.push_back(draw());
+  }
+  std::vector<double> ox(x.size()), oy(x.size()), oz(x.size());
+  gemmi::transform_soa(tr, x.data(), y.data(), z.data(),
+                       ox.data(), oy.data(), oz.data(), x.size());
+  // in place
+  gemmi::transform_soa(tr, x.data(), y.data(), z.data(),
+                       x.data(), y.data(), z.data(), x.size());
+  gemmi::wrap_to_unit_soa(ox.data(), oy.data(), oz.data(), ox.size());
+  for (size_t i = 0; i != x.size(); ++i) {
+    CHECK_EQ(gemmi::Fractional(x[i], y[i], z[i]).wrap_to_unit()
+             .approx(gemmi::Vec3(ox[i], oy[i], oz[i]), 0.), true);
+  }
+}
+
 TEST_CASE("Mat33::smallest_eigenvalue") {
   auto ev = gemmi::Mat33(3, 2, 4, 2, 0, 2, 4, 2, 3).calculate_eigenvalues();
   CHECK_EQ(ev[0], doctest::Approx(8));
@@ -120,3 +167,805 @@ TEST_CASE("string_to_int") {
   CHECK_EQ(gemmi::string_to_int(std::to_string(INT_MIN), true), INT_MIN);
   CHECK_EQ(gemmi::string_to_int("", false), 0);
 }
+
+TEST_CASE("label_connected_components") {
+  gemmi::Grid<float> grid;
+  grid.set_size(6, 4, 5);
+  grid.fill(0.f);
+  // two points joined through the periodic boundary along u
+  grid.set_value(0, 1, 1, 1.f);
+  grid.set_value(5, 1, 1, 1.f);
+  // and a separate region, crossing the boundary along w
+  grid.set_value(3, 3, 4, 1.f);
+  grid.set_value(3, 3, 0, 1.f);
+  grid.set_value(3, 3, 1, 1.f);
+  for (int n_threads : {1, 3}) {
+    int n = 0;
+    std::vector<int> labels = gemmi::label_connected_components(
+        grid, [](float x) { return x > 0.5f; }, n_threads, &n);
+    CHECK_EQ(n, 2);
+    CHECK_EQ(labels[grid.index_q(0, 0, 0)], -1);
+    CHECK_EQ(labels[grid.index_q(3, 3, 0)], 0);
+    CHECK_EQ(labels[grid.index_q(3, 3, 4)], 0);
+    CHECK_EQ(labels[grid.index_q(0, 1, 1)], 1);
+    CHECK_EQ(labels[grid.index_q(5, 1, 1)], 1);
+  }
+}
+
+TEST_CASE("find_peaks") {
+  gemmi::Grid<float> grid;
+  grid.set_unit_cell(20, 20, 24, 90, 90, 90);
+  grid.spacegroup = gemmi::find_spacegroup_by_name("P 1 2 1");
+  grid.set_size(40, 40, 48);
+  grid.unit_cell.set_cell_images_from_spacegroup(grid.spacegroup);
+  // Gaussian peaks (and a hole) placed between grid points
+  struct G { gemmi::Fractional f; double height; };
+  std::vector<G> gaussians = {{gemmi::Fractional(0.212, 0.33, 0.41), 3.0},
+                              {gemmi::Fractional(0.61, 0.707, 0.1), 2.0},
+                              {gemmi::Fractional(0.4, 0.1, 0.7), -2.5}};
+  grid.fill(0.f);
+  for (const G& g : gaussians)
+    for (const gemmi::Fractional& mate : {g.f, gemmi::Fractional(
+                                          -g.f.x, g.f.y, -g.f.z)}) {
+      gemmi::Position center = grid.unit_cell.orthogonalize(mate);
+      for (int w = 0; w != grid.nw; ++w)
+        for (int v = 0; v != grid.nv; ++v)
+          for (int u = 0; u != grid.nu; ++u) {
+            gemmi::Position p = grid.unit_cell.orthogonalize(
+                gemmi::Fractional(double(u) / grid.nu, double(v) / grid.nv,
+                                  double(w) / grid.nw));
+            double d2 = grid.unit_cell.distance_sq(p, center);
+            grid.data[grid.index_q(u, v, w)] += float(g.height *
+                                                      std::exp(-d2));
+          }
+    }
+  std::vector<gemmi::Peak> peaks = gemmi::find_peaks(grid, 1.0);
+  for (int n_threads : {1, 3}) {
+    std::vector<gemmi::Peak> peaks_n = gemmi::find_peaks(grid, 1.0, false,
+                                                         n_threads);
+    REQUIRE_EQ(peaks_n.size(), peaks.size());
+    for (size_t i = 0; i != peaks.size(); ++i)
+      CHECK_EQ(peaks_n[i].height, peaks[i].height);
+  }
+  // symmetry mates are not reported
+  REQUIRE_EQ(peaks.size(), 2);
+  for (int i = 0; i != 2; ++i) {
+    // the peak can be reported at either of two symmetry mates
+    gemmi::Fractional f = gaussians[i].f;
+    gemmi::Fractional mate(-f.x, f.y, -f.z);
+    gemmi::Fractional pf = grid.unit_cell.fractionalize(peaks[i].pos);
+    double dist_sq = std::min(grid.unit_cell.distance_sq(pf, f),
+                              grid.unit_cell.distance_sq(pf, mate));
+    CHECK_LT(std::sqrt(dist_sq), 0.05);
+    CHECK_EQ(peaks[i].height, doctest::Approx(gaussians[i].height)
+                              .epsilon(0.02));
+  }
+  std::vector<gemmi::Peak> holes = gemmi::find_peaks(grid, 1.0, true);
+  REQUIRE_EQ(holes.size(), 1);
+  CHECK_EQ(holes[0].height, doctest::Approx(-2.5).epsilon(0.02));
+
+  gemmi::Model model("1");
+  model.chains.emplace_back("A");
+  model.chains[0].residues.emplace_back();
+  gemmi::Atom atom;
+  atom.name = "O";
+  atom.element = gemmi::El::O;
+  // near the symmetry mate of the second peak
+  atom.pos = grid.unit_cell.orthogonalize(gemmi::Fractional(0.39, 0.707,
+                                                            0.9));
+  model.chains[0].residues[0].atoms.push_back(atom);
+  gemmi::SubCells sc(model, grid.unit_cell, 5.0);
+  sc.populate();
+  gemmi::assign_nearest_atoms(peaks, sc, 2);
+  CHECK(peaks[0].nearest == nullptr);
+  REQUIRE(peaks[1].nearest != nullptr);
+  CHECK_EQ(peaks[1].nearest->atom_idx, 0);
+  CHECK_LT(peaks[1].nearest_dist, 0.05);
+}
+
+TEST_CASE("JobScheduler") {
+  for (int n_threads : {1, 4}) {
+    gemmi::JobScheduler scheduler(n_threads, 3);
+    std::vector<size_t> order;
+    std::vector<int> values;
+    gemmi::JobStats stats = scheduler.run_n(50, [](size_t i, int) {
+      if (i % 7 == 3)
+        throw std::runtime_error("bad " + std::to_string(i));
+      if (i == 48)
+        throw 48;  // not derived from std::exception
+      return (int) i * 2;
+    }, [&](size_t i, gemmi::JobResult<int>& result) {
+      order.push_back(i);
+      if (result.ok())
+        values.push_back(result.value);
+      else if (i == 48)
+        CHECK_EQ(result.error, "unknown error");
+      else
+        CHECK_EQ(result.error, "bad " + std::to_string(i));
+    });
+    CHECK_EQ(stats.done, 50);
+    CHECK_EQ(stats.failed, 8);
+    REQUIRE_EQ(order.size(), 50);
+    for (size_t i = 0; i != order.size(); ++i)
+      CHECK_EQ(order[i], i);
+    CHECK_EQ(values.size(), 42);
+    CHECK_EQ(values[3], 8);
+  }
+}
+
+#ifndef _WIN32
+TEST_CASE("ParallelFileWalk") {
+  char top_buf[] = "/tmp/gemmi-walk-XXXXXX";
+  REQUIRE(mkdtemp(top_buf) != nullptr);
+  std::string top = top_buf;
+  std::vector<std::string> dirs = {"/d1", "/d1/e", "/d2", "/d3"};
+  std::vector<std::string> files = {"/a.cif", "/b.txt", "/d1/x.cif",
+                                    "/d1/z.pdb", "/d1/e/y.cif.gz",
+                                    "/d3/w.cif"};
+  for (const std::string& d : dirs)
+    REQUIRE(mkdir((top + d).c_str(), 0700) == 0);
+  for (const std::string& f : files) {
+    std::FILE* fp = std::fopen((top + f).c_str(), "w");
+    REQUIRE(fp != nullptr);
+    std::fclose(fp);
+  }
+  // a broken symlink is listed, but cannot be prefetched
+  REQUIRE(symlink((top + "/nonexistent").c_str(),
+                  (top + "/d3/broken.cif").c_str()) == 0);
+
+  std::vector<std::string> expected;
+  for (const char* path : gemmi::CifWalk(top))
+    expected.push_back(path);
+  CHECK_EQ(expected.size(), 5);
+  for (int n_threads : {1, 4})
+    for (int prefetch : {0, 3})
+      for (size_t max_ahead : {1, 100000}) {
+        std::vector<std::string> paths;
+        for (const std::string& path :
+             gemmi::ParallelCifWalk(top, n_threads, prefetch, max_ahead))
+          paths.push_back(path);
+        CHECK(paths == expected);
+      }
+  // breaking off the iteration early must not hang
+  for (const std::string& path : gemmi::ParallelCifWalk(top, 2, 2, 1)) {
+    CHECK_EQ(path, expected[0]);
+    break;
+  }
+  gemmi::FilePrefetcher::prefetch(top + "/nonexistent");
+  CHECK_THROWS_AS(gemmi::ParallelCifWalk(top + "/nonexistent"),
+                  std::runtime_error);
+
+  unlink((top + "/d3/broken.cif").c_str());
+  for (const std::string& f : files)
+    unlink((top + f).c_str());
+  for (auto d = dirs.rbegin(); d != dirs.rend(); ++d)
+    rmdir((top + *d).c_str());
+  rmdir(top.c_str());
+}
+#endif
+
+TEST_CASE("FloatFormat") {
+  const char* formats[] = {"g", "G", ".4f", "_.4f", "12.5e", "+8.3g",
+                           "-10.2f", ".1E", ".0f", ".0e", ".0g", ".15g",
+                           "99.2f", "#g", "08.3f"};
+  std::vector<float> values = {
+    0.f, -0.f, 1.f, -1.f, 0.5f, 1.5f, 2.5f, 0.125f, 0.0625f, 0.00001f,
+    0.0001f, 9.9999995f, 99.95f, 999999.5f, 1234567.f, 0.99999f, 9.5f,
+    1e-5f, 1e10f, 1e17f, 1e30f, -3.4e38f, 1e-30f, 1e-40f,
+    NAN, -NAN, INFINITY, -INFINITY};
+  std::srand(12345);
+  for (int i = 0; i != 2000; ++i) {
+    std::uint32_t bits = std::uint32_t(std::rand()) << 16 ^ std::rand();
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    values.push_back(f);
+    values.push_back(float(draw() * std::pow(10., std::rand() % 12 - 6)));
+  }
+  char buf[256];
+  char expected[256];
+  for (const char* fmt : formats) {
+    gemmi::FloatFormat ff;
+    ff.parse(fmt);
+    std::string printf_fmt = std::string("%") + fmt;
+    if (printf_fmt[1] == '_')
+      printf_fmt[1] = ' ';
+    for (float v : values) {
+      *ff.write(buf, v) = '\0';
+#if defined(__GNUC__)
+# pragma GCC diagnostic push
+# pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#endif
+      std::snprintf(expected, sizeof(expected), printf_fmt.c_str(), v);
+#if defined(__GNUC__)
+# pragma GCC diagnostic pop
+#endif
+      CHECK_EQ(std::string(buf), std::string(expected));
+    }
+  }
+}
+
+TEST_CASE("find_covalent_bonds") {
+  // SiC (COD 1011031): each atom has 4 neighbours of the other kind
+  gemmi::AtomicStructure st;
+  st.cell.set(4.358, 4.358, 4.358, 90, 90, 90);
+  st.cell.set_cell_images_from_spacegroup(
+      gemmi::find_spacegroup_by_name("F -4 3 m"));
+  st.sites.resize(2);
+  st.sites[0].label = "Si";
+  st.sites[0].type_symbol = "Si4+";
+  st.sites[1].label = "C1";
+  st.sites[1].fract = gemmi::Fractional(0.25, 0.25, 0.25);
+  for (int n_threads : {1, 2}) {
+    gemmi::BondGraph graph = gemmi::find_covalent_bonds(st, 0.4f, 1.0f,
+                                                        n_threads);
+    REQUIRE_EQ(graph.atom_count(), 2);
+    CHECK_EQ(graph.bond_count(), 4);
+    for (int n = 0; n != 2; ++n) {
+      CHECK_EQ(graph.degree(n), 4);
+      for (const gemmi::BondGraph::Bond* b = graph.begin_of(n);
+           b != graph.end_of(n); ++b) {
+        CHECK_EQ(b->atom, 1 - n);
+        CHECK_EQ(b->dist, doctest::Approx(4.358 * std::sqrt(3) / 4));
+      }
+    }
+  }
+}
+
+TEST_CASE("AtomicStructure::get_all_unit_cell_images") {
+  gemmi::AtomicStructure st;
+  st.cell.set(10.5, 10.5, 10.5, 90, 90, 90);
+  st.cell.set_cell_images_from_spacegroup(
+      gemmi::find_spacegroup_by_name("F d -3 m :1"));
+  using gemmi::Fractional;
+  std::vector<Fractional> positions = {
+    Fractional(0.125, 0.125, 0.125),  // special positions
+    Fractional(0, 0, 0),
+    Fractional(0.13, 0.125, 0.125),   // close to a special position
+    Fractional(1.125, -0.875, 0.125),
+  };
+  std::srand(12345);
+  for (int i = 0; i != 20; ++i)
+    positions.push_back(Fractional(draw(), draw(), draw()));
+  for (const Fractional& fract : positions) {
+    st.sites.emplace_back();
+    st.sites.back().fract = fract;
+  }
+  // a site without coordinates (? in CIF) is not binned, but kept
+  positions.push_back(Fractional(NAN, 0, 0));
+  st.sites.emplace_back();
+  st.sites.back().fract = positions.back();
+
+  // the per-site expansion used previously
+  std::vector<gemmi::AtomicStructure::SiteImage> expected;
+  for (int site_idx = 0; site_idx != (int) positions.size(); ++site_idx) {
+    size_t start = expected.size();
+    for (int image_idx = 0; image_idx <= (int) st.cell.images.size();
+         ++image_idx) {
+      const Fractional& orig = positions[site_idx];
+      Fractional fpos = orig;
+      if (image_idx != 0)
+        fpos = st.cell.images[image_idx-1].apply(orig);
+      if (std::none_of(expected.begin() + start, expected.end(),
+                       [&](const gemmi::AtomicStructure::SiteImage& other) {
+                         return st.cell.distance_sq(fpos, other.fract) < 0.25;
+                       }))
+        expected.push_back({site_idx, image_idx, fpos});
+    }
+  }
+  auto count_images = [&](int site_idx) {
+    return std::count_if(expected.begin(), expected.end(),
+                         [&](const gemmi::AtomicStructure::SiteImage& im) {
+                           return im.site_idx == site_idx;
+                         });
+  };
+  CHECK_EQ(count_images(0), 16);  // Wyckoff position 16c
+  CHECK_EQ(count_images(1), 8);   // 8a
+  CHECK_EQ(count_images(4), 192);
+  CHECK_EQ(count_images((int) positions.size() - 1), 192);
+  for (int n_threads : {1, 3}) {
+    std::vector<gemmi::AtomicStructure::SiteImage> images =
+      st.get_all_unit_cell_images(n_threads);
+    REQUIRE_EQ(images.size(), expected.size());
+    for (size_t i = 0; i != images.size(); ++i) {
+      CHECK_EQ(images[i].site_idx, expected[i].site_idx);
+      CHECK_EQ(images[i].image_idx, expected[i].image_idx);
+    }
+  }
+}
+
+TEST_CASE("find_element") {
+  using gemmi::El;
+  CHECK(gemmi::find_element("C") == El::C);
+  CHECK(gemmi::find_element(" C") == El::C);
+  CHECK(gemmi::find_element("c\n") == El::C);
+  CHECK(gemmi::find_element("FE") == El::Fe);
+  CHECK(gemmi::find_element("fe") == El::Fe);
+  CHECK(gemmi::find_element("Og") == El::Og);
+  CHECK(gemmi::find_element("D") == El::D);
+  CHECK(gemmi::find_element("Q") == El::X);
+  CHECK(gemmi::find_element("Cx") == El::X);
+  CHECK(gemmi::find_element("C1") == El::X);
+  CHECK(gemmi::find_element("") == El::X);
+  for (int i = 1; i != static_cast<int>(El::END); ++i) {
+    El el = static_cast<El>(i);
+    CHECK(gemmi::find_element(gemmi::element_uppercase_name(el)) == el);
+    CHECK(gemmi::find_element(gemmi::element_name(el)) == el);
+  }
+}
+
+TEST_CASE("ResidueInfoCache") {
+  gemmi::ResidueInfoCache cache;
+  const char* names[] = {"ALA", "HOH", "DA", "U", "ZN", "SO4", "XYZ", "",
+                         "ABCD", "HOH", "ALA", "U"};
+  for (int n = 0; n != 2; ++n)
+    for (const char* name : names) {
+      gemmi::ResidueInfo a = cache.get(name);
+      gemmi::ResidueInfo b = gemmi::find_tabulated_residue(name);
+      CHECK_EQ(a.kind, b.kind);
+      CHECK_EQ(a.one_letter_code, b.one_letter_code);
+      CHECK_EQ(a.hydrogen_count, b.hydrogen_count);
+    }
+  // more names than fit in the cache
+  for (int i = 0; i != 1000; ++i) {
+    std::string name = std::to_string(i);
+    CHECK_EQ(cache.get(name).kind, gemmi::find_tabulated_residue(name).kind);
+  }
+  CHECK(cache.get("GLY").is_amino_acid());
+}
+
+TEST_CASE("setup_entities") {
+  gemmi::Structure st;
+  st.models.emplace_back("1");
+  for (const char* chain_name : {"A", "B", "C"}) {
+    st.models[0].chains.emplace_back(chain_name);
+    gemmi::Chain& chain = st.models[0].chains.back();
+    for (int i = 1; i <= 13; ++i) {
+      gemmi::Residue res;
+      res.name = i < 13 ? "GLY" : "SO4";
+      res.seqid = gemmi::SeqId(i, ' ');
+      res.het_flag = i < 13 ? 'A' : 'H';
+      chain.residues.push_back(res);
+    }
+  }
+  gemmi::setup_entities(st);
+  const gemmi::Chain& chain_b = st.models[0].chains[1];
+  CHECK_EQ(chain_b.residues[0].subchain, "Bpoly");
+  CHECK_EQ(chain_b.residues[12].subchain, "B13");
+  CHECK(chain_b.residues[12].entity_type == gemmi::EntityType::NonPolymer);
+  REQUIRE_EQ(st.entities.size(), 4);
+  CHECK_EQ(st.entities[1].name, "SO4!");
+  CHECK_EQ(st.entities[1].subchains.size(), 3);
+  CHECK_EQ(st.entities[3].subchains.back(), "Cpoly");
+  for (gemmi::Entity& ent : st.entities)
+    if (ent.entity_type == gemmi::EntityType::Polymer)
+      ent.full_sequence = std::vector<std::string>(12, "GLY");
+  gemmi::deduplicate_entities(st);
+  REQUIRE_EQ(st.entities.size(), 2);
+  CHECK_EQ(st.entities[0].name, "A");
+  CHECK_EQ(st.entities[0].subchains,
+           std::vector<std::string>({"Apoly", "Bpoly", "Cpoly"}));
+}
+
+TEST_CASE("grid statistics") {
+  std::vector<float> data(100000);
+  for (size_t i = 0; i != data.size(); ++i)
+    data[i] = 1e4f + (float) ((i * 7919) % 1000);  // large mean, small rms
+  gemmi::Variance var(data.begin(), data.end());
+  gemmi::GridStats st = gemmi::calculate_grid_statistics(data);
+  CHECK_EQ(st.dmin, 1e4);
+  CHECK_EQ(st.dmax, 1e4 + 999);
+  CHECK_EQ(st.dmean, doctest::Approx(var.mean_x).epsilon(1e-12));
+  CHECK_EQ(st.rms, doctest::Approx(std::sqrt(var.for_population()))
+                   .epsilon(1e-9));
+  for (int n_threads : {1, 3}) {
+    gemmi::GridStats st2 = gemmi::calculate_grid_statistics(data, n_threads);
+    CHECK_EQ(st2.dmean, st.dmean);
+    CHECK_EQ(st2.rms, st.rms);
+  }
+
+  gemmi::Grid<float> grid;
+  grid.data = data;
+  gemmi::Grid<signed char> mask;
+  mask.data.resize(data.size(), 0);
+  for (size_t i = 0; i < data.size(); i += 2)
+    mask.data[i] = 1;
+  gemmi::Variance masked_var;
+  for (size_t i = 0; i < data.size(); i += 2)
+    masked_var.add_point(data[i]);
+  gemmi::GridStats mst = gemmi::calculate_masked_statistics(grid, mask, 2);
+  CHECK_EQ(mst.dmean, doctest::Approx(masked_var.mean_x).epsilon(1e-12));
+  CHECK_EQ(mst.rms, doctest::Approx(std::sqrt(masked_var.for_population()))
+                    .epsilon(1e-9));
+
+  gemmi::Histogram hist = gemmi::calculate_histogram(data, 10, 1e4, 1e4 + 1000,
+                                                     3);
+  CHECK_EQ(hist.total, data.size());
+  CHECK_EQ(hist.counts[0], data.size() / 10);
+  CHECK_EQ(hist.percentile(50), doctest::Approx(1e4 + 500));
+
+  std::vector<float> sorted = data;
+  std::sort(sorted.begin(), sorted.end());
+  for (size_t n : {(size_t)0, (size_t)1, data.size() / 2, data.size() - 1})
+    for (int n_threads : {1, 4})
+      CHECK_EQ(gemmi::find_nth_smallest(data, n, n_threads), sorted[n]);
+  // a few distinct values, and an outlier that makes bins very wide
+  std::vector<signed char> small(200000, 0);
+  for (size_t i = 0; i < small.size(); i += 3)
+    small[i] = 1;
+  CHECK_EQ(gemmi::find_nth_smallest(small, small.size() / 2), 0);
+  CHECK_EQ(gemmi::find_nth_smallest(small, small.size() - 1), 1);
+  data[12345] = 1e30f;
+  sorted = data;
+  std::sort(sorted.begin(), sorted.end());
+  CHECK_EQ(gemmi::find_nth_smallest(data, 12345), sorted[12345]);
+  CHECK_EQ(gemmi::find_nth_smallest(data, data.size() - 1), 1e30f);
+}
+
+TEST_CASE("resample_grid") {
+  gemmi::Grid<float> grid;
+  grid.set_unit_cell(20, 24, 30, 90, 90, 90);
+  grid.set_size(20, 24, 30);
+  const double pi = 3.14159265358979323846;
+  auto smooth = [&](double x, double y, double z) {
+    return std::cos(2 * pi * x / 20) * std::sin(2 * pi * y / 24) +
+           std::cos(4 * pi * z / 30);
+  };
+  for (int w = 0; w != grid.nw; ++w)
+    for (int v = 0; v != grid.nv; ++v)
+      for (int u = 0; u != grid.nu; ++u)
+        grid.data[grid.index_q(u, v, w)] = (float) smooth(u, v, w);
+
+  gemmi::Grid<float> same = grid;
+  same.fill(0.f);
+  gemmi::resample_grid(grid, same, gemmi::Transform(),
+                       gemmi::Interpolation::Tricubic, 2);
+  for (size_t i = 0; i != grid.data.size(); ++i)
+    CHECK_EQ(same.data[i], doctest::Approx(grid.data[i]).epsilon(1e-5));
+
+  gemmi::Transform shift;
+  shift.vec = gemmi::Vec3(1, 0, 0);
+  gemmi::resample_grid(grid, same, shift, gemmi::Interpolation::Trilinear);
+  CHECK_EQ(same.get_value(19, 3, 4),
+           doctest::Approx(grid.get_value(0, 3, 4)).epsilon(1e-5));
+
+  // between grid points tricubic is closer to the true value
+  double x = 3.3, y = 7.6, z = 11.45;
+  double exact = smooth(x, y, z);
+  double cubic_err = std::fabs(grid.tricubic_interpolation(x, y, z) - exact);
+  double linear_err = std::fabs(grid.trilinear_interpolation(x, y, z) - exact);
+  CHECK(cubic_err < 0.2 * linear_err);
+  CHECK_EQ(grid.interpolate_value(gemmi::Position(x, y, z)),
+           doctest::Approx(grid.trilinear_interpolation(x, y, z)));
+
+  gemmi::BoundingBox box;
+  box.low = gemmi::Vec3(2, 3, 4);
+  box.high = gemmi::Vec3(6, 7, 8);
+  gemmi::Grid<float> ext = gemmi::extract_box(grid, box, 0.5);
+  CHECK_EQ(ext.nu, 8);
+  CHECK_EQ(ext.get_value(2, 4, 6),
+           doctest::Approx(grid.get_value(3, 5, 7)).epsilon(1e-5));
+}
+
+TEST_CASE("calculate_rscc") {
+  gemmi::Model model("1");
+  model.chains.emplace_back("A");
+  for (int i = 0; i != 3; ++i) {
+    gemmi::Residue res;
+    res.name = "ALA";
+    res.seqid.num = i + 1;
+    for (int j = 0; j != 4; ++j) {
+      gemmi::Atom atom;
+      atom.name = "C" + std::to_string(j);
+      atom.element = gemmi::El::C;
+      atom.pos = gemmi::Position(6 + 3.5 * i + 1.2 * j, 10 + (j % 2), 12);
+      res.atoms.push_back(atom);
+    }
+    model.chains[0].residues.push_back(res);
+  }
+  gemmi::UnitCell cell(24, 24, 24, 90, 90, 90);
+  gemmi::Grid<float> map;
+  map.set_unit_cell(cell);
+  map.set_size(48, 48, 48);
+  const double b_blur = 4 * gemmi::sq(2.0);
+  // the last residue is shifted in the "experimental" map
+  gemmi::Model shifted = model;
+  for (gemmi::Atom& atom : shifted.chains[0].residues[2].atoms)
+    atom.pos.y += 1.0;
+  for (int w = 0; w != map.nw; ++w)
+    for (int v = 0; v != map.nv; ++v)
+      for (int u = 0; u != map.nu; ++u) {
+        gemmi::Position pos(u * 0.5, v * 0.5, w * 0.5);
+        double d = 0;
+        for (const gemmi::Residue& res : shifted.chains[0].residues)
+          for (const gemmi::Atom& atom : res.atoms)
+            d += gemmi::GaussianAtom(atom, b_blur)
+                 .density(pos.dist_sq(atom.pos));
+        map.data[map.index_q(u, v, w)] = (float) d;
+      }
+  gemmi::RsccResult r = gemmi::calculate_rscc(model, cell, map, b_blur);
+  REQUIRE_EQ(r.residues.size(), 3);
+  CHECK_GT(r.residues[0].cc.coefficient(), 0.99);
+  CHECK_LT(r.residues[2].cc.coefficient(), 0.9);
+  CHECK_LT(r.residues[2].cc.coefficient(), r.residues[1].cc.coefficient());
+  REQUIRE_EQ(r.chains.size(), 1);
+  double chain_cc = r.chains[0].coefficient();
+  CHECK_LT(chain_cc, r.residues[0].cc.coefficient());
+  CHECK_GT(chain_cc, r.residues[2].cc.coefficient());
+  gemmi::RsccResult r1 = gemmi::calculate_rscc(model, cell, map, b_blur,
+                                               2.0, 1);
+  CHECK_EQ(r1.chains[0].coefficient(), chain_cc);
+  CHECK_EQ(r1.chains[0].n, r.chains[0].n);
+  // each point near the chain is counted once
+  int n_near = 0;
+  for (int w = 0; w != map.nw; ++w)
+    for (int v = 0; v != map.nv; ++v)
+      for (int u = 0; u != map.nu; ++u) {
+        gemmi::Position pos(u * 0.5, v * 0.5, w * 0.5);
+        bool near = false;
+        for (const gemmi::Residue& res : model.chains[0].residues)
+          for (const gemmi::Atom& atom : res.atoms)
+            near = near || pos.dist_sq(atom.pos) < 4.0;
+        n_near += near;
+      }
+  CHECK_EQ(r.chains[0].n, n_near);
+}
+
+TEST_CASE("superpose_positions") {
+  std::vector<gemmi::Position> pos1, pos2;
+  for (int i = 0; i != 50; ++i)
+    pos1.emplace_back(draw(), draw(), draw());
+  // rotation from a unit quaternion
+  double q[4] = {0.5, -0.3, 0.7, 0.1};
+  double len = std::sqrt(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+  for (double& x : q)
+    x /= len;
+  gemmi::Mat33 rot(
+      1 - 2*(q[2]*q[2] + q[3]*q[3]), 2*(q[1]*q[2] - q[0]*q[3]),
+      2*(q[1]*q[3] + q[0]*q[2]),
+      2*(q[1]*q[2] + q[0]*q[3]), 1 - 2*(q[1]*q[1] + q[3]*q[3]),
+      2*(q[2]*q[3] - q[0]*q[1]),
+      2*(q[1]*q[3] - q[0]*q[2]), 2*(q[2]*q[3] + q[0]*q[1]),
+      1 - 2*(q[1]*q[1] + q[2]*q[2]));
+  gemmi::Transform tr{rot, gemmi::Vec3(3, -20, 7)};
+  for (const gemmi::Position& p : pos1)
+    pos2.emplace_back(tr.apply(p));
+  gemmi::SupResult r = gemmi::superpose_positions(pos1.data(), pos2.data(),
+                                                  pos1.size());
+  CHECK_EQ(r.count, 50);
+  CHECK_LT(r.rmsd, 1e-6);
+  CHECK(r.transform.approx(tr.inverse(), 1e-9));
+
+  // with noise, the rmsd is the same as after applying the transform
+  for (gemmi::Position& p : pos2)
+    p += gemmi::Position(0.1 * draw(), 0.1 * draw(), 0.1 * draw());
+  std::vector<double> weights(pos1.size(), 1.);
+  weights[0] = 5;
+  for (const double* w : {(const double*) nullptr,
+                          (const double*) weights.data()}) {
+    r = gemmi::superpose_positions(pos1.data(), pos2.data(), pos1.size(), w);
+    std::vector<gemmi::Position> moved;
+    for (const gemmi::Position& p : pos2)
+      moved.emplace_back(r.transform.apply(p));
+    double rmsd = gemmi::calculate_current_rmsd(pos1.data(), moved.data(),
+                                                pos1.size(), w);
+    CHECK_EQ(r.rmsd, doctest::Approx(rmsd).epsilon(1e-9));
+    CHECK_GT(r.rmsd, 0.1);
+  }
+}
+
+TEST_CASE("calculate_rmsd_matrix") {
+  std::vector<gemmi::Model> models;
+  for (int n = 0; n != 4; ++n) {
+    models.emplace_back(std::to_string(n + 1));
+    models[n].chains.emplace_back("A");
+    for (int i = 0; i != 10; ++i) {
+      gemmi::Residue res;
+      res.name = "GLY";
+      res.seqid.num = i + 1;
+      for (const char* name : {"N", "CA", "C", "O"}) {
+        gemmi::Atom atom;
+        atom.name = name;
+        atom.element = gemmi::Element(std::string(name, 1));
+        // models differ by translation and, from model 3, by a moved atom
+        atom.pos = gemmi::Position(3.8 * i + name[0], i % 3 + name[1], n);
+        if (n >= 2 && i == 5 && atom.name == "CA")
+          atom.pos.z += 1.0;
+        res.atoms.push_back(atom);
+      }
+      models[n].chains[0].residues.push_back(res);
+    }
+  }
+  // atoms that are not present in all models are skipped
+  models[0].chains[0].residues[0].atoms.pop_back();
+  std::vector<gemmi::SupResult> sup =
+      gemmi::superpose_models_onto(models, 0, gemmi::SupSelect::All, 2);
+  CHECK_EQ(sup[0].count, 39);
+  CHECK_LT(sup[1].rmsd, 1e-6);
+  CHECK_GT(sup[2].rmsd, 0.1);
+  std::vector<double> m = gemmi::calculate_rmsd_matrix(
+      models, gemmi::SupSelect::CaP, 3);
+  REQUIRE_EQ(m.size(), 16);
+  CHECK_EQ(m[0 * 4 + 1], doctest::Approx(0.0));
+  CHECK_EQ(m[2 * 4 + 3], doctest::Approx(0.0));
+  CHECK_EQ(m[1 * 4 + 2], m[2 * 4 + 1]);
+  // rmsd after translation only is 0.3, rotation can make it smaller
+  CHECK_LT(m[1 * 4 + 2], 0.3 + 1e-9);
+  CHECK_GT(m[1 * 4 + 2], 0.2);
+}
+
+TEST_CASE("apply_reciprocal_weights") {
+  for (gemmi::HklOrient orient : {gemmi::HklOrient::HKL,
+                                  gemmi::HklOrient::LKH})
+    for (bool half_l : {false, true}) {
+      gemmi::Grid<std::complex<double>> hkl;
+      hkl.set_unit_cell(30, 40, 50, 80, 95, 105);
+      hkl.half_l = half_l;
+      hkl.hkl_orient = orient;
+      hkl.set_size_without_checking(8, 9, half_l ? 6 : 10);
+      hkl.fill(1.0);
+      gemmi::apply_reciprocal_weights(hkl, [](double x) { return x; }, 2);
+      auto index = [](int i, int n, bool half) {
+        return half || 2 * i <= n ? i : i - n;
+      };
+      bool lkh = orient == gemmi::HklOrient::LKH;
+      double max_diff = 0;
+      for (int w = 0; w != hkl.nw; ++w)
+        for (int v = 0; v != hkl.nv; ++v)
+          for (int u = 0; u != hkl.nu; ++u) {
+            int mu = index(u, hkl.nu, half_l && lkh);
+            int mv = index(v, hkl.nv, false);
+            int mw = index(w, hkl.nw, half_l && !lkh);
+            double expected = lkh
+                              ? hkl.unit_cell.calculate_1_d2(mw, mv, mu)
+                              : hkl.unit_cell.calculate_1_d2(mu, mv, mw);
+            double value = hkl.get_value_q(u, v, w).real();
+            max_diff = std::max(max_diff, std::fabs(value - expected));
+          }
+      CHECK_LT(max_diff, 1e-12);
+    }
+}
+
+TEST_CASE("transform_map_to_f_phi_box") {
+  gemmi::Grid<double> map;
+  map.set_unit_cell(30, 40, 50, 80, 95, 105);
+  map.spacegroup = gemmi::find_spacegroup_by_name("P 1");
+  for (int nw : {20, 21}) {
+    map.set_size(12, 15, nw);
+    for (size_t i = 0; i != map.data.size(); ++i)
+      map.data[i] = double((i * 7919) % 101) / 101.;
+    auto hkl = gemmi::transform_map_to_f_phi(map, /*half_l=*/false);
+    for (double d_min : {0., 8.})
+      for (int n_threads : {1, 3}) {
+        gemmi::FPhiBox<double> box =
+          gemmi::transform_map_to_f_phi_box(map, d_min, n_threads);
+        CHECK_EQ(box.max_h, d_min == 0 ? 6 : 3);
+        CHECK_EQ(box.max_k, d_min == 0 ? 7 : 5);
+        CHECK_EQ(box.max_l, d_min == 0 ? 10 : 6);
+        double max_diff = 0;
+        for (int h = -box.max_h; h <= box.max_h; ++h)
+          for (int k = -box.max_k; k <= box.max_k; ++k)
+            for (int l = -box.max_l; l <= box.max_l; ++l) {
+              auto diff = box.get_value(h, k, l) - hkl.get_value(h, k, l);
+              max_diff = std::max(max_diff, std::abs(diff));
+            }
+        CHECK_LT(max_diff, 1e-9);
+      }
+  }
+}
+
+TEST_CASE("calculate_cross_correlation and calculate_patterson") {
+  for (int nw : {8, 9}) {
+    gemmi::Grid<double> a, b;
+    for (gemmi::Grid<double>* g : {&a, &b}) {
+      g->set_unit_cell(20, 25, 30, 90, 100, 90);
+      g->spacegroup = gemmi::find_spacegroup_by_name("P 1");
+      g->set_size(6, 5, nw);
+    }
+    for (size_t i = 0; i != a.data.size(); ++i) {
+      a.data[i] = double((i * 7919) % 101) / 101.;
+      b.data[i] = double((i * 4111) % 53) / 53.;
+    }
+    gemmi::Grid<double> cc = gemmi::calculate_cross_correlation(a, b, 2);
+    gemmi::Grid<double> ac = gemmi::calculate_cross_correlation(a, a, 2);
+    REQUIRE_EQ(cc.data.size(), a.data.size());
+    double max_diff = 0;
+    double max_ac_diff = 0;
+    for (int w = 0; w != a.nw; ++w)
+      for (int v = 0; v != a.nv; ++v)
+        for (int u = 0; u != a.nu; ++u) {
+          double sum = 0, ac_sum = 0;
+          for (int z = 0; z != a.nw; ++z)
+            for (int y = 0; y != a.nv; ++y)
+              for (int x = 0; x != a.nu; ++x) {
+                double ax = a.get_value_q(x, y, z);
+                sum += ax * b.get_value(x + u, y + v, z + w);
+                ac_sum += ax * a.get_value(x + u, y + v, z + w);
+              }
+          size_t n = a.data.size();
+          max_diff = std::max(max_diff, std::fabs(cc.get_value_q(u, v, w) -
+                                                  sum / n));
+          max_ac_diff = std::max(max_ac_diff,
+                                 std::fabs(ac.get_value_q(u, v, w) -
+                                           ac_sum / n));
+        }
+    CHECK_LT(max_diff, 1e-12);
+    CHECK_LT(max_ac_diff, 1e-12);
+    // Patterson = V * autocorrelation of the map without F000
+    double mean = 0;
+    for (double x : a.data)
+      mean += x / a.data.size();
+    gemmi::Grid<double> a0 = a;
+    for (double& x : a0.data)
+      x -= mean;
+    gemmi::Grid<double> ac0 = gemmi::calculate_cross_correlation(a0, a0);
+    gemmi::Grid<double> patt = gemmi::calculate_patterson(
+        gemmi::transform_map_to_f_phi(a, nw % 2 == 0));
+    REQUIRE_EQ(patt.data.size(), a.data.size());
+    double volume = a.unit_cell.volume;
+    max_diff = 0;
+    for (size_t i = 0; i != patt.data.size(); ++i)
+      max_diff = std::max(max_diff,
+                          std::fabs(patt.data[i] - volume * ac0.data[i]));
+    CHECK_LT(max_diff, 1e-8);
+    // removal of the origin peak
+    gemmi::Grid<double> patt_r = gemmi::calculate_patterson(
+        gemmi::transform_map_to_f_phi(a, nw % 2 == 0), 0., true);
+    CHECK_LT(std::fabs(patt_r.data[0]), 0.2 * patt.data[0]);
+  }
+}
+
+TEST_CASE("solvent mask and density modification kernels") {
+  gemmi::Model model("1");
+  model.chains.emplace_back("A");
+  model.chains[0].residues.emplace_back();
+  for (double x : {8.0, 9.5, 11.0}) {
+    gemmi::Atom atom;
+    atom.element = gemmi::El::C;
+    atom.pos = gemmi::Position(x, 10, 10);
+    model.chains[0].residues[0].atoms.push_back(atom);
+  }
+  gemmi::Grid<signed char> mask;
+  mask.set_unit_cell(20, 20, 20, 90, 90, 90);
+  mask.spacegroup = gemmi::find_spacegroup_by_name("P 1");
+  mask.set_size(40, 40, 40);
+  gemmi::SolventMasker masker;
+  masker.put_mask_on_grid(mask, model, 2);
+  CHECK_EQ(mask.get_value(19, 20, 20), 0);  // at an atom
+  CHECK_EQ(mask.get_value(19, 23, 20), 0);  // within vdW radius (1.5A)
+  // 2.5A from the atom: not solvent with the probe, solvent after shrinking
+  CHECK_EQ(mask.get_value(19, 25, 20), 1);
+  CHECK_EQ(mask.get_value(0, 0, 0), 1);
+  masker.rshrink = 0;
+  masker.put_mask_on_grid(mask, model, 2);
+  CHECK_EQ(mask.get_value(19, 25, 20), 0);
+  masker.rshrink = 1.1;
+  masker.put_mask_on_grid(mask, model, 2);
+
+  gemmi::Grid<float> map;
+  map.unit_cell = mask.unit_cell;
+  map.spacegroup = mask.spacegroup;
+  map.set_size(40, 40, 40);
+  for (size_t i = 0; i != map.data.size(); ++i)
+    map.data[i] = (float) ((i * 7919) % 1000) * 0.001f;
+  std::vector<double> reference(11);
+  for (int i = 0; i <= 10; ++i)
+    reference[i] = 2.0 * i * i;  // skewed distribution from 0 to 200
+
+  gemmi::Grid<std::complex<float>> hkl;
+  const std::complex<float>* hkl_data = nullptr;
+  for (int cycle = 0; cycle != 3; ++cycle) {
+    double mean = gemmi::flatten_solvent(map, mask, 2);
+    CHECK_EQ(map.get_value(0, 0, 0), (float) mean);
+    gemmi::match_histogram(map, mask, reference, 4096, 2);
+    std::vector<double> q = gemmi::calculate_macro_quantiles(map, mask, 10);
+    CHECK_EQ(q[0], doctest::Approx(0.).epsilon(0.01));
+    CHECK_EQ(q[5], doctest::Approx(50.).epsilon(0.05));
+    CHECK_EQ(q[10], doctest::Approx(200.).epsilon(0.01));
+    gemmi::transform_map_to_f_phi_(map, hkl, true);
+    if (cycle != 0)
+      CHECK_EQ(hkl.data.data(), hkl_data);  // not reallocated
+    hkl_data = hkl.data.data();
+    gemmi::apply_b_factor(hkl, 10.);
+    gemmi::transform_f_phi_grid_to_map_(std::move(hkl), map);
+  }
+}